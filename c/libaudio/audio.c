@@ -1,5 +1,6 @@
 
 
+#include <assert.h>
 #include "audio.h"
 #include "dsp_algorithms.h"
 #include "dsp_algorithms.c"
@@ -250,28 +251,80 @@ int audio_dry_8samples(volatile _SPM short *xP, volatile _SPM short *yP) {
     return 0;
 }
 
-int alloc_space(unsigned int BASE_ADDR, unsigned int LAST_ADDR) {
+unsigned int alloc_space(unsigned int ALLOC_AMOUNT) {
     int cpuid = get_cpuid();
-    unsigned int ALLOC_AMOUNT = LAST_ADDR - BASE_ADDR;
-    void _SPM *allocret = mp_alloc(ALLOC_AMOUNT);
-    if(allocret == NULL) {
+    unsigned int BASE_ADDR = (unsigned int)mp_alloc(ALLOC_AMOUNT);
+    if(BASE_ADDR == 0) {
         if(cpuid == 0) {
             printf("ERROR ON SPM ALLOCATION\n");
         }
-
-        return 1;
     }
     else {
         if(cpuid == 0) {
             printf("\n");
             printf("Base position at SPM of core %d is 0x%x\n", cpuid, BASE_ADDR);
             printf("%d bytes allocated in SPM of core %d\n", ALLOC_AMOUNT, cpuid);
-            printf("Last free position at SPM of core %d is 0x%x\n", cpuid, LAST_ADDR);
+            printf("Last free position at SPM of core %d is 0x%x\n", cpuid, BASE_ADDR + ALLOC_AMOUNT);
             printf("-------------------DONE!-------------------\n");
         }
+    }
+    return BASE_ADDR;
+}
 
-        return 0;
+//size of the SPM variables of an effect, as laid out by alloc_audio_vars()
+unsigned int audio_vars_size(fx_t FX_TYPE, con_t in_con, con_t out_con, unsigned int RECV_AM, unsigned int SEND_AM, unsigned int IN_SIZE, unsigned int OUT_SIZE) {
+    // FX ID, CPUID, INPUT: in_con, x_pnt, recv_am, xb_size
+    unsigned int size = 5 * sizeof(int) + sizeof(int)*RECV_AM;
+    if ( (in_con == SAME) || (in_con == FIRST) ) { //same core or first
+        size += IN_SIZE * 2 * sizeof(short);
+    }
+    else { //NoC
+        size += sizeof(int)*RECV_AM;
+    }
+    // OUTPUT: out_con, y_pnt, send_am, yb_size
+    size += 3 * sizeof(int) + sizeof(int)*SEND_AM;
+    if(out_con == LAST) {
+        size += OUT_SIZE * 2 * sizeof(short) + sizeof(int) + 2 * sizeof(unsigned int);
+    }
+    else if(out_con == NOC) {
+        size += sizeof(int)*SEND_AM;
+    }
+    // PARAMETERS: pt, s, Nr, Ns, Nf
+    size += 5 * sizeof(int);
+    // FX TYPE and pointer
+    size += sizeof(fx_t) + sizeof(int);
+    switch(FX_TYPE) {
+    case DELAY:
+        size += sizeof(struct IIRdelay);
+        break;
+    case OVERDRIVE:
+        size += sizeof(struct Overdrive);
+        break;
+    case WAHWAH:
+        size += sizeof(struct WahWah);
+        break;
+    case CHORUS:
+        size += sizeof(struct Chorus);
+        break;
+    case DISTORTION:
+        size += sizeof(struct Distortion);
+        break;
+    case HP:
+    case LP:
+    case BP:
+    case BR:
+        size += sizeof(struct Filter);
+        break;
+    case VIBRATO:
+        size += sizeof(struct Vibrato);
+        break;
+    case TREMOLO:
+        size += sizeof(struct Tremolo);
+        break;
+    default:
+        break;
     }
+    return size;
 }
 
 unsigned int alloc_filter_vars(_SPM struct Filter *filtP, unsigned int LAST_ADDR, int Fc, float QorFb, int thisType) {
@@ -661,7 +714,11 @@ int alloc_audio_vars(struct AudioFX *audioP, int FX_ID, fx_t FX_TYPE, con_t in_c
     /*
       LOCATION IN SPM
     */
-    unsigned int BASE_ADDR = (unsigned int)mp_alloc(0);
+    const unsigned int ALLOC_AMOUNT = audio_vars_size(FX_TYPE, in_con, out_con, RECV_AM, SEND_AM, IN_SIZE, OUT_SIZE);
+    unsigned int BASE_ADDR = alloc_space(ALLOC_AMOUNT);
+    if(BASE_ADDR == 0) {
+        return 1;
+    }
     unsigned int LAST_ADDR;
     // FX ID
     const unsigned int ADDR_FXID = BASE_ADDR;
@@ -875,10 +932,10 @@ int alloc_audio_vars(struct AudioFX *audioP, int FX_ID, fx_t FX_TYPE, con_t in_c
         //nothing to do
         break;
     }
-    //update spm_alloc
-    int retval = alloc_space(BASE_ADDR, LAST_ADDR);
+    //the layout must fill exactly the space given by audio_vars_size()
+    assert(LAST_ADDR - BASE_ADDR == ALLOC_AMOUNT);
 
-    return retval;
+    return 0;
 }
 
 int free_audio_vars(struct AudioFX *audioP) {
@@ -916,6 +973,8 @@ int free_audio_vars(struct AudioFX *audioP) {
         //nothing to free
         break;
     }
+    //the SPM variables start at fx_id
+    mp_free((void _SPM *)audioP->fx_id);
 
     return 0;
 }
@@ -39,174 +39,371 @@
 
 #include "mp.h"
 #include "mp_internal.h"
+#include "mp_loopbound.h"
 #include "include/debug.h"
 
+
+////////////////////////////////////////////////////////////////////////////
+// State of the collective functions
+////////////////////////////////////////////////////////////////////////////
+
+/// \brief The collective state of a member in its communication SPM.
+///
+/// The header is followed by arrays of one word per member, in the order
+/// given by #coll_array_t, and by the message buffers of the members. All
+/// members have the same layout, so the remote copy of a flag or a buffer
+/// is at the same offset from the state of the remote member.
+///
+/// A member increments the epoch when it enters a collective function and
+/// writes it to the flags of the other members to signal progress. Each
+/// flag is written by a single member, so one DMA channel orders the writes
+/// to it, and a message arrives before the flag that is written after it.
+typedef struct {
+  unsigned int epoch;
+  unsigned int rank;
+  unsigned int count;
+  unsigned int msg_size;
+} coll_t;
+
+typedef enum {
+  /** The core IDs of the members */
+  COLL_IDS,
+  /** The addresses of the states of the members */
+  COLL_PEERS,
+  /** Barrier flags */
+  COLL_SYNC,
+  /** Flags that tell that a message has arrived */
+  COLL_ARRIVE,
+  /** Flags that tell that the buffers of the receiver are free */
+  COLL_READY,
+  COLL_ARRAYS
+} coll_array_t;
+
+static inline volatile unsigned int _SPM * coll_word(volatile coll_t _SPM * st,
+                              const coll_array_t array, const unsigned int index) {
+  return (volatile unsigned int _SPM *)((unsigned)st + sizeof(coll_t)
+                + (array*st->count + index)*sizeof(unsigned int));
+}
+
+static inline volatile void _SPM * coll_buf(volatile coll_t _SPM * st,
+                                            const unsigned int index) {
+  return (volatile void _SPM *)((unsigned)st + sizeof(coll_t)
+                + COLL_ARRAYS*st->count*sizeof(unsigned int)
+                + index*st->msg_size);
+}
+
+static inline volatile coll_t _SPM * coll_state(communicator_t* comm) {
+  volatile _UNCACHED communicator_t * c = (volatile _UNCACHED communicator_t *)comm;
+  return (volatile coll_t _SPM *)c->addr[get_cpuid()];
+}
+
+/// Indices of members modulo count, without a division
+static inline unsigned int coll_add(const unsigned int a, const unsigned int b,
+                                    const unsigned int count) {
+  unsigned int i = a + b;
+  return i >= count ? i - count : i;
+}
+
+static inline unsigned int coll_sub(const unsigned int a, const unsigned int b,
+                                    const unsigned int count) {
+  return a >= b ? a - b : a + count - b;
+}
+
+/// Returns the index of a core ID, or count if the core is not a member
+static unsigned int coll_index(volatile coll_t _SPM * st, const coreid_t id) {
+  unsigned int i;
+  #pragma loopbound min 1 max COMM_MEMBERS
+  for (i = 0; i < st->count; i++) {
+    if (*coll_word(st, COLL_IDS, i) == (unsigned char)id) {
+      break;
+    }
+  }
+  return i;
+}
+
+/// Returns the distance from a non-zero relative index to its parent in
+/// the binomial tree, the highest power of two that is not larger than v
+static unsigned int coll_parent_dist(const unsigned int v) {
+  unsigned int d = 1;
+  #pragma loopbound min 0 max COMM_ROUNDS
+  while (d*2 <= v) {
+    d <<= 1;
+  }
+  return d;
+}
+
+/// Writes size bytes from src in the local state to dst_offset in the state
+/// of the member index
+static void coll_put(volatile coll_t _SPM * st, const unsigned int index,
+                     const unsigned int dst_offset, volatile void _SPM * src,
+                     const size_t size, coreset_t *sent) {
+  if (size == 0) {
+    return;
+  }
+  unsigned int id = *coll_word(st, COLL_IDS, index);
+  unsigned int peer = *coll_word(st, COLL_PEERS, index);
+  #pragma loopbound min 1 max PKT_TRANS_WAIT
+  while(!noc_nbwrite(id, (volatile void _SPM *)(peer + dst_offset), src, size, 0));
+  coreset_add(id, sent);
+}
+
+/// Sends a message buffer to the same buffer at the member index
+static inline void coll_send(volatile coll_t _SPM * st, const unsigned int index,
+                             volatile void _SPM * buf, const size_t size,
+                             coreset_t *sent) {
+  coll_put(st, index, (unsigned)buf - (unsigned)st, buf, size, sent);
+}
+
+/// Writes the epoch to the flag of the calling member in the flag array
+/// of the member index
+static inline void coll_signal(volatile coll_t _SPM * st, const unsigned int index,
+                               const coll_array_t array, coreset_t *sent) {
+  unsigned int flag = (unsigned)coll_word(st, array, st->rank) - (unsigned)st;
+  coll_put(st, index, flag, &st->epoch, sizeof(unsigned int), sent);
+}
+
+/// Waits until the member index has written the current epoch to its flag
+static inline void coll_wait(volatile coll_t _SPM * st, const coll_array_t array,
+                             const unsigned int index) {
+  volatile unsigned int _SPM * flag = coll_word(st, array, index);
+  unsigned int epoch = st->epoch;
+  #pragma loopbound min 1 max 1
+  while((int)(*flag - epoch) < 0) {
+    /* Spin */
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////
 // Function for initializing collective behavior
 ////////////////////////////////////////////////////////////////////////////
 
 int mp_communicator_init(communicator_t* comm, const unsigned int count,
               const coreid_t member_ids [], const unsigned int msg_size) {
-  return 0;
-}
-
-// Communicator cannot be initialized, initialization scheme needs to be re-written
-//int mp_communicator_init(communicator_t* comm, unsigned count,
-//              const coreid_t member_ids [], unsigned msg_size) {
-//  if (get_cpuid() != NOC_MASTER) {
-//    return 0;
-//  }
-//  comm->count = count;
-//  comm->msg_size = msg_size;
-//  comm->addr = (volatile void _SPM **) malloc(sizeof(void*)*count);
-//
-//  TRACE(INFO,TRUE,"mp_communicator_init(): malloc size %lu\n",sizeof(void*)*count);
-//  
-//  coreset_clearall(&comm->barrier_set);
-//  for (int i = 0; i < count; ++i) {
-//    coreset_add(member_ids[i],&comm->barrier_set);
-//    comm->addr[i] = (volatile void _SPM *) mp_alloc(member_ids[i],count*BARRIER_SIZE+msg_size+FLAG_SIZE);
-//
-//
-//    if (get_cpuid() == member_ids[i]) {
-//      for (int j = 0; j < count; ++j) {
-//        *((volatile unsigned long long _SPM *)((unsigned)comm->addr[i] + (j*BARRIER_SIZE))) = BARRIER_INITIALIZED;
-//      }
-//      *((volatile unsigned long long _SPM *)((unsigned)comm->addr[i] + (count*BARRIER_SIZE) + msg_size)) = FLAG_INVALID;
-//    } else {      
-//      for (int j = 0; j < count; ++j) {
-//        noc_write(member_ids[i],
-//                (volatile int _SPM *)((unsigned)comm->addr[i] + (j*BARRIER_SIZE)),
-//                NOC_SPM_BASE,
-//                BARRIER_SIZE);
-//      }
-//      noc_write(member_ids[i],
-//              (volatile int _SPM *)((unsigned)comm->addr[i] + (count*BARRIER_SIZE) + msg_size),
-//              NOC_SPM_BASE,
-//              BARRIER_SIZE);
-//    }  
-//  }
-//  
-//  return 1;
-//}
+  unsigned int cpuid = get_cpuid();
+  unsigned int rank = count;
+  if (count == 0 || count > COMM_MEMBERS) {
+    TRACE(FAILURE,TRUE,"Communicator size is out of range: count %u\n",count);
+    return 0;
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    if ((unsigned char)member_ids[i] == cpuid) {
+      rank = i;
+    }
+  }
+  if (rank == count) {
+    TRACE(FAILURE,TRUE,"Core %u is not a member of the communicator\n",cpuid);
+    return 0;
+  }
+
+  size_t w_size = WALIGN(msg_size);
+  volatile coll_t _SPM * st = (volatile coll_t _SPM *) mp_alloc(sizeof(coll_t)
+                         + COLL_ARRAYS*count*sizeof(unsigned int) + count*w_size);
+  if (st == NULL) {
+    TRACE(FAILURE,TRUE,"Communicator could not be allocated, SPM out of memory.\n");
+    return 0;
+  }
+  st->epoch = 0;
+  st->rank = rank;
+  st->count = count;
+  st->msg_size = w_size;
+
+  coreset_t barrier_set;
+  coreset_clearall(&barrier_set);
+  for (unsigned int i = 0; i < count; i++) {
+    coreset_add((unsigned char)member_ids[i], &barrier_set);
+    *coll_word(st, COLL_IDS, i) = (unsigned char)member_ids[i];
+    *coll_word(st, COLL_SYNC, i) = 0;
+    *coll_word(st, COLL_ARRIVE, i) = 0;
+    *coll_word(st, COLL_READY, i) = 0;
+  }
+
+  // Publish the state, the other members start writing flags as soon
+  // as they see it
+  volatile _UNCACHED communicator_t * c = (volatile _UNCACHED communicator_t *)comm;
+  c->barrier_set = barrier_set;
+  c->count = count;
+  c->msg_size = w_size;
+  c->addr[cpuid] = st;
+  TRACE(INFO,TRUE,"Core id %u, communicator rank %u, state addr %x\n",cpuid,rank,(unsigned)st);
+
+  // Wait for the states of the other members
+  for (unsigned int i = 0; i < count; i++) {
+    volatile void _SPM * peer;
+    while ((peer = c->addr[(unsigned char)member_ids[i]]) == NULL) {
+      /* Spin */
+    }
+    *coll_word(st, COLL_PEERS, i) = (unsigned)peer;
+  }
+  return 1;
+}
+
+volatile void _SPM * mp_comm_buf(communicator_t* comm, const coreid_t member) {
+  volatile coll_t _SPM * st = coll_state(comm);
+  unsigned int index = coll_index(st, member);
+  if (index == st->count) {
+    return NULL;
+  }
+  return coll_buf(st, index);
+}
 
 ////////////////////////////////////////////////////////////////////////////
 // Functions for collective behaviour
 ////////////////////////////////////////////////////////////////////////////
 
-//static void mp_barrier_int(communicator_t* comm, const unsigned int index){
-//  coreset_t barrier_set = comm->barrier_set;
-//  volatile void _SPM **addr_arr = (volatile void _SPM **)&comm->addr[0];
-//  unsigned local_addr = (unsigned)addr_arr[index];
-//  unsigned count = comm->count;
-//  volatile barrier_t _SPM * addr = (volatile barrier_t _SPM *)(local_addr +
-//                               index*BARRIER_SIZE);
-//  unsigned phase;
-//  switch(*addr){
-//    case BARRIER_PHASE_0:
-//      *addr = BARRIER_PHASE_1;
-//      phase = 1;
-//      break;
-//    case BARRIER_PHASE_1:
-//      *addr = BARRIER_PHASE_2;
-//      phase = 2;
-//      break;
-//    case BARRIER_PHASE_2:
-//      *addr = BARRIER_PHASE_3;
-//      phase = 3;
-//      break;
-//    case BARRIER_PHASE_3:
-//      *addr = BARRIER_PHASE_0;
-//      phase = 0;
-//      break;
-//  }
-//  unsigned local_val = (unsigned)addr + (phase & 1)*sizeof(unsigned);
-//  TRACE(INFO,TRUE,"\tBarrier phase\t%016llx\n\tPhase\t%d\n\tLocal val\t%08x@%08x\n",
-//            *addr,
-//            phase,
-//            *(volatile unsigned _SPM *)local_val,
-//            local_val);
-//  noc_multisend_cs(&barrier_set,addr_arr,index*BARRIER_SIZE,addr,BARRIER_SIZE);
-//  
-//  void * addr_a = (void*)local_addr;
-//  _Pragma("loopbound min 0 max 9")
-//  for(unsigned cpu_index = 0; cpu_index < count; cpu_index++) {
-//    unsigned remote_val = (unsigned)addr_a + cpu_index*BARRIER_SIZE+ (phase & 1)*sizeof(unsigned);
-//    TRACE(INFO,TRUE,"\t--------\n\tCPUIDX\t%u\n\tRemote val\t%08x@%08x\n",
-//              cpu_index,
-//              *(volatile unsigned _SPM *)remote_val,
-//              remote_val);
-//    unsigned comp = *(volatile unsigned _SPM *)local_val;
-//
-//    _Pragma("loopbound min 1 max 1")
-//    while (!(*(volatile unsigned _SPM *)remote_val == comp)) {
-//    }
-//    TRACE(INFO,TRUE,"\tBarrier reached\n");
-//    
-//  }
-//  return;
-//}
-
-//void mp_barrier(communicator_t* comm){
-//  //if(coreset_contains(get_cpuid(),&comm->barrier_set) == 0) {
-//  //  if(get_cpuid() == 0) {
-//  //    printf("mp_barrier(): Bad barrier call!!");
-//  //  }
-//  //}
-//  //DEBUG_CORECHECK(coreset_contains(get_cpuid(),&comm->barrier_set) != 0);
-//  // Something bad happens if mp_barrier() is called by a core
-//  // that is not in the communicator.
-//  unsigned index = 0;
-//  unsigned cpuid = get_cpuid();
-//  coreset_t barrier_set = comm->barrier_set;
-//  for (unsigned i = 0; i < get_cpucnt(); ++i) {
-//    if(coreset_contains(i,&barrier_set) != 0 && i < cpuid) {
-//      index++;
-//    }
-//  }
-//  DEBUGGER("mp_barrier():\n\tIndex\t%d\n",index);
-//  mp_barrier_int(comm,index);
-//  return;
-//}
-//
-//void mp_broadcast(communicator_t* comm, coreid_t root) {
-//  unsigned index = 0;
-//  for (unsigned i = 0; i < get_cpucnt(); ++i) {
-//    if(coreset_contains(i,&comm->barrier_set) != 0 && i < get_cpuid()) {
-//      index++;
-//    }
-//  }
-//  mp_barrier_int(comm,index);
-//  
-//
-//  volatile unsigned _SPM * flag_addr = (volatile unsigned _SPM*)(
-//                                  (unsigned)comm->addr[index]
-//                                           +comm->count*BARRIER_SIZE
-//                                           +comm->msg_size);
-//
-//  DEBUGGER("mp_broadcast():\n\tindex\t%d\n",index);
-//  DEBUGGER("\tflag_addr\t%x\n",(unsigned)flag_addr);
-//  
-//  if (get_cpuid() == root) {
-//    *flag_addr = FLAG_VALID;
-//    volatile unsigned _SPM * src_addr = (volatile unsigned _SPM*)(
-//                                  (unsigned)comm->addr[index]
-//                                           +comm->count*BARRIER_SIZE);
-//    DEBUGGER("\tsrc addr\t%08x\n\tflag val\t%08x\n",(unsigned)src_addr,(unsigned)(*flag_addr));
-//    noc_multisend_cs(&comm->barrier_set,
-//                     (volatile void _SPM **)comm->addr,
-//                     comm->count*BARRIER_SIZE,
-//                     (volatile void _SPM *)src_addr,
-//                     comm->msg_size+BARRIER_SIZE);
-//    noc_wait_dma(comm->barrier_set);
-//  } else {
-//
-//    _Pragma("loopbound min 1 max 1")
-//    while(!(*flag_addr == FLAG_VALID)) {
-//      /* Spin */
-//      DEBUGGER("\tflag value %08x\n",(unsigned)*flag_addr);
-//    }
-//  }
-//  *flag_addr = FLAG_INVALID;
-//  return;
-//}
\ No newline at end of file
+// Dissemination barrier: in the round with distance d, each member signals
+// the member d places after it and waits for the member d places before it.
+void mp_barrier(communicator_t* comm) {
+  volatile coll_t _SPM * st = coll_state(comm);
+  unsigned int count = st->count;
+  unsigned int rank = st->rank;
+  coreset_t sent;
+  coreset_clearall(&sent);
+
+  st->epoch++;
+  #pragma loopbound min 0 max COMM_ROUNDS
+  for (unsigned int d = 1; d < count; d <<= 1) {
+    coll_signal(st, coll_add(rank, d, count), COLL_SYNC, &sent);
+    coll_wait(st, COLL_SYNC, coll_sub(rank, d, count));
+  }
+  noc_wait_dma(sent);
+  return;
+}
+
+// Binomial tree broadcast over the indices relative to the root: the
+// member with relative index v receives from v minus its highest bit and
+// sends to v+d for the powers of two d above that bit.
+void mp_broadcast(communicator_t* comm, const coreid_t root) {
+  volatile coll_t _SPM * st = coll_state(comm);
+  unsigned int count = st->count;
+  unsigned int r = coll_index(st, root);
+  if (r == count) {
+    return;
+  }
+  unsigned int v = coll_sub(st->rank, r, count);
+  volatile void _SPM * buf = coll_buf(st, r);
+  coreset_t sent;
+  coreset_clearall(&sent);
+
+  st->epoch++;
+  unsigned int first = 1;
+  if (v != 0) {
+    unsigned int d = coll_parent_dist(v);
+    unsigned int parent = coll_add(v - d, r, count);
+    coll_signal(st, parent, COLL_READY, &sent);
+    coll_wait(st, COLL_ARRIVE, parent);
+    first = d << 1;
+  }
+  #pragma loopbound min 0 max COMM_ROUNDS
+  for (unsigned int d = first; v + d < count; d <<= 1) {
+    unsigned int child = coll_add(v + d, r, count);
+    coll_wait(st, COLL_READY, child);
+    coll_send(st, child, buf, st->msg_size, &sent);
+    coll_signal(st, child, COLL_ARRIVE, &sent);
+  }
+  noc_wait_dma(sent);
+  return;
+}
+
+static void coll_combine(volatile int _SPM * acc, volatile int _SPM * in,
+                         const unsigned int words, const mp_op_t op) {
+  #pragma loopbound min 0 max MSG_SIZE_WORDS
+  for (unsigned int i = 0; i < words; i++) {
+    int a = acc[i];
+    int b = in[i];
+    switch (op) {
+      case MP_SUM:  a += b; break;
+      case MP_PROD: a *= b; break;
+      case MP_MIN:  a = b < a ? b : a; break;
+      case MP_MAX:  a = b > a ? b : a; break;
+      case MP_AND:  a &= b; break;
+      case MP_OR:   a |= b; break;
+      case MP_XOR:  a ^= b; break;
+    }
+    acc[i] = a;
+  }
+}
+
+// The broadcast tree in reverse: each member combines the partial results
+// of its children, smallest subtree first, and sends its result to the
+// buffer of its index at the parent.
+void mp_reduce(communicator_t* comm, const coreid_t root, const mp_op_t op) {
+  volatile coll_t _SPM * st = coll_state(comm);
+  unsigned int count = st->count;
+  unsigned int r = coll_index(st, root);
+  if (r == count) {
+    return;
+  }
+  // All members have the same message size, so they all return here
+  if (st->msg_size > MSG_SIZE_WORDS*sizeof(int)) {
+    TRACE(FAILURE,TRUE,"Message size is out of range for mp_reduce(): %u\n",st->msg_size);
+    return;
+  }
+  unsigned int v = coll_sub(st->rank, r, count);
+  volatile void _SPM * buf = coll_buf(st, st->rank);
+  coreset_t sent;
+  coreset_clearall(&sent);
+
+  st->epoch++;
+  unsigned int first = 1;
+  unsigned int parent = 0;
+  if (v != 0) {
+    unsigned int d = coll_parent_dist(v);
+    parent = coll_add(v - d, r, count);
+    first = d << 1;
+  }
+  #pragma loopbound min 0 max COMM_ROUNDS
+  for (unsigned int d = first; v + d < count; d <<= 1) {
+    coll_signal(st, coll_add(v + d, r, count), COLL_READY, &sent);
+  }
+  #pragma loopbound min 0 max COMM_ROUNDS
+  for (unsigned int d = first; v + d < count; d <<= 1) {
+    unsigned int child = coll_add(v + d, r, count);
+    coll_wait(st, COLL_ARRIVE, child);
+    coll_combine((volatile int _SPM *)buf, (volatile int _SPM *)coll_buf(st, child),
+                 st->msg_size/sizeof(int), op);
+  }
+  if (v != 0) {
+    coll_wait(st, COLL_READY, parent);
+    coll_send(st, parent, buf, st->msg_size, &sent);
+    coll_signal(st, parent, COLL_ARRIVE, &sent);
+  }
+  noc_wait_dma(sent);
+  return;
+}
+
+// Dissemination allgather: after the round with distance d, a member holds
+// the messages of the 2*d members before it. In each round it sends the
+// messages it holds to the member d places after it, which does not have
+// them yet. Messages stay in the buffers of their members, so a range that
+// wraps around is sent in two transfers.
+void mp_allgather(communicator_t* comm) {
+  volatile coll_t _SPM * st = coll_state(comm);
+  unsigned int count = st->count;
+  unsigned int rank = st->rank;
+  unsigned int msg_size = st->msg_size;
+  coreset_t sent;
+  coreset_clearall(&sent);
+
+  st->epoch++;
+  #pragma loopbound min 0 max COMM_ROUNDS
+  for (unsigned int d = 1; d < count; d <<= 1) {
+    coll_signal(st, coll_sub(rank, d, count), COLL_READY, &sent);
+  }
+  #pragma loopbound min 0 max COMM_ROUNDS
+  for (unsigned int d = 1; d < count; d <<= 1) {
+    unsigned int to = coll_add(rank, d, count);
+    unsigned int n = d < count - d ? d : count - d;
+    unsigned int first = coll_sub(rank, n - 1, count);
+    coll_wait(st, COLL_READY, to);
+    if (first + n <= count) {
+      coll_send(st, to, coll_buf(st, first), n*msg_size, &sent);
+    } else {
+      coll_send(st, to, coll_buf(st, first), (count - first)*msg_size, &sent);
+      coll_send(st, to, coll_buf(st, 0), (first + n - count)*msg_size, &sent);
+    }
+    coll_signal(st, to, COLL_ARRIVE, &sent);
+    coll_wait(st, COLL_ARRIVE, coll_sub(rank, d, count));
+  }
+  noc_wait_dma(sent);
+  return;
+}
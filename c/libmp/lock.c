@@ -43,6 +43,9 @@
 
 LOCK_T * initialize_lock(unsigned remote) {
     LOCK_T * lock = (LOCK_T *)mp_alloc(sizeof(LOCK_T));
+    if (lock == NULL) {
+        return NULL;
+    }
     lock->remote_entering = 0;
     lock->remote_number = 0;
     lock->local_entering = 0;
@@ -119,5 +122,5 @@ void release_lock(LOCK_T * lock) {
 }
 
 void close_lock(LOCK_T * lock) {
-
+    mp_free((void _SPM *)lock);
 }
@@ -48,10 +48,47 @@
 // Functions for library initialization and memory management
 ////////////////////////////////////////////////////////////////////////////
 
-/// These two arrays are initialized by #mp_init() and only modified by
-/// #mp_alloc(), they should not be cached.
-static volatile unsigned int * _UNCACHED spm_alloc_array[MAX_CORES];
-static volatile unsigned int _UNCACHED spm_size_array[MAX_CORES];
+/// \cond PRIVATE
+// The communication SPM is managed as a heap of blocks. Every block
+// starts with a header word that holds the size of the block in bytes,
+// including the header, and the two flags below. Free blocks are kept in
+// doubly linked lists, one for each power of two of the block size, and
+// end with a copy of their size, so that a freed block can be merged with
+// its neighbours in constant time. Blocks are only taken from the
+// unallocated area above the heap when no free list holds a block that
+// is large enough.
+#define SPM_HDR_SIZE   4
+#define SPM_MIN_BLOCK  16
+#define SPM_USED       0x1
+#define SPM_PREV_FREE  0x2
+#define SPM_SIZE_MASK  (~0x3)
+/// The first free list holds blocks of #SPM_MIN_BLOCK bytes or more, the
+/// last one all blocks from 2^(#SPM_CLASSES+3) bytes.
+#define SPM_CLASSES    16
+
+typedef struct {
+  /** The start of the unallocated area */
+  unsigned int top;
+  /** The end of the communication SPM */
+  unsigned int end;
+  /** Bit c is set when free_lists[c] is not empty */
+  unsigned int free_map;
+  /** The number of bytes in free blocks */
+  unsigned int free;
+  /** The number of free blocks */
+  unsigned int free_blocks;
+  /** The header addresses of the first blocks of the free lists */
+  unsigned int free_lists[SPM_CLASSES];
+} spm_heap_t;
+
+#define SPM_WORD(addr) (*(volatile unsigned int _SPM *)(addr))
+#define SPM_NEXT(blk) SPM_WORD((blk) + 4)
+#define SPM_PREV(blk) SPM_WORD((blk) + 8)
+/// \endcond
+
+/// This array is initialized by #mp_init(), the heaps it points to are
+/// in the local communication SPMs. It should not be cached.
+static spm_heap_t _SPM * _UNCACHED spm_heap_array[MAX_CORES];
 
 volatile _UNCACHED chan_info_t chan_info[MAX_CHANNELS];
 
@@ -86,42 +123,212 @@ void mp_init() {
     DEBUGS("Memory failure found");
     abort();
   }
-  // Initialize the size of the SPM
-  spm_size_array[cpuid] = spm_size;
 
-  // Initializing the array of pointers to the beginning of the SPMs
-  spm_alloc_array[cpuid] = (volatile unsigned int * _UNCACHED) NOC_SPM_BASE;
-
-  // Allocate a zero value for remote resetting of values through the NOC
-  barrier_t _SPM * spm_zero = (barrier_t _SPM *) mp_alloc(BARRIER_SIZE);
+  // Reserve a zero value for remote resetting of values through the NOC
+  // at the beginning of the SPM, followed by the state of the heap
+  barrier_t _SPM * spm_zero = (barrier_t _SPM *) NOC_SPM_BASE;
   *spm_zero = BARRIER_INITIALIZED;
+
+  spm_heap_t _SPM * heap = (spm_heap_t _SPM *)((char _SPM *)NOC_SPM_BASE + BARRIER_SIZE);
+  heap->top = (unsigned int)heap + WALIGN(sizeof(spm_heap_t));
+  heap->end = (unsigned int)NOC_SPM_BASE + spm_size;
+  heap->free_map = 0;
+  heap->free = 0;
+  heap->free_blocks = 0;
+  for (int i = 0; i < SPM_CLASSES; ++i) {
+    heap->free_lists[i] = 0;
+  }
+  spm_heap_array[cpuid] = heap;
   return;
 }
 
+/// \brief The integer logarithm of \p x, computed in a fixed number
+/// of steps. \p x must not be zero.
+static unsigned int spm_log2(unsigned int x) {
+  unsigned int log = 0;
+  if (x & 0xFFFF0000) { x >>= 16; log += 16; }
+  if (x & 0xFF00) { x >>= 8; log += 8; }
+  if (x & 0xF0) { x >>= 4; log += 4; }
+  if (x & 0xC) { x >>= 2; log += 2; }
+  if (x & 0x2) { log += 1; }
+  return log;
+}
+
+/// \brief The free list of blocks of \p size bytes.
+static unsigned int spm_class(unsigned int size) {
+  unsigned int cl = spm_log2(size) - spm_log2(SPM_MIN_BLOCK);
+  return cl < SPM_CLASSES ? cl : SPM_CLASSES - 1;
+}
+
+static void spm_insert(spm_heap_t _SPM * heap, unsigned int blk, unsigned int size) {
+  unsigned int cl = spm_class(size);
+  unsigned int head = heap->free_lists[cl];
+  SPM_WORD(blk) = size;
+  SPM_WORD(blk + size - 4) = size;
+  SPM_NEXT(blk) = head;
+  SPM_PREV(blk) = 0;
+  if (head != 0) {
+    SPM_PREV(head) = blk;
+  }
+  heap->free_lists[cl] = blk;
+  heap->free_map |= 1 << cl;
+  heap->free += size;
+  heap->free_blocks++;
+}
+
+static void spm_remove(spm_heap_t _SPM * heap, unsigned int blk) {
+  unsigned int size = SPM_WORD(blk) & SPM_SIZE_MASK;
+  unsigned int cl = spm_class(size);
+  unsigned int next = SPM_NEXT(blk);
+  unsigned int prev = SPM_PREV(blk);
+  if (prev != 0) {
+    SPM_NEXT(prev) = next;
+  } else {
+    heap->free_lists[cl] = next;
+    if (next == 0) {
+      heap->free_map &= ~(1 << cl);
+    }
+  }
+  if (next != 0) {
+    SPM_PREV(next) = prev;
+  }
+  heap->free -= size;
+  heap->free_blocks--;
+}
+
 void _SPM * mp_alloc(const size_t size) {
   // Get cpu ID
   int cpuid = get_cpuid();
-  // Align size to words, this is minimum addressable
-  // amount of data from the noc
-  size_t w_size = WALIGN(size);
-  // Read the new pointer from the array of addresses
-  unsigned int mem_ptr = (unsigned int)spm_alloc_array[cpuid];
-
-  unsigned int new_addr = (unsigned int)((char*)mem_ptr + w_size);
-  // Check if the allocated memory is there
-  if (new_addr < (unsigned int)NOC_SPM_BASE) {
+  spm_heap_t _SPM * heap = spm_heap_array[cpuid];
+  if (heap == NULL) {
     // TODO: Cause disaster (Kernel panic)
     DEBUGS("SPM Alloc failed. SPM not initialized");
     return NULL;
   }
-  if (new_addr > (unsigned int)(spm_size_array[cpuid] + NOC_SPM_BASE)) {
-    // TODO: Cause disaster (Kernel panic)
-    DEBUGS("SPM Alloc failed. No more memory in SPM");
-    return NULL;
+  // Align size to words, this is minimum addressable
+  // amount of data from the noc
+  unsigned int b_size = WALIGN(size) + SPM_HDR_SIZE;
+  if (b_size < SPM_MIN_BLOCK) {
+    b_size = SPM_MIN_BLOCK;
+  }
+  // All blocks in the free lists from the class of the next power of two
+  // up are large enough, except in the last list
+  unsigned int cl = spm_log2(b_size) - spm_log2(SPM_MIN_BLOCK);
+  if (b_size & (b_size - 1)) {
+    cl++;
+  }
+  unsigned int map = cl < SPM_CLASSES ? heap->free_map & (~0U << cl) : 0;
+  unsigned int blk;
+  if (map != 0) {
+    blk = heap->free_lists[spm_log2(map & -map)];
+    unsigned int blk_size = SPM_WORD(blk) & SPM_SIZE_MASK;
+    spm_remove(heap, blk);
+    if (blk_size - b_size >= SPM_MIN_BLOCK) {
+      // Return the rest of the block to the free lists
+      spm_insert(heap, blk + b_size, blk_size - b_size);
+    } else {
+      SPM_WORD(blk + blk_size) &= ~SPM_PREV_FREE;
+      b_size = blk_size;
+    }
+  } else {
+    blk = heap->top;
+    if (b_size > heap->end - blk) {
+      // TODO: Cause disaster (Kernel panic)
+      DEBUGS("SPM Alloc failed. No more memory in SPM");
+      return NULL;
+    }
+    heap->top = blk + b_size;
+  }
+  SPM_WORD(blk) = b_size | SPM_USED;
+  TRACE(INFO,TRUE,"Core id %u, block size %u, allocated addr %x\n",cpuid,b_size,blk + SPM_HDR_SIZE);
+  return (void _SPM *)(blk + SPM_HDR_SIZE);
+}
+
+void mp_free(void _SPM * ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  spm_heap_t _SPM * heap = spm_heap_array[get_cpuid()];
+  unsigned int blk = (unsigned int)ptr - SPM_HDR_SIZE;
+  if (heap == NULL || blk < (unsigned int)heap + WALIGN(sizeof(spm_heap_t)) ||
+      blk >= heap->top || (SPM_WORD(blk) & SPM_USED) == 0) {
+    TRACE(ERROR,TRUE,"SPM free of %x failed, not an allocated block\n",(unsigned int)ptr);
+    return;
+  }
+  unsigned int header = SPM_WORD(blk);
+  unsigned int size = header & SPM_SIZE_MASK;
+  unsigned int next = blk + size;
+  // Merge with the previous block, if it is free
+  if (header & SPM_PREV_FREE) {
+    unsigned int prev_size = SPM_WORD(blk - 4);
+    blk -= prev_size;
+    size += prev_size;
+    spm_remove(heap, blk);
+  }
+  // Merge with the unallocated area or the next block, if it is free.
+  // The block below the unallocated area is never free.
+  if (next == heap->top) {
+    heap->top = blk;
+    return;
+  }
+  unsigned int next_header = SPM_WORD(next);
+  if ((next_header & SPM_USED) == 0) {
+    spm_remove(heap, next);
+    size += next_header & SPM_SIZE_MASK;
+  }
+  spm_insert(heap, blk, size);
+  SPM_WORD(blk + size) |= SPM_PREV_FREE;
+  TRACE(INFO,TRUE,"Core id %u, freed block at %x, size %u\n",get_cpuid(),blk,size);
+}
+
+void mp_spm_stats(mp_spm_stats_t * stats) {
+  spm_heap_t _SPM * heap = spm_heap_array[get_cpuid()];
+  if (heap == NULL) {
+    return;
+  }
+  stats->size = heap->end - (unsigned int)NOC_SPM_BASE;
+  stats->free = heap->free;
+  stats->free_blocks = heap->free_blocks;
+  stats->unallocated = heap->end - heap->top;
+  stats->used = stats->size - stats->free - stats->unallocated;
+  // The largest free block is in the highest non-empty free list
+  unsigned int largest = 0;
+  if (heap->free_map != 0) {
+    unsigned int blk = heap->free_lists[spm_log2(heap->free_map)];
+    while (blk != 0) {
+      unsigned int blk_size = SPM_WORD(blk) & SPM_SIZE_MASK;
+      if (blk_size > largest) {
+        largest = blk_size;
+      }
+      blk = SPM_NEXT(blk);
+    }
+  }
+  if (stats->unallocated > largest) {
+    largest = stats->unallocated;
+  }
+  stats->largest_free = largest > SPM_HDR_SIZE ? largest - SPM_HDR_SIZE : 0;
+  unsigned int avail = stats->free + stats->unallocated;
+  stats->fragmentation = avail > 0 ? 100 - (100 * largest) / avail : 0;
+}
+
+void mp_release_chan(const void _SPM * port_ptr, const direction_t direction_type) {
+  for (int chan_id = 0; chan_id < MAX_CHANNELS; ++chan_id) {
+    if (direction_type == SOURCE && chan_info[chan_id].src_id == get_cpuid() &&
+        (void _SPM *)chan_info[chan_id].src_qpd_ptr == port_ptr) {
+      chan_info[chan_id].src_id = -1;
+      chan_info[chan_id].src_addr = NULL;
+      chan_info[chan_id].src_lock = NULL;
+      chan_info[chan_id].src_qpd_ptr = NULL;
+      return;
+    } else if (direction_type == SINK && chan_info[chan_id].sink_id == get_cpuid() &&
+        (void _SPM *)chan_info[chan_id].sink_qpd_ptr == port_ptr) {
+      chan_info[chan_id].sink_id = -1;
+      chan_info[chan_id].sink_addr = NULL;
+      chan_info[chan_id].sink_lock = NULL;
+      chan_info[chan_id].sink_qpd_ptr = NULL;
+      return;
+    }
   }
-  spm_alloc_array[cpuid] = (volatile unsigned int * _UNCACHED)new_addr;
-  TRACE(INFO,TRUE,"Core id %u, word size %lu, allocated addr %x\n",cpuid,w_size,mem_ptr);
-  return (void _SPM *)mem_ptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////
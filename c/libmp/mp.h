@@ -97,6 +97,8 @@ struct _SPM_LOCK_T {
 LOCK_T * initialize_lock(unsigned remote);
 void acquire_lock(LOCK_T * lock) INLINING;
 void release_lock(LOCK_T * lock) INLINING;
+/// \brief Return the memory of a lock to the communication scratchpad.
+void close_lock(LOCK_T * lock);
 
 /// \struct qpd_t
 /// \brief Queuing port descriptor.
@@ -132,6 +134,13 @@ struct _qpd_t {
       unsigned int send_count;
       /** A pointer to the tail of the receiving queue */
       unsigned int send_ptr;
+      /** The local buffers that mirror the receiving queue */
+      volatile void _SPM * send_bufs;
+      /** The number of buffers reserved by #mp_nbacquire() */
+      unsigned int acquired;
+      /** The number of local buffers, #NUM_WRITE_BUF or, for burst ports,
+          enough to mirror the receiving queue */
+      unsigned int num_send_buf;
     };
     /** Recevier specific fields */
     struct {
@@ -195,19 +204,46 @@ struct _spd_t {
 } ;
 
 
-/// \cond PRIVATE
 /// \struct communicator_t
 /// \brief Describes at set of communicating processors.
 ///
 /// The struct is used to store all necessary information on the set of
-/// communicating processors.
+/// communicating processors. It is shared by all members and must be
+/// zero-initialized, e.g., by declaring it as a global variable.
 typedef struct {
   coreset_t barrier_set;
   unsigned int count;
   unsigned int msg_size;
-  volatile void _SPM ** addr;
+  /** The address of the collective state of each member, indexed by
+      core ID. Only accessed uncached. */
+  volatile void _SPM * addr[CORESET_SIZE];
 } communicator_t __attribute__((aligned(16)));
-/// \endcond
+
+/// \brief The operations that #mp_reduce() can apply to the words of
+/// the messages.
+typedef enum {MP_SUM, MP_PROD, MP_MIN, MP_MAX, MP_AND, MP_OR, MP_XOR} mp_op_t;
+
+/// \struct mp_spm_stats_t
+/// \brief Statistics of the memory in the communication scratchpad of a
+/// core, see #mp_spm_stats().
+typedef struct {
+  /** The size of the communication scratchpad in bytes */
+  size_t size;
+  /** The number of bytes in allocated blocks, including the block headers
+      and the state of the library */
+  size_t used;
+  /** The number of bytes in freed blocks */
+  size_t free;
+  /** The number of freed blocks */
+  unsigned int free_blocks;
+  /** The number of bytes that have never been allocated */
+  size_t unallocated;
+  /** The largest size that #mp_alloc() can currently allocate */
+  size_t largest_free;
+  /** The percentage of the free memory that is not part of the largest
+      free block */
+  unsigned int fragmentation;
+} mp_spm_stats_t;
 
 
 ////////////////////////////////////////////////////////////////////////////
@@ -219,10 +255,37 @@ typedef struct {
 /// #mp_init is a static constructor and not intended to be called directly.
 void mp_init(void) __attribute__((constructor(102),used));
 
-/// \brief Static memory allocation on the communication scratchpad.
-/// No mp_free function
+/// \brief Memory allocation on the communication scratchpad.
+///
+/// The allocation takes constant time. Freed blocks are kept in lists by
+/// the power of two of their size and are reused before memory that has
+/// never been allocated. Each block has a header of one word and is at
+/// least 16 bytes large.
+///
+/// \param size The number of bytes to allocate.
+///
+/// \returns A word aligned pointer to the memory, or NULL if there is not
+/// enough memory left.
 void _SPM * mp_alloc(const size_t size) __attribute__ ((noinline));
 
+/// \brief Return memory allocated by #mp_alloc() to the communication
+/// scratchpad.
+///
+/// The function takes constant time and merges the block with free
+/// neighbouring blocks. Freeing NULL does nothing.
+///
+/// \param ptr The pointer returned by #mp_alloc().
+void mp_free(void _SPM * ptr) __attribute__ ((noinline));
+
+/// \brief Report how the communication scratchpad of the calling core is
+/// used.
+///
+/// Unlike #mp_alloc() and #mp_free(), the function walks one of the free
+/// lists and does not take constant time.
+///
+/// \param stats A pointer to the structure to fill in.
+void mp_spm_stats(mp_spm_stats_t * stats);
+
 ////////////////////////////////////////////////////////////////////////////
 // Functions for initializing the communication channels of the
 // message passing API. The initialization happens in two steps.
@@ -243,6 +306,18 @@ void _SPM * mp_alloc(const size_t size) __attribute__ ((noinline));
 qpd_t * mp_create_qport( const unsigned int chan_id, const direction_t direction_type,
                          const size_t msg_size, const size_t num_buf);
 
+/// \brief Initialize the state of a queuing port that can send bursts
+/// with #mp_nbacquire() and #mp_nbcommit().
+///
+/// Like #mp_create_qport(), but the source keeps a copy of the whole
+/// receiving queue, so it allocates \p num_buf local buffers instead of two.
+/// The sink is the same as for #mp_create_qport().
+///
+/// \return The function returns a pointer to the created message passing
+/// descriptor #qpd_t. If the function fails, the pointer is NULL.
+qpd_t * mp_create_burst_qport(const unsigned int chan_id, const direction_t direction_type,
+                              const size_t msg_size, const size_t num_buf);
+
 /// \brief Initialize the state of a communication channel
 ///
 /// \param qpd_ptr A pointer the the message passing descriptor
@@ -256,24 +331,57 @@ qpd_t * mp_create_qport( const unsigned int chan_id, const direction_t direction
 spd_t * mp_create_sport(const unsigned int chan_id, const direction_t direction_type,
                         const size_t sample_size);
 
+/// \brief Free a queuing port and its buffers.
+///
+/// The channel can afterwards be created again with #mp_create_qport()
+/// and #mp_init_ports(). Both ends of the channel have to be destroyed,
+/// and a source may only be destroyed when all its messages have been
+/// acknowledged, as the sink buffers are reused.
+///
+/// \param qpd_ptr A pointer to the queuing port descriptor.
+void mp_destroy_qport(qpd_t * qpd_ptr);
+
+/// \brief Free a sampling port, its buffers and its lock.
+///
+/// The same rules as for #mp_destroy_qport() apply; no core may be reading
+/// or writing the port.
+///
+/// \param spd_ptr A pointer to the sampling port descriptor.
+void mp_destroy_sport(spd_t * spd_ptr);
+
 /// \breif Initializing all the channels that have been registered.
 ///
 /// \retval 0 The initialization of one or more communication channels failed.
 /// \retval 1 The initialization of all the communication channels succeeded.
 int mp_init_ports();
 
-/// \cond PRIVATE
-/// \brief Initialize the communicator
+/// \brief Initialize a communicator. All members have to call the
+/// function with the same arguments before they use the communicator.
+///
+/// Each member allocates the state of the collective functions and a
+/// message buffer of \p msg_size bytes for each member in its
+/// communication scratchpad. The function returns when all members have
+/// done so.
 ///
 /// \param comm A pointer to the communicator structure
+/// \param count The number of members.
 /// \param member_ids An array of member ids.
-/// \param member_addrs An array of COM SPM addresses for the members.
+/// \param msg_size The size of the message of a member in bytes.
 ///
-/// \retval 0 The address is not aligned  to words.
+/// \retval 0 The calling core is not a member or the allocation failed.
 /// \retval 1 The initialization of the communicator_t succeeded.
 int mp_communicator_init(communicator_t* comm, const unsigned int count,
               const coreid_t member_ids [], const unsigned int msg_size);
-/// \endcond
+
+/// \brief The message buffer of a member in the communication scratchpad
+/// of the calling core.
+///
+/// \param comm A pointer to the communicator struct.
+/// \param member The core ID of the member.
+///
+/// \returns A pointer to the buffer of \p msg_size bytes, or NULL if
+/// \p member is not a member of the communicator.
+volatile void _SPM * mp_comm_buf(communicator_t* comm, const coreid_t member);
 ////////////////////////////////////////////////////////////////////////////
 // Functions for queuing point-to-point transmission of data
 ////////////////////////////////////////////////////////////////////////////
@@ -301,6 +409,8 @@ int mp_nbsend(qpd_t * qpd_ptr) INLINING  ;
 /// \param time_usecs The time out time in microseconds, if parameter is 0
 /// the timeout is infinite
 ///
+/// If #noc_event_enable() has been called on the core and the timeout is
+/// infinite, the core sleeps until an acknowledgement arrives instead of polling.
 /// \retval 0 The function timed out.
 /// \retval 1 The function succeeded sending the message.
 int mp_send(qpd_t * qpd_ptr, const unsigned int time_usecs) INLINING ;
@@ -330,6 +440,8 @@ int mp_nbrecv(qpd_t * qpd_ptr)  INLINING ;
 /// \param time_usecs The time out time in microseconds, if parameter is 0
 /// the timeout is infinite
 ///
+/// If #noc_event_enable() has been called on the core and the timeout is
+/// infinite, the core sleeps until a message arrives instead of polling.
 /// \retval 0 The function timed out.
 /// \retval 1 The function succeeded receiving the message.
 int mp_recv(qpd_t * qpd_ptr, const unsigned int time_usecs)  INLINING ;
@@ -367,6 +479,81 @@ int mp_nback(qpd_t * qpd_ptr) INLINING ;
 int mp_ack(qpd_t * qpd_ptr, const unsigned int time_usecs) INLINING ;
 int mp_ack_n(qpd_t * qpd_ptr, const unsigned int time_usecs, unsigned int num_acks) INLINING ;
 
+////////////////////////////////////////////////////////////////////////////
+// Functions for sending bursts of messages on a queuing port
+//
+// On ports created with #mp_create_burst_qport(), the sender keeps a copy
+// of the receiving queue in its communication scratch pad. #mp_nbacquire()
+// reserves a number of consecutive buffers in the queue, the sender fills
+// them in place and #mp_nbcommit() sends them with a single transfer. The
+// receiver can receive the messages with #mp_recv() and acknowledge all of
+// them with a single #mp_ack_n().
+// A port should not mix these functions with #mp_nbsend().
+////////////////////////////////////////////////////////////////////////////
+
+/// \brief Non-blocking function for reserving buffers in the receiving
+/// queue.
+///
+/// The reservation ends at the end of the queue, the following buffers can
+/// be reserved after the reserved ones are committed. Calling the function
+/// again before #mp_nbcommit() changes the number of reserved buffers.
+///
+/// \param qpd_ptr A pointer to the message passing data structure
+/// for the given message passing channel.
+/// \param num_msgs The number of buffers to reserve.
+///
+/// \returns The number of reserved buffers, at most \p num_msgs. If there
+/// is no free buffer in the receiving queue or the port was not created
+/// with #mp_create_burst_qport() the function returns 0.
+unsigned int mp_nbacquire(qpd_t * qpd_ptr, const unsigned int num_msgs) INLINING ;
+
+/// \brief A function for reserving buffers in the receiving queue, like
+/// #mp_nbacquire(), that waits until at least one buffer is free.
+///
+/// \param qpd_ptr A pointer to the message passing data structure
+/// for the given message passing channel.
+/// \param num_msgs The number of buffers to reserve.
+/// \param time_usecs The time out time in microseconds, if parameter is 0
+/// the timeout is infinite
+///
+/// If #noc_event_enable() has been called on the core and the timeout is
+/// infinite, the core sleeps until an acknowledgement arrives instead of polling.
+/// \returns The number of reserved buffers, 0 if the function timed out
+/// or the port was not created with #mp_create_burst_qport().
+unsigned int mp_acquire(qpd_t * qpd_ptr, const unsigned int num_msgs,
+                        const unsigned int time_usecs) INLINING ;
+
+/// \brief Returns a reserved buffer in the communication scratch pad of the
+/// sender.
+///
+/// \param qpd_ptr A pointer to the message passing data structure
+/// for the given message passing channel.
+/// \param index The index of the buffer, less than the number of reserved
+/// buffers.
+volatile void _SPM * mp_acquired_buf(qpd_t * qpd_ptr, const unsigned int index) INLINING ;
+
+/// \brief Non-blocking function for sending the reserved buffers to the
+/// receiver as one transfer.
+///
+/// \param qpd_ptr A pointer to the message passing data structure
+/// for the given message passing channel.
+///
+/// \retval 0 There was no free DMA to start the transfer.
+/// \retval 1 The reserved buffers have been sent.
+int mp_nbcommit(qpd_t * qpd_ptr) INLINING ;
+
+/// \brief A function for sending the reserved buffers to the receiver as
+/// one transfer.
+///
+/// \param qpd_ptr A pointer to the message passing data structure
+/// for the given message passing channel.
+/// \param time_usecs The time out time in microseconds, if parameter is 0
+/// the timeout is infinite
+///
+/// \retval 0 The function timed out.
+/// \retval 1 The reserved buffers have been sent.
+int mp_commit(qpd_t * qpd_ptr, const unsigned int time_usecs) INLINING ;
+
 ////////////////////////////////////////////////////////////////////////////
 // Functions for sampling point-to-point transmission of data
 ////////////////////////////////////////////////////////////////////////////
@@ -392,12 +579,19 @@ int mp_read(spd_t * sport, volatile void _SPM * sample)   __attribute__ ((noinli
 ////////////////////////////////////////////////////////////////////////////
 // Functions for collective communication
 ////////////////////////////////////////////////////////////////////////////
-/// \cond PRIVATE
+/// The collective functions have to be called by all members of a
+/// communicator in the same order. They take a logarithmic number of rounds
+/// in the number of members, in each round a member transfers at most one
+/// message. A member returns when its part of the communication has
+/// completed. Messages are placed in the buffers returned by
+/// #mp_comm_buf() and stay valid until the member calls the next
+/// collective function on the communicator.
+
 /// \brief A function to synchronize the cores described in the communicator
 /// to a barrier.
 ///
 /// \param comm A pointer to the communicator struct that describes 
-/// the group of processing cores involved in the broadcast.
+/// the group of processing cores involved in the barrier.
 ///
 /// \returns The function returns after all processing cores has
 /// called at the barrier function.
@@ -406,6 +600,9 @@ void mp_barrier(communicator_t* comm);
 /// \brief A function for broadcasting a message to all members of
 /// a communicator
 ///
+/// The root places the message in its buffer, the other members receive it
+/// in the buffer of the root.
+///
 /// \param comm A pointer to the communicator struct that describes 
 /// the group of processing cores involved in the broadcast.
 /// \param root The core ID of the processing core that should broadcast
@@ -416,7 +613,36 @@ void mp_barrier(communicator_t* comm);
 /// the other cores and in the other cores when each core has received the data
 /// from the #root core
 void mp_broadcast(communicator_t* comm, const coreid_t root);
-/// \endcond
+
+/// \brief A function for combining the messages of all members of a
+/// communicator in the root.
+///
+/// Each member places its message in its own buffer. The messages are
+/// combined word by word with \p op and the result is placed in the buffer
+/// of the root at the root. The buffers of the other members are
+/// overwritten with partial results.
+///
+/// The message size of the communicator must not exceed MSG_SIZE_WORDS
+/// words, the bound used for the timing analysis (64 unless defined
+/// otherwise when compiling the library). With larger messages the
+/// function does nothing.
+///
+/// \param comm A pointer to the communicator struct that describes 
+/// the group of processing cores involved in the reduction.
+/// \param root The core ID of the processing core that receives the
+/// result. All members have to specify the same #root core ID.
+/// \param op The operation applied to the words of the messages.
+void mp_reduce(communicator_t* comm, const coreid_t root, const mp_op_t op);
+
+/// \brief A function for exchanging the messages of all members of a
+/// communicator.
+///
+/// Each member places its message in its own buffer. When the function
+/// returns, the buffers of all members contain their messages.
+///
+/// \param comm A pointer to the communicator struct that describes 
+/// the group of processing cores involved in the exchange.
+void mp_allgather(communicator_t* comm);
 
 #endif /* _MP_H_ */
 
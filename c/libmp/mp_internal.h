@@ -141,6 +141,10 @@ struct _chan_info_t {
 
 extern volatile _UNCACHED chan_info_t chan_info[MAX_CHANNELS];
 
+/// \brief Remove a port of the calling core from #chan_info, so that the
+/// channel can be created again.
+void mp_release_chan(const void _SPM * port_ptr, const direction_t direction_type);
+
 size_t mp_send_alloc_size(qpd_t * qpd_ptr);
 
 size_t mp_recv_alloc_size(qpd_t * qpd_ptr);
@@ -66,4 +66,15 @@
 #define SAMPLE_TRANS_WAIT 768
 #endif
 
+/// \brief The maximum number of rounds of the collective functions, the
+/// base 2 logarithm of the largest communicator, rounded up.
+#ifndef COMM_ROUNDS
+#define COMM_ROUNDS 5
+#endif
+
+/// \brief The maximum number of members of a communicator.
+#ifndef COMM_MEMBERS
+#define COMM_MEMBERS CORESET_SIZE
+#endif
+
 #endif /* _MP_LOOPBOUND_H_ */
\ No newline at end of file
@@ -39,14 +39,16 @@
 
  #include "mp.h"
  #include "mp_internal.h"
+ #include "mp_loopbound.h"
 
 ////////////////////////////////////////////////////////////////////////////
 // Function for creating a queuing port 
 ////////////////////////////////////////////////////////////////////////////
-qpd_t * mp_create_qport(const unsigned int chan_id,
-                        const direction_t direction_type,
-                        const size_t msg_size,
-                        const size_t num_buf) {
+static qpd_t * create_qport(const unsigned int chan_id,
+                            const direction_t direction_type,
+                            const size_t msg_size,
+                            const size_t num_buf,
+                            const size_t num_send_buf) {
   if (chan_id >= MAX_CHANNELS) {
     TRACE(FAILURE,TRUE,"Channel id is out of range: chan_id %d\n",chan_id);
     return NULL;
@@ -67,15 +69,17 @@ qpd_t * mp_create_qport(const unsigned int chan_id,
   chan_info[chan_id].port_type = QUEUING;
 
   if (direction_type == SOURCE) {
+    qpd_ptr->num_send_buf = num_send_buf;
     unsigned int _SPM * send_addr = (unsigned int _SPM *)mp_alloc(mp_send_alloc_size(qpd_ptr));
     TRACE(INFO,TRUE,"Initializing SOURCE port addr : %#08x\n",(unsigned int)send_addr);
     
     if (send_addr == NULL) {
       TRACE(FAILURE,TRUE,"SPM allocation failed at SOURCE\n");
+      mp_free((void _SPM *)qpd_ptr);
       return NULL;
     }
 
-    int send_recv_count_offset = (qpd_ptr->buf_size + FLAG_SIZE) * NUM_WRITE_BUF;
+    int send_recv_count_offset = (qpd_ptr->buf_size + FLAG_SIZE) * qpd_ptr->num_send_buf;
     qpd_ptr->send_recv_count = (volatile unsigned int _SPM *)((char*)send_addr + send_recv_count_offset);
 
     // src_desc_ptr must be set first inorder for
@@ -94,7 +98,9 @@ qpd_t * mp_create_qport(const unsigned int chan_id,
     // Initialize send count to 0 and recv count to 0.
     qpd_ptr->send_count = 0;
     qpd_ptr->send_ptr = 0;
+    qpd_ptr->acquired = 0;
     
+    qpd_ptr->send_bufs = (volatile void _SPM *)send_addr;
     qpd_ptr->write_buf = (volatile void _SPM *)send_addr;
     qpd_ptr->shadow_write_buf = (volatile void _SPM *)((char*)send_addr + (qpd_ptr->buf_size + FLAG_SIZE));
 
@@ -112,6 +118,8 @@ qpd_t * mp_create_qport(const unsigned int chan_id,
 
     if (qpd_ptr->recv_addr == NULL) {
       TRACE(FAILURE,TRUE,"SPM allocation failed at SINK\n");
+      mp_release_chan(qpd_ptr, SINK);
+      mp_free((void _SPM *)qpd_ptr);
       return NULL;
     }
 
@@ -144,6 +152,32 @@ qpd_t * mp_create_qport(const unsigned int chan_id,
   return qpd_ptr;
 }
 
+qpd_t * mp_create_qport(const unsigned int chan_id,
+                        const direction_t direction_type,
+                        const size_t msg_size,
+                        const size_t num_buf) {
+  return create_qport(chan_id, direction_type, msg_size, num_buf, NUM_WRITE_BUF);
+}
+
+qpd_t * mp_create_burst_qport(const unsigned int chan_id,
+                              const direction_t direction_type,
+                              const size_t msg_size,
+                              const size_t num_buf) {
+  // The local buffers mirror the receiving queue
+  size_t num_send_buf = num_buf > NUM_WRITE_BUF ? num_buf : NUM_WRITE_BUF;
+  return create_qport(chan_id, direction_type, msg_size, num_buf, num_send_buf);
+}
+
+void mp_destroy_qport(qpd_t * qpd_ptr) {
+  mp_release_chan(qpd_ptr, qpd_ptr->direction_type);
+  if (qpd_ptr->direction_type == SOURCE) {
+    mp_free((void _SPM *)qpd_ptr->send_bufs);
+  } else {
+    mp_free((void _SPM *)qpd_ptr->recv_addr);
+  }
+  mp_free((void _SPM *)qpd_ptr);
+}
+
 
 ////////////////////////////////////////////////////////////////////////////
 // Functions for point-to-point transmission of data
@@ -191,7 +225,14 @@ int mp_send(qpd_t * qpd_ptr, const unsigned int time_usecs) {
   _Pragma("loopbound min 1 max 1")
   // while message not sent and ( timeout infinite or now is before timeout)
   while(retval == 0 && ( time_usecs == 0 || get_cpu_usecs() < timeout ) ) {
+    unsigned int events = noc_event_count();
     retval = mp_nbsend(qpd_ptr);
+    // A busy DMA raises no interrupt, only sleep when the queue is full
+    if (retval == 0 && time_usecs == 0 &&
+        (qpd_ptr->send_count) - *(qpd_ptr->send_recv_count) == qpd_ptr->num_buf) {
+      // Sleep until an acknowledgement arrives, see noc_event_enable()
+      noc_event_wait(events);
+    }
   }
   TRACE(FAULT,retval == 0,"mp_send() timed out");
   return retval;
@@ -234,7 +275,12 @@ int mp_recv(qpd_t * qpd_ptr, const unsigned int time_usecs) {
   _Pragma("loopbound min 1 max 1")
   // while message not received and ( timeout infinite or now is before timeout)
   while(retval == 0 && ( time_usecs == 0 || get_cpu_usecs() < timeout ) ) {
+    unsigned int events = noc_event_count();
     retval = mp_nbrecv(qpd_ptr);
+    if (retval == 0 && time_usecs == 0) {
+      // Sleep until a message arrives, see noc_event_enable()
+      noc_event_wait(events);
+    }
   }
   TRACE(FAULT,retval == 0,"mp_recv() timed out");
   return retval;
@@ -293,3 +339,103 @@ int mp_ack_n(qpd_t * qpd_ptr, const unsigned int time_usecs, unsigned int num_ac
   return retval;
 }
 
+////////////////////////////////////////////////////////////////////////////
+// Functions for sending bursts of messages
+////////////////////////////////////////////////////////////////////////////
+
+unsigned int mp_nbacquire(qpd_t * qpd_ptr, const unsigned int num_msgs) {
+  if (qpd_ptr->num_send_buf < qpd_ptr->num_buf) {
+    TRACE(FAILURE,TRUE,"Port was not created with mp_create_burst_qport()\n");
+    return 0;
+  }
+  // The free buffers in the receiving queue, up to the end of the queue
+  unsigned int free_bufs = qpd_ptr->num_buf - (qpd_ptr->send_count - *(qpd_ptr->send_recv_count));
+  unsigned int to_end = qpd_ptr->num_buf - qpd_ptr->send_ptr;
+  unsigned int n = num_msgs;
+  if (n > free_bufs) {
+    n = free_bufs;
+  }
+  if (n > to_end) {
+    n = to_end;
+  }
+  qpd_ptr->acquired = n;
+  TRACE(INFO,n == 0,"NO room in queue\n");
+  return n;
+}
+
+unsigned int mp_acquire(qpd_t * qpd_ptr, const unsigned int num_msgs,
+                        const unsigned int time_usecs) {
+  unsigned long long int timeout = get_cpu_usecs() + time_usecs;
+  unsigned int retval = 0;
+  if (qpd_ptr->num_send_buf < qpd_ptr->num_buf) {
+    TRACE(FAILURE,TRUE,"Port was not created with mp_create_burst_qport()\n");
+    return 0;
+  }
+  // REM: The worst case waiting time of the mp_nbacquire() must
+  // be added after the WCET analysis
+  _Pragma("loopbound min 1 max 1")
+  // while no buffer reserved and ( timeout infinite or now is before timeout)
+  while(retval == 0 && ( time_usecs == 0 || get_cpu_usecs() < timeout ) ) {
+    unsigned int events = noc_event_count();
+    retval = mp_nbacquire(qpd_ptr, num_msgs);
+    if (retval == 0 && time_usecs == 0) {
+      // Sleep until an acknowledgement arrives, see noc_event_enable()
+      noc_event_wait(events);
+    }
+  }
+  TRACE(FAULT,retval == 0,"mp_acquire() timed out");
+  return retval;
+}
+
+volatile void _SPM * mp_acquired_buf(qpd_t * qpd_ptr, const unsigned int index) {
+  // The local buffers have the same layout as the receiving queue
+  int offset = (qpd_ptr->buf_size + FLAG_SIZE) * (qpd_ptr->send_ptr + index);
+  return (volatile void _SPM *)((char*)qpd_ptr->send_bufs + offset);
+}
+
+int mp_nbcommit(qpd_t * qpd_ptr) {
+  unsigned int n = qpd_ptr->acquired;
+  if (n == 0) {
+    return 1;
+  }
+  // Set the flags of the reserved buffers
+  #pragma loopbound min 1 max NUM_BUF
+  for (unsigned int i = 0; i < n; i++) {
+    volatile void _SPM * buf = mp_acquired_buf(qpd_ptr, i);
+    *(volatile int _SPM *)((char*)buf + qpd_ptr->buf_size) = FLAG_VALID;
+  }
+
+  // Send the reserved buffers, flags included, to the same place
+  // in the receiving queue
+  int rmt_addr_offset = (qpd_ptr->buf_size + FLAG_SIZE) * qpd_ptr->send_ptr;
+  volatile void _SPM * calc_rmt_addr = &qpd_ptr->recv_addr[rmt_addr_offset];
+  if (!noc_nbwrite(qpd_ptr->remote,calc_rmt_addr,mp_acquired_buf(qpd_ptr, 0),
+                   (qpd_ptr->buf_size + FLAG_SIZE) * n, 1)) {
+    TRACE(INFO,TRUE,"NO DMA free\n");
+    return 0;
+  }
+
+  // Increment the send counter and move the send pointer
+  qpd_ptr->send_count += n;
+  qpd_ptr->send_ptr += n;
+  if (qpd_ptr->send_ptr == qpd_ptr->num_buf) {
+    qpd_ptr->send_ptr = 0;
+  }
+  qpd_ptr->acquired = 0;
+
+  return 1;
+}
+
+int mp_commit(qpd_t * qpd_ptr, const unsigned int time_usecs) {
+  unsigned long long int timeout = get_cpu_usecs() + time_usecs;
+  int retval = 0;
+  // REM: The worst case waiting time of the mp_nbcommit() must
+  // be added after the WCET analysis
+  _Pragma("loopbound min 1 max 1")
+  // while buffers not sent and ( timeout infinite or now is before timeout)
+  while(retval == 0 && ( time_usecs == 0 || get_cpu_usecs() < timeout ) ) {
+    retval = mp_nbcommit(qpd_ptr);
+  }
+  TRACE(FAULT,retval == 0,"mp_commit() timed out");
+  return retval;
+}
@@ -157,6 +157,26 @@ spd_t * mp_create_sport(const unsigned int chan_id,
   #endif
 }
 
+void mp_destroy_sport(spd_t * spd_ptr) {
+  #if IMPL != MULTI_NOC_MP
+    mp_release_chan(spd_ptr, spd_ptr->direction_type);
+    if (spd_ptr->direction_type == SOURCE) {
+      #if IMPL == SINGLE_SHM
+        free((void *)spd_ptr->read_shm_buf);
+      #endif
+    } else if (spd_ptr->direction_type == SINK) {
+      #if IMPL != SINGLE_SHM
+        mp_free((void _SPM *)spd_ptr->read_bufs);
+      #endif
+    }
+    close_lock(spd_ptr->lock);
+    mp_free((void _SPM *)spd_ptr);
+
+  #elif IMPL == MULTI_NOC_MP
+    mp_destroy_qport((qpd_t *)spd_ptr);
+  #endif
+}
+
 static inline void mem_copy(int _SPM * to, int _SPM * from, int bytes){
   // Since we want to copy 32 bit at the time we divide bytes by 4
   unsigned itteration_count = (bytes + 4 - 1) / 4; // equal to ceil(bytes/4)
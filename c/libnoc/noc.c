@@ -122,8 +122,8 @@ int k_noc_configure(void) {
   k_noc_state_set(0); // Make sure that the network is disabled
   ret = k_noc_sched_load();
   
-  exc_register(18,&__data_recv_handler);
-  exc_register(19,&__remote_irq_handler);
+  exc_register(NOC_DATA_IRQ,&__data_recv_handler);
+  exc_register(NOC_REMOTE_IRQ,&__remote_irq_handler);
 #ifdef TRAP
   exc_register(8,&__noc_trap_handler);
 #endif
@@ -526,6 +526,43 @@ void noc_multisend_cs(coreset_t *receivers, volatile void _SPM *dst[],
 //  } while(!done);
 //}
 
+// Transfer data from main memory via the NoC
+// The addresses and the size are in bytes
+int noc_stream_write(unsigned dma_id, volatile void _SPM *dst,
+                     const void *src, size_t size,
+                     volatile void _SPM *staging, size_t staging_size) {
+  size_t chunk = (staging_size / 2) & ~0x3;
+  if (chunk == 0) {
+    return 0;
+  }
+  volatile char _SPM *bufs[2];
+  bufs[0] = (volatile char _SPM *)staging;
+  bufs[1] = (volatile char _SPM *)staging + chunk;
+  int aligned = ((unsigned)src & 0x3) == 0;
+  unsigned i = 0;
+  for (size_t offset = 0; offset < size; offset += chunk) {
+    size_t n = size - offset < chunk ? size - offset : chunk;
+    // The transfer of the previous chunk was only started after the
+    // transfer from the same buffer had finished, so it is free now
+    volatile char _SPM *buf = bufs[i & 1];
+    const char *from = (const char *)src + offset;
+    size_t k = 0;
+    if (aligned) {
+      for (; k + 4 <= n; k += 4) {
+        *(volatile unsigned _SPM *)(buf + k) = *(const unsigned *)(from + k);
+      }
+    }
+    for (; k < n; k++) {
+      buf[k] = from[k];
+    }
+    noc_write(dma_id, (volatile char _SPM *)dst + offset, buf, n, 0);
+    i++;
+  }
+  _Pragma("loopbound min 1 max 1")
+  while(!noc_dma_done(dma_id));
+  return 1;
+}
+
 void noc_wait_dma(coreset_t receivers) {
   int index = 0;
   for (unsigned i = 0; i < NOC_CORES; ++i) {
@@ -537,12 +574,129 @@ void noc_wait_dma(coreset_t receivers) {
   } 
 }
 
+// The states of an entry in the transfer queue
+#define NOC_REQ_PENDING 0
+#define NOC_REQ_ISSUED  1
+#define NOC_REQ_DONE    2
+
+typedef struct {
+  volatile void _SPM *dst;
+  volatile void _SPM *src;
+  size_t size;
+  noc_callback_t callback;
+  void *arg;
+  unsigned short dma_id;
+  unsigned char irq_enable;
+  unsigned char state;
+} noc_req_t;
+
+// The transfer queue of a core. The token of a transfer is its sequence
+// number, tail is the oldest transfer that has not been retired and head
+// the next token.
+typedef struct {
+  unsigned int head;
+  unsigned int tail;
+  noc_req_t reqs[NOC_QUEUE_SIZE];
+} noc_queue_t;
+
+static _UNCACHED noc_queue_t noc_queues[MAX_CORES];
+
+unsigned int noc_progress(void) {
+  _UNCACHED noc_queue_t *q = &noc_queues[get_cpuid()];
+  // The receivers that already have an earlier transfer in flight or waiting
+  coreset_t busy;
+  coreset_clearall(&busy);
+  unsigned int tail = q->tail;
+  unsigned int head = q->head;
+  #pragma loopbound min 0 max NOC_QUEUE_SIZE
+  for (unsigned int t = tail; t != head; t++) {
+    _UNCACHED noc_req_t *req = &q->reqs[t % NOC_QUEUE_SIZE];
+    if (req->state == NOC_REQ_ISSUED) {
+      if (noc_dma_done(req->dma_id)) {
+        req->state = NOC_REQ_DONE;
+        if (req->callback != NULL) {
+          req->callback(req->arg);
+        }
+      } else {
+        coreset_add(req->dma_id, &busy);
+      }
+    } else if (req->state == NOC_REQ_PENDING) {
+      if (!coreset_contains(req->dma_id, &busy) &&
+          noc_nbwrite(req->dma_id, req->dst, req->src, req->size, req->irq_enable)) {
+        req->state = NOC_REQ_ISSUED;
+      }
+      coreset_add(req->dma_id, &busy);
+    }
+  }
+  // Retire the finished transfers at the tail
+  #pragma loopbound min 0 max NOC_QUEUE_SIZE
+  while (tail != head && q->reqs[tail % NOC_QUEUE_SIZE].state == NOC_REQ_DONE) {
+    tail++;
+  }
+  q->tail = tail;
+  return head - tail;
+}
+
+noc_token_t noc_enqueue(unsigned dma_id, volatile void _SPM *dst,
+                        volatile void _SPM *src, size_t size,
+                        unsigned irq_enable,
+                        noc_callback_t callback, void *arg) {
+  _UNCACHED noc_queue_t *q = &noc_queues[get_cpuid()];
+  // Wait for a free entry if the queue is full
+  _Pragma("loopbound min 1 max 1")
+  while (q->head - q->tail == NOC_QUEUE_SIZE) {
+    noc_progress();
+  }
+  noc_token_t token = q->head;
+  _UNCACHED noc_req_t *req = &q->reqs[token % NOC_QUEUE_SIZE];
+  req->dst = dst;
+  req->src = src;
+  req->size = size;
+  req->callback = callback;
+  req->arg = arg;
+  req->dma_id = dma_id;
+  req->irq_enable = irq_enable != 0;
+  req->state = NOC_REQ_PENDING;
+  q->head = token + 1;
+  noc_progress();
+  return token;
+}
+
+int noc_done(noc_token_t token) {
+  _UNCACHED noc_queue_t *q = &noc_queues[get_cpuid()];
+  // Transfers before the tail have been retired
+  if ((int)(token - q->tail) < 0 || (int)(token - q->head) >= 0) {
+    return 1;
+  }
+  return q->reqs[token % NOC_QUEUE_SIZE].state == NOC_REQ_DONE;
+}
+
+void noc_wait(noc_token_t token) {
+  _Pragma("loopbound min 1 max 1")
+  while (!noc_done(token)) {
+    noc_progress();
+  }
+}
+
+void noc_flush(void) {
+  _Pragma("loopbound min 1 max 1")
+  while (noc_progress() != 0);
+}
+
+// Writing to this register of the exception unit puts the core to sleep
+#define EXC_SLEEP (*((volatile _IODEV unsigned *)(PATMOS_IO_EXCUNIT+0x10)))
+
+// The number of NoC interrupts per core, counted by the exception handlers
+static volatile _UNCACHED unsigned int noc_events[MAX_CORES];
+static volatile _UNCACHED unsigned int noc_events_enabled[MAX_CORES];
+
 void __remote_irq_handler(void)  __attribute__((naked));
 void __remote_irq_handler(void) {
   exc_prologue();
   //WRITE("IRQ0\n",5);
+  // Pop the address of the interrupt from the FIFO
   int tmp = *(NOC_IRQ_BASE);
-  *(NOC_SPM_BASE+(tmp<<2)) = 0;
+  noc_events[get_cpuid()]++;
   intr_clear_pending(exc_get_source());
   exc_epilogue();
 }
@@ -551,12 +705,52 @@ void __data_recv_handler(void) __attribute__((naked));
 void __data_recv_handler(void) {
   exc_prologue();
   //WRITE("IRQ1\n",5); 
+  // Pop the address of the transfer from the FIFO
   int tmp = *(NOC_IRQ_BASE+1);
-  *(NOC_SPM_BASE+(tmp<<2)) = 0;
+  noc_events[get_cpuid()]++;
   intr_clear_pending(exc_get_source());
   exc_epilogue();
 }
 
+void noc_event_enable(void) {
+  // The handlers are only registered on the core that ran noc_init()
+  exc_register(NOC_DATA_IRQ,&__data_recv_handler);
+  exc_register(NOC_REMOTE_IRQ,&__remote_irq_handler);
+  intr_unmask(NOC_DATA_IRQ);
+  intr_unmask(NOC_REMOTE_IRQ);
+  noc_events_enabled[get_cpuid()] = 1;
+  // The interrupts must be enabled globally to run the handlers
+  intr_enable();
+}
+
+void noc_event_disable(void) {
+  noc_events_enabled[get_cpuid()] = 0;
+  intr_mask(NOC_DATA_IRQ);
+  intr_mask(NOC_REMOTE_IRQ);
+}
+
+unsigned int noc_event_count(void) {
+  return noc_events[get_cpuid()];
+}
+
+void noc_event_wait(unsigned int count) {
+  unsigned id = get_cpuid();
+  if (!noc_events_enabled[id]) {
+    return;
+  }
+  // Check and sleep with interrupts disabled, so an interrupt cannot
+  // slip in between. The core also wakes up on a pending interrupt when
+  // interrupts are disabled, the handler runs when they are enabled again.
+  // Restore the status afterwards, so a caller that runs with interrupts
+  // disabled keeps them disabled.
+  unsigned status = EXC_STATUS;
+  intr_disable();
+  if (noc_events[id] == count) {
+    EXC_SLEEP = 0;
+  }
+  EXC_STATUS = status;
+}
+
 #ifdef TRAP
 
 int _noc_trap_handler(unsigned int op,
@@ -296,11 +296,147 @@ void noc_multisend_cs(coreset_t *receivers,
                       size_t size,
                       unsigned irq_enable);
 
+/// \brief Transfer data from main memory via the NoC (blocking).
+///
+/// The data is copied in chunks into a staging area in the communication
+/// SPM of the calling core and sent from there. The staging area is
+/// split into two buffers, so the next chunk is copied while the previous
+/// one is being sent. The function returns when all data has been sent.
+///
+/// The size is in bytes and rounded up to words, like for #noc_write().
+/// \param dma_id The core id of the receiver.
+/// \param dst A pointer to the destination of the transfer, word aligned.
+/// \param src A pointer to the data in main memory. It is read through
+/// the data cache.
+/// \param size The size of data to be transferred, in bytes.
+/// \param staging A pointer to the staging area, word aligned.
+/// \param staging_size The size of the staging area, at least two words.
+/// Larger staging areas make better use of the NoC bandwidth.
+/// \retval 1 Sending was successful.
+/// \retval 0 The staging area is too small, nothing has been sent.
+int noc_stream_write(unsigned dma_id, volatile void _SPM *dst,
+                     const void *src, size_t size,
+                     volatile void _SPM *staging, size_t staging_size);
+
 /// \brief Wait until all transfers to a set of receivers have finished.
 ///
 /// \param receivers The set of receivers.
 void noc_wait_dma(coreset_t receivers);
 
+///////////////////////////////////////////////////////////////////////////////
+// Functions for queued transfers
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef NOC_QUEUE_SIZE
+/// \brief The number of transfers that a core can have queued.
+///
+/// Must be a power of two.
+#define NOC_QUEUE_SIZE 16
+#endif
+
+/// \brief Identifies a queued transfer, see #noc_enqueue().
+typedef unsigned int noc_token_t;
+
+/// \brief A function that is called when a queued transfer has finished.
+typedef void (*noc_callback_t)(void *arg);
+
+/// \brief Queue a transfer of data via the NoC.
+///
+/// Each core has a queue of transfers. The transfers are started by
+/// #noc_progress() as soon as the DMA of their receiver is free, so
+/// transfers to different receivers overlap, while transfers to the same
+/// receiver are done in the order they were queued. The data must not be
+/// changed until the transfer has finished.
+///
+/// The function starts the transfer if possible and returns without
+/// waiting, unless the queue is full. Then it waits until the oldest
+/// transfer has finished.
+///
+/// The addresses and the size are absolute and in bytes.
+/// \param dma_id The core id of the receiver.
+/// \param dst A pointer to the destination of the transfer.
+/// \param src A pointer to the source of the transfer.
+/// \param size The size of data to be transferred, in bytes.
+/// \param irq_enable If irq_enable is 1 an interrupt will be triggered at the
+/// receiver when the whole transfer is complete.
+/// \param callback A function that #noc_progress() calls when the transfer
+/// has finished, or NULL. It must not call the functions for queued
+/// transfers.
+/// \param arg The argument of the callback.
+/// \returns A token to check whether the transfer has finished.
+noc_token_t noc_enqueue(unsigned dma_id, volatile void _SPM *dst,
+                        volatile void _SPM *src, size_t size,
+                        unsigned irq_enable,
+                        noc_callback_t callback, void *arg);
+
+/// \brief Start queued transfers and retire finished ones.
+///
+/// The network interface does not raise an interrupt when a DMA has
+/// finished, so the queue only makes progress when this function, or a
+/// function that waits for queued transfers, is called.
+///
+/// \returns The number of queued transfers that have not finished.
+unsigned int noc_progress(void);
+
+/// \brief Check whether a queued transfer has finished.
+///
+/// The function does not make progress on the queue.
+/// \param token The token returned by #noc_enqueue().
+/// \retval 1 The transfer has finished.
+/// \retval 0 Otherwise.
+int noc_done(noc_token_t token);
+
+/// \brief Wait until a queued transfer has finished.
+///
+/// \param token The token returned by #noc_enqueue().
+void noc_wait(noc_token_t token);
+
+/// \brief Wait until all queued transfers of the calling core have
+/// finished.
+void noc_flush(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Functions for waiting on interrupts
+///////////////////////////////////////////////////////////////////////////////
+
+/// \brief The interrupt raised when a transfer with irq_enable set has been
+/// received.
+#define NOC_DATA_IRQ   18
+/// \brief The interrupt raised when a remote interrupt has been received.
+#define NOC_REMOTE_IRQ 19
+
+/// \brief Enable waiting on NoC interrupts on the calling core.
+///
+/// Registers the NoC exception handlers, unmasks the NoC interrupts and
+/// enables interrupts. Afterwards #noc_event_wait() puts the core to sleep
+/// until the next interrupt.
+///
+/// Note that the function enables interrupts globally on the calling core,
+/// not only the NoC interrupts, and #noc_event_disable() does not disable
+/// them again.
+void noc_event_enable(void);
+
+/// \brief Disable waiting on NoC interrupts on the calling core.
+///
+/// Masks the NoC interrupts, #noc_event_wait() returns immediately again.
+void noc_event_disable(void);
+
+/// \brief The number of NoC interrupts received by the calling core.
+///
+/// Read the count before checking for a condition that an interrupt can
+/// change, and pass it to #noc_event_wait() if the condition does not hold.
+unsigned int noc_event_count(void);
+
+/// \brief Sleep until the calling core has received more NoC interrupts
+/// than \p count.
+///
+/// The function returns immediately if waiting on interrupts is not enabled
+/// with #noc_event_enable(). It may also return early, when another
+/// interrupt wakes up the core. The function leaves interrupts enabled or
+/// disabled as they were on entry.
+/// \param count A count returned by #noc_event_count().
+void noc_event_wait(unsigned int count);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Definitions for setting up a transfer
 ///////////////////////////////////////////////////////////////////////////////
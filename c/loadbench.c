@@ -0,0 +1,21 @@
+/*
+  Program with a large initialized data section, to measure how long
+  the emulator takes to load an ELF file. Run with "patemu -b".
+  The default of 1.5 MB of data fits into the 2 MB external memory of
+  the default configuration; override LOADBENCH_WORDS for larger memories.
+*/
+#include <stdio.h>
+
+#ifndef LOADBENCH_WORDS
+#define LOADBENCH_WORDS (3 << 17)
+#endif
+
+// The non-zero initializer keeps the array in .data rather than .bss
+volatile int data[LOADBENCH_WORDS] = { 1 };
+
+int main(int argc, char **argv)
+{
+  printf("%d words of data, first %d, last %d\n",
+         LOADBENCH_WORDS, data[0], data[LOADBENCH_WORDS-1]);
+  return 0;
+}
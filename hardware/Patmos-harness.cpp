@@ -21,745 +21,3443 @@ NOTES ON STUFF MISSING FROM THE OLD EMULATOR
 #include <libelf.h>
 #include <gelf.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <chrono>
+#include <algorithm>
+#include <sstream>
+#include <map>
+#include <unordered_map>
+#include <array>
 
 #include "VPatmos.h"
 #include "verilated.h"
+#include "regtrace.h"
+#include "memtrace.h"
+#include "Patmos-isasim.h"
+#if EMU_TRACE_FST
+#define TRACE_FILE "Patmos.fst"
+#else
+#define TRACE_FILE "Patmos.vcd"
+#endif
 #if VM_TRACE
+#if EMU_TRACE_FST
+#include "verilated_fst_c.h"
+typedef VerilatedFstC TraceFile;
+#else
 #include "verilated_vcd_c.h"
+typedef VerilatedVcdC TraceFile;
+#endif
 #endif
+#if EMU_SAVABLE
+#include "verilated_save.h"
+#endif
+#include "emulator_cores.h"
 #if CORE_COUNT > 1
 #include "VPatmos_PatmosCore.h"
 #endif
 
+// Signals of core n. With several cores, Verilator generates a class for
+// the cores, in which only the signals that are public in harnessConfig.vlt
+// keep their plain names; CORE_PVT accesses the other signals.
+#if CORE_COUNT > 1
+#define CORE_PUB(n, sig) (cores[n]->sig)
+#define CORE_PVT(n, sig) (cores[n]->__PVT__##sig)
+#else
+#define CORE_PUB(n, sig) (c->Patmos__DOT__cores_0__DOT__##sig)
+#define CORE_PVT(n, sig) (c->Patmos__DOT__cores_0__DOT__##sig)
+#endif
+
 #define OCMEM_ADDR_BITS 16
+#define SRAM_CYCLES 3
+
+// Sizes of the UART output buffer and of the input read-ahead buffer
+#define UART_OUT_BUFSIZE 4096
+#define UART_IN_BUFSIZE 4096
+
+#ifndef PIPE_COUNT
+#define PIPE_COUNT 2
+#endif
+// Retired slots in a row that may differ from the instruction set model,
+// for bundles squashed by non-delayed control flow
+#define LOCKSTEP_MAX_SKIP 16
+
+// Fast-forwarding of idle loops: code size of a spin loop, cycles to stop
+// before a timer interrupt, and the default for the cycles to skip at once
+#define WARP_SPIN_BYTES 64
+#define WARP_MARGIN 16
+#define WARP_MAX_DEFAULT 10000
+#define CYCLES_PER_USEC (FREQ / 1000000)
+// Upper 16 bits of the addresses of an I/O device; the CPU info device of
+// each core is not part of the configuration and always at offset 0
+#define IO_DEVICE(offset) (0xf000 + (offset))
+#define IO_CPUINFO_OFFSET 0
+
+#if defined(EXTMEM_SSRAM32CTRL) || defined(EXTMEM_SRAMCTRL) || defined(EXTMEM_MEMBRIDGE)
+#define EXTMEM_EMULATED 1
+#endif
+
+// Parameters of the external memory timing model, from the <Timing>
+// element of <ExtMem> in the configuration. Missing ones default to the
+// SDRAM of the DE2-115 board at 80 MHz.
+#ifndef EXTMEM_BURST_LENGTH
+#define EXTMEM_BURST_LENGTH 4
+#endif
+#ifndef EXTMEM_TIMING_LATENCY
+#define EXTMEM_TIMING_LATENCY SRAM_CYCLES
+#endif
+#ifndef EXTMEM_TIMING_BANKS
+#define EXTMEM_TIMING_BANKS 4
+#endif
+#ifndef EXTMEM_TIMING_COLBITS
+#define EXTMEM_TIMING_COLBITS 10
+#endif
+#ifndef EXTMEM_TIMING_TCAS
+#define EXTMEM_TIMING_TCAS 3
+#endif
+#ifndef EXTMEM_TIMING_TRCD
+#define EXTMEM_TIMING_TRCD 2
+#endif
+#ifndef EXTMEM_TIMING_TRP
+#define EXTMEM_TIMING_TRP 2
+#endif
+#ifndef EXTMEM_TIMING_TWR
+#define EXTMEM_TIMING_TWR 2
+#endif
+#ifndef EXTMEM_TIMING_TREFI
+#define EXTMEM_TIMING_TREFI 624
+#endif
+#ifndef EXTMEM_TIMING_TRFC
+#define EXTMEM_TIMING_TRFC 5
+#endif
+#ifndef EXTMEM_TIMING_WORDCYCLES
+#define EXTMEM_TIMING_WORDCYCLES 1
+#endif
+
+// Events counted per core with -p, the ones of io/PerfCounters.scala
+// and stall cycles
+enum {
+  PERF_IC_HIT, PERF_IC_MISS, PERF_DC_HIT, PERF_DC_MISS,
+  PERF_SC_SPILL, PERF_SC_FILL, PERF_WC_HIT, PERF_WC_MISS,
+  PERF_MEM_READ, PERF_MEM_WRITE, PERF_STALL, PERF_EVENTS
+};
+static const char *perf_names[PERF_EVENTS] = {
+  "ic_hits", "ic_misses", "dc_hits", "dc_misses",
+  "sc_spills", "sc_fills", "wc_hits", "wc_misses",
+  "mem_reads", "mem_writes", "stall_cycles"
+};
+
+// Events of the profiler, per PC
+enum {
+  PROF_CYCLES, PROF_INSTRS, PROF_STALLS, PROF_MCACHE_STALLS, PROF_EVENTS
+};
+
+// OCP commands and responses
+#define OCP_CMD_IDLE 0
+#define OCP_CMD_WR 1
+#define OCP_CMD_RD 2
+#define OCP_RESP_NULL 0
+#define OCP_RESP_DVA 1
+
+// Number of Verilator threads, passed on from the Makefile
+#ifndef EMU_THREADS
+#define EMU_THREADS 1
+#endif
+
+// Identification of snapshot files, bump version when the layout changes
+#define SNAPSHOT_MAGIC 0x50544d53 // "PTMS"
+#define SNAPSHOT_VERSION 5
 
 typedef uint64_t val_t;
 
 using namespace std;
 
-class Emulator
+// Memory that is allocated page by page when it is first written. Pages
+// that were never written read as zero, or as a pseudo-random pattern that
+// only depends on the address, so that runs remain reproducible.
+template<typename T>
+class SparseMem
 {
-  unsigned long m_tickcount;
-  public: VPatmos *c;
-  VerilatedVcdC	*c_trace;
-  // For Uart:
-  bool UART_on;
-  int baudrate;
-  int freq;
-  char in_byte;
-  char out_byte;
-  int sample_counter_out;
-  int sample_counter_in;
-  int bit_counter_out;
-  int bit_counter_in;
-  char state;
-  bool writing;
-  string write_str;
-  int write_cntr;
-  int write_len;
-  bool trace;
-  ostream *outputTarget = &std::cout;
+  static const unsigned PAGE_BITS = 12;
+  static const size_t PAGE_SIZE = (size_t)1 << PAGE_BITS;
 
-  //elf - mem - ram
-  #ifdef EXTMEM_SSRAM32CTRL
-  uint32_t *ram_buf; 
-  #endif /* EXTMEM_SSRAM32CTRL */
+  size_t size;
+  vector<T *> pages;
+  size_t touched;
+  bool random;
 
-  #ifdef EXTMEM_SRAMCTRL
-  uint16_t *ram_buf; 
-  #endif /* EXTMEM_SRAMCTRL */
+  T fill(size_t addr) const
+  {
+    if (!random) {
+      return 0;
+    }
+    // splitmix64 finalizer
+    uint64_t x = (uint64_t)addr + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (T)(x ^ (x >> 31));
+  }
+
+  T *page(size_t addr)
+  {
+    T *&p = pages[addr >> PAGE_BITS];
+    if (p == NULL) {
+      p = new T[PAGE_SIZE];
+      size_t base = addr & ~(PAGE_SIZE-1);
+      for (size_t i = 0; i < PAGE_SIZE; i++) {
+        p[i] = fill(base + i);
+      }
+      touched++;
+    }
+    return p;
+  }
 
 public:
-  Emulator(void)
+  SparseMem(size_t size)
+    : size(size), pages((size + PAGE_SIZE - 1) >> PAGE_BITS, (T *)NULL),
+      touched(0), random(false)
   {
-    Verilated::traceEverOn(true);
-    c = new VPatmos;
-    m_tickcount = 0l;
+  }
 
-    //for UART
-    UART_on = false;
-    c->io_UartCmp_rx = 1; // keep UART tx high when idle
-    outputTarget = &cout; // default uart print to terminal
+  ~SparseMem(void)
+  {
+    clear();
+  }
 
-    #ifdef EXTMEM_SSRAM32CTRL
-    ram_buf = (uint32_t *)calloc(1 << EXTMEM_ADDR_BITS, sizeof(uint32_t));
-    #endif /* EXTMEM_SSRAM32CTRL */
+  // Drop all pages, memory contents return to the fill pattern
+  void clear(void)
+  {
+    for (size_t i = 0; i < pages.size(); i++) {
+      delete [] pages[i];
+      pages[i] = NULL;
+    }
+    touched = 0;
+  }
 
-    #ifdef EXTMEM_SRAMCTRL
-    ram_buf = (uint16_t *)calloc(1 << EXTMEM_ADDR_BITS, sizeof(uint16_t));
-    #endif /* EXTMEM_SRAMCTRL */
+  void set_random(bool r)
+  {
+    random = r;
+  }
 
-    trace = false;
-    
+  T read(size_t addr) const
+  {
+    assert(addr < size);
+    T *p = pages[addr >> PAGE_BITS];
+    return p != NULL ? p[addr & (PAGE_SIZE-1)] : fill(addr);
   }
 
-  ~Emulator(void)
+  // Reference for writing, allocates the page if needed
+  T &operator[](size_t addr)
   {
-    delete c;
-    c = NULL;
+    assert(addr < size);
+    return page(addr)[addr & (PAGE_SIZE-1)];
+  }
 
-    if (trace){
-      if (c_trace) {
-        c_trace->close();
-        c_trace = NULL;
+  // Set a range to zero
+  void zero(size_t addr, size_t count)
+  {
+    assert(addr + count <= size);
+    while (count > 0) {
+      size_t offset = addr & (PAGE_SIZE-1);
+      size_t n = min(count, PAGE_SIZE - offset);
+      if (random || pages[addr >> PAGE_BITS] != NULL) {
+        memset(&page(addr)[offset], 0, n * sizeof(T));
       }
+      addr += n;
+      count -= n;
     }
   }
 
-  void setTrace(){
-    trace = true;
-    if (!c_trace){
-      c_trace = new VerilatedVcdC;
-			c->trace(c_trace, 99);
-			c_trace->open("Patmos.vcd");
+  size_t page_count(void) const
+  {
+    return touched;
+  }
+
+  size_t footprint(void) const
+  {
+    return touched * PAGE_SIZE * sizeof(T);
+  }
+
+  #if EMU_SAVABLE
+  void save(VerilatedSerialize &os)
+  {
+    os.write(&touched, sizeof(touched));
+    for (size_t i = 0; i < pages.size(); i++) {
+      if (pages[i] != NULL) {
+        os.write(&i, sizeof(i));
+        os.write(pages[i], PAGE_SIZE * sizeof(T));
+      }
     }
   }
 
-  void stopTrace(){
-    if (trace){
-      if (c_trace) {
-        c_trace->close();
-        c_trace = NULL;
+  void restore(VerilatedDeserialize &os)
+  {
+    clear();
+    size_t count;
+    os.read(&count, sizeof(count));
+    for (size_t k = 0; k < count; k++) {
+      size_t i;
+      os.read(&i, sizeof(i));
+      assert(i < pages.size());
+      pages[i] = new T[PAGE_SIZE];
+      os.read(pages[i], PAGE_SIZE * sizeof(T));
+    }
+    touched = count;
+  }
+  #endif /* EMU_SAVABLE */
+};
+
+// Timing model for external memory behind an OCP burst interface. access()
+// returns the number of cycles from accepting a request until the memory
+// can transfer the first word of a burst of EXTMEM_BURST_LENGTH words.
+class MemTiming
+{
+public:
+  virtual ~MemTiming(void) {}
+  virtual unsigned access(uint64_t cycle, uint64_t addr, bool write) = 0;
+  virtual void report(ostream &out) {}
+  #if EMU_SAVABLE
+  virtual void save(VerilatedSerialize &os) {}
+  virtual void restore(VerilatedDeserialize &os) {}
+  #endif /* EMU_SAVABLE */
+};
+
+// Memory with a fixed latency, e.g., SRAM
+class FixedTiming : public MemTiming
+{
+  unsigned latency;
+
+public:
+  FixedTiming(unsigned latency) : latency(latency) {}
+
+  unsigned access(uint64_t cycle, uint64_t addr, bool write)
+  {
+    return latency;
+  }
+};
+
+// SDRAM with an open-page policy. Each bank keeps its last row open until a
+// request to another row or a refresh closes it. All refreshes take place
+// at fixed intervals and stall requests that arrive while they are running.
+class SdramTiming : public MemTiming
+{
+  struct Bank {
+    bool open;
+    uint64_t row;
+    uint64_t precharge_ok; // earliest cycle to precharge after a write
+  };
+
+  vector<Bank> banks;
+  unsigned col_bits, bank_bits;
+  unsigned tCAS, tRCD, tRP, tWR, tREFI, tRFC, word_cycles, burst_length;
+  uint64_t next_refresh;
+
+  uint64_t row_hits, row_misses, row_conflicts;
+  uint64_t refreshes, refresh_stalls;
+
+public:
+  SdramTiming(unsigned bank_count, unsigned col_bits,
+              unsigned tCAS, unsigned tRCD, unsigned tRP, unsigned tWR,
+              unsigned tREFI, unsigned tRFC, unsigned word_cycles,
+              unsigned burst_length)
+    : banks(bank_count), col_bits(col_bits), bank_bits(0),
+      tCAS(tCAS), tRCD(tRCD), tRP(tRP), tWR(tWR), tREFI(tREFI), tRFC(tRFC),
+      word_cycles(word_cycles), burst_length(burst_length),
+      next_refresh(tREFI), row_hits(0), row_misses(0), row_conflicts(0),
+      refreshes(0), refresh_stalls(0)
+  {
+    while ((1u << bank_bits) < bank_count) {
+      bank_bits++;
+    }
+    for (size_t i = 0; i < banks.size(); i++) {
+      banks[i].open = false;
+      banks[i].row = 0;
+      banks[i].precharge_ok = 0;
+    }
+  }
+
+  unsigned access(uint64_t cycle, uint64_t addr, bool write)
+  {
+    uint64_t word = addr >> 2;
+    Bank &bank = banks[(word >> col_bits) & (banks.size()-1)];
+    uint64_t row = word >> (col_bits + bank_bits);
+    uint64_t start = cycle;
+
+    // refreshes that were due close all rows
+    while (tREFI > 0 && next_refresh <= start) {
+      uint64_t refresh_end = next_refresh + tRFC;
+      if (refresh_end > start) {
+        refresh_stalls += refresh_end - start;
+        start = refresh_end;
       }
+      for (size_t i = 0; i < banks.size(); i++) {
+        banks[i].open = false;
+      }
+      refreshes++;
+      next_refresh += tREFI;
     }
-    trace = false;
+
+    if (bank.open && bank.row == row) {
+      row_hits++;
+    } else if (!bank.open) {
+      row_misses++;
+      start += tRCD;
+    } else {
+      row_conflicts++;
+      start = max(start, bank.precharge_ok) + tRP + tRCD;
+    }
+    bank.open = true;
+    bank.row = row;
+
+    // the burst is transferred in burst_length*word_cycles cycles, but the
+    // OCP interface returns one word per cycle, so it starts later
+    unsigned transfer = burst_length * (word_cycles - 1);
+    start += (write ? 0 : tCAS) + transfer;
+    if (write) {
+      bank.precharge_ok = start + burst_length + tWR;
+    }
+    return start - cycle;
   }
 
-  void reset(int cycles)
+  void report(ostream &out)
   {
-    c->reset = 1;
-    // Make sure any inheritance gets applied
-    for (int i = 0; i < cycles; i++)
-    {
-      this->tick(STDIN_FILENO, STDOUT_FILENO);
+    out << "row hits: " << row_hits << "\n"
+        << "row misses: " << row_misses << "\n"
+        << "row conflicts: " << row_conflicts << "\n"
+        << "refreshes: " << refreshes << "\n"
+        << "refresh stall cycles: " << refresh_stalls << "\n";
+  }
+
+  #if EMU_SAVABLE
+  void save(VerilatedSerialize &os)
+  {
+    os.write(&banks[0], banks.size() * sizeof(Bank));
+    os.write(&next_refresh, sizeof(next_refresh));
+    os.write(&row_hits, sizeof(row_hits));
+    os.write(&row_misses, sizeof(row_misses));
+    os.write(&row_conflicts, sizeof(row_conflicts));
+    os.write(&refreshes, sizeof(refreshes));
+    os.write(&refresh_stalls, sizeof(refresh_stalls));
+  }
+
+  void restore(VerilatedDeserialize &os)
+  {
+    os.read(&banks[0], banks.size() * sizeof(Bank));
+    os.read(&next_refresh, sizeof(next_refresh));
+    os.read(&row_hits, sizeof(row_hits));
+    os.read(&row_misses, sizeof(row_misses));
+    os.read(&row_conflicts, sizeof(row_conflicts));
+    os.read(&refreshes, sizeof(refreshes));
+    os.read(&refresh_stalls, sizeof(refresh_stalls));
+  }
+  #endif /* EMU_SAVABLE */
+};
+
+// Timing model as selected in the configuration
+static MemTiming *new_extmem_timing(void)
+{
+  #ifdef EXTMEM_TIMING_SDRAM
+  return new SdramTiming(EXTMEM_TIMING_BANKS, EXTMEM_TIMING_COLBITS,
+                         EXTMEM_TIMING_TCAS, EXTMEM_TIMING_TRCD,
+                         EXTMEM_TIMING_TRP, EXTMEM_TIMING_TWR,
+                         EXTMEM_TIMING_TREFI, EXTMEM_TIMING_TRFC,
+                         EXTMEM_TIMING_WORDCYCLES, EXTMEM_BURST_LENGTH);
+  #else
+  return new FixedTiming(EXTMEM_TIMING_LATENCY);
+  #endif
+}
+
+#ifdef IO_ETHMAC
+#include "VPatmos__Dpi.h"
+
+// Frames take their length plus preamble and inter-frame gap on the wire
+#define ETHMAC_BITRATE 100000000ULL
+#define ETHMAC_WIRE_OVERHEAD 20
+#define ETHMAC_MIN_FRAME 60
+#define ETHMAC_MAX_FRAME 1536
+// Default delay of the network peer for its replies, in cycles
+#define ETHMAC_PEER_DELAY 1000
+
+// Registers and buffer descriptors, as byte offsets into the register space
+#define ETHMAC_MODER       0x000
+#define ETHMAC_INT_SOURCE  0x004
+#define ETHMAC_INT_MASK    0x008
+#define ETHMAC_TX_BD_NUM   0x020
+#define ETHMAC_MAC_ADDR0   0x040
+#define ETHMAC_MAC_ADDR1   0x044
+#define ETHMAC_BD_BASE     0x400
+#define ETHMAC_BD_COUNT    128
+#define ETHMAC_REG_SPACE   0x800
+
+#define ETHMAC_MODER_RXEN  0x0001
+#define ETHMAC_MODER_TXEN  0x0002
+#define ETHMAC_MODER_BRO   0x0008
+#define ETHMAC_MODER_PRO   0x0020
+#define ETHMAC_INT_TXB     0x0001
+#define ETHMAC_INT_RXB     0x0004
+#define ETHMAC_BD_READY    0x8000 // TX: ready, RX: empty
+#define ETHMAC_BD_IRQ      0x4000
+#define ETHMAC_BD_WRAP     0x2000
+#define ETHMAC_BD_PAD      0x1000
+#define ETHMAC_BD_CRC      0x0800
+
+// Emulation of the Ethernet controller in hardware/ethmac, called through
+// DPI from the replacement in hardware/verilog/emulator. The controller
+// works on the buffer descriptors like the real one, but frames go to and
+// come from pcap files instead of a PHY, and an optional peer answers ARP
+// requests, ICMP echo requests and UDP datagrams for its IP address.
+//
+// Received frames wait until an empty buffer descriptor is available
+// instead of being dropped, so that input files can be replayed without
+// losses. Snapshots contain the state of the controller and the positions
+// in the pcap files, but not the files themselves.
+class EthMacEmu
+{
+  uint64_t cycle;
+  vector<uint8_t> buffer;
+  uint32_t buffer_mask;
+  uint32_t regs[ETHMAC_REG_SPACE / 4];
+
+  unsigned tx_bd;
+  bool tx_busy;
+  uint64_t tx_done;
+  vector<uint8_t> tx_frame;
+  unsigned rx_bd;
+  uint64_t rx_free;
+  // Frames that wait to be received, by the cycle they arrive in
+  multimap<uint64_t, vector<uint8_t> > rx_queue;
+
+  FILE *pcap_in;
+  bool pcap_swapped;
+  bool pcap_nsec;
+  bool pcap_first;
+  uint64_t pcap_start;
+  bool pcap_pending;
+  uint64_t pcap_next_cycle;
+  vector<uint8_t> pcap_next;
+  FILE *pcap_out;
+
+  bool peer;
+  uint8_t peer_ip[4];
+  uint8_t peer_mac[6];
+  uint64_t peer_delay;
+
+  uint64_t tx_frames, tx_bytes, rx_frames, rx_bytes;
+  uint64_t first_cycle, last_cycle;
+
+  #if EMU_SAVABLE
+  static void save_frame(VerilatedSerialize &os, const vector<uint8_t> &frame) {
+    size_t len = frame.size();
+    os.write(&len, sizeof(len));
+    if (len > 0) {
+      os.write(&frame[0], len);
     }
-    c->reset = 0;
   }
 
-  void tick(int uart_in,int uart_out)
+  static void restore_frame(VerilatedDeserialize &os, vector<uint8_t> &frame) {
+    size_t len;
+    os.read(&len, sizeof(len));
+    frame.resize(len);
+    if (len > 0) {
+      os.read(&frame[0], len);
+    }
+  }
+  #endif /* EMU_SAVABLE */
+
+  static uint32_t get32(const uint8_t *p, bool swapped) {
+    return swapped
+      ? ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]
+      : ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+  }
+
+  static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+  }
+
+  static uint16_t get16be(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+  }
+
+  static void put16be(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8; p[1] = v;
+  }
+
+  // Internet checksum over len bytes, starting with sum
+  static uint16_t checksum(const uint8_t *p, size_t len, uint32_t sum = 0) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+      sum += get16be(p + i);
+    }
+    if (len & 1) {
+      sum += p[len-1] << 8;
+    }
+    while (sum >> 16) {
+      sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+  }
+
+  static uint32_t crc32(const uint8_t *p, size_t len) {
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < len; i++) {
+      crc ^= p[i];
+      for (unsigned k = 0; k < 8; k++) {
+        crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+      }
+    }
+    return ~crc;
+  }
+
+  uint64_t wire_cycles(size_t len) {
+    return ((len + ETHMAC_WIRE_OVERHEAD) * 8 * (uint64_t)FREQ + ETHMAC_BITRATE - 1)
+      / ETHMAC_BITRATE;
+  }
+
+  // Read the next frame from the input file into pcap_next
+  void pcap_read(void) {
+    uint8_t hdr[16];
+    pcap_pending = false;
+    if (pcap_in == NULL || fread(hdr, 1, sizeof(hdr), pcap_in) != sizeof(hdr)) {
+      return;
+    }
+    uint64_t sec = get32(hdr, pcap_swapped);
+    uint64_t frac = get32(hdr + 4, pcap_swapped);
+    uint32_t len = get32(hdr + 8, pcap_swapped);
+    uint64_t ns = sec * 1000000000ULL + (pcap_nsec ? frac : frac * 1000);
+    pcap_next.resize(len);
+    if (len > 0 && fread(&pcap_next[0], 1, len, pcap_in) != len) {
+      return;
+    }
+    if (pcap_first) {
+      pcap_start = ns;
+      pcap_first = false;
+    }
+    pcap_next_cycle = (ns - pcap_start) * (uint64_t)FREQ / 1000000000ULL;
+    pcap_pending = true;
+  }
+
+  void pcap_write(const vector<uint8_t> &frame) {
+    if (pcap_out == NULL) {
+      return;
+    }
+    uint64_t ns = cycle * 1000000000ULL / (uint64_t)FREQ;
+    uint8_t hdr[16];
+    put32(hdr, ns / 1000000000ULL);
+    put32(hdr + 4, (ns % 1000000000ULL) / 1000);
+    put32(hdr + 8, frame.size());
+    put32(hdr + 12, frame.size());
+    fwrite(hdr, 1, sizeof(hdr), pcap_out);
+    fwrite(&frame[0], 1, frame.size(), pcap_out);
+  }
+
+  uint32_t &bd(unsigned index, unsigned word) {
+    return regs[(ETHMAC_BD_BASE + index * 8 + word * 4) / 4];
+  }
+
+  unsigned tx_bd_num(void) {
+    return min(regs[ETHMAC_TX_BD_NUM / 4], (uint32_t)ETHMAC_BD_COUNT);
+  }
+
+  bool accept(const vector<uint8_t> &frame) {
+    uint32_t moder = regs[ETHMAC_MODER / 4];
+    if (frame.size() < 14 || (moder & ETHMAC_MODER_PRO)) {
+      return frame.size() >= 14;
+    }
+    uint8_t mac[6] = {
+      (uint8_t)(regs[ETHMAC_MAC_ADDR1 / 4] >> 8), (uint8_t)regs[ETHMAC_MAC_ADDR1 / 4],
+      (uint8_t)(regs[ETHMAC_MAC_ADDR0 / 4] >> 24), (uint8_t)(regs[ETHMAC_MAC_ADDR0 / 4] >> 16),
+      (uint8_t)(regs[ETHMAC_MAC_ADDR0 / 4] >> 8), (uint8_t)regs[ETHMAC_MAC_ADDR0 / 4] };
+    static const uint8_t bcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    if (memcmp(&frame[0], bcast, 6) == 0) {
+      return !(moder & ETHMAC_MODER_BRO);
+    }
+    return memcmp(&frame[0], mac, 6) == 0 || (frame[0] & 1);
+  }
+
+  // Replies of the peer to a frame sent by Patmos
+  void peer_reply(const vector<uint8_t> &frame) {
+    if (!peer || frame.size() < 14) {
+      return;
+    }
+    const uint8_t *in = &frame[0];
+    uint16_t type = get16be(in + 12);
+    vector<uint8_t> out;
+
+    if (type == 0x0806 && frame.size() >= 42 && get16be(in + 20) == 1
+        && memcmp(in + 38, peer_ip, 4) == 0) {
+      // ARP request for the peer
+      out.assign(in, in + 42);
+      memcpy(&out[0], in + 6, 6);
+      memcpy(&out[6], peer_mac, 6);
+      put16be(&out[20], 2);
+      memcpy(&out[22], peer_mac, 6);
+      memcpy(&out[28], peer_ip, 4);
+      memcpy(&out[32], in + 22, 10);
+    } else if (type == 0x0800 && frame.size() >= 34
+               && memcmp(in + 30, peer_ip, 4) == 0) {
+      unsigned ihl = (in[14] & 0xf) * 4;
+      unsigned total = get16be(in + 16);
+      if (ihl < 20 || 14 + total > frame.size() || total < ihl) {
+        return;
+      }
+      out.assign(in, in + 14 + total);
+      uint8_t *ip = &out[14];
+      uint8_t *payload = ip + ihl;
+      unsigned payload_len = total - ihl;
+      if (ip[9] == 1 && payload_len >= 8 && payload[0] == 8) {
+        // ICMP echo request
+        payload[0] = 0;
+        put16be(payload + 2, 0);
+        put16be(payload + 2, checksum(payload, payload_len));
+      } else if (ip[9] == 17 && payload_len >= 8) {
+        // UDP, echoed to the sender
+        uint8_t port[2];
+        memcpy(port, payload, 2);
+        memcpy(payload, payload + 2, 2);
+        memcpy(payload + 2, port, 2);
+      } else {
+        return;
+      }
+      memcpy(&out[0], in + 6, 6);
+      memcpy(&out[6], peer_mac, 6);
+      memcpy(ip + 12, in + 30, 4);
+      memcpy(ip + 16, in + 26, 4);
+      ip[8] = 64;
+      put16be(ip + 10, 0);
+      put16be(ip + 10, checksum(ip, ihl));
+      if (ip[9] == 17 && get16be(payload + 6) != 0) {
+        // Checksum over the pseudo header and the datagram
+        uint32_t sum = get16be(ip + 12) + get16be(ip + 14) + get16be(ip + 16)
+          + get16be(ip + 18) + 17 + payload_len;
+        put16be(payload + 6, 0);
+        uint16_t c = checksum(payload, payload_len, sum);
+        put16be(payload + 6, c == 0 ? 0xffff : c);
+      }
+    } else {
+      return;
+    }
+    rx_queue.insert(make_pair(cycle + peer_delay, out));
+  }
+
+  void transmit(void) {
+    uint32_t &status = bd(tx_bd, 0);
+    if (!tx_busy) {
+      if (!(regs[ETHMAC_MODER / 4] & ETHMAC_MODER_TXEN) || !(status & ETHMAC_BD_READY)) {
+        return;
+      }
+      uint32_t len = min(status >> 16, (uint32_t)ETHMAC_MAX_FRAME);
+      uint32_t ptr = bd(tx_bd, 1);
+      tx_frame.resize(len);
+      for (uint32_t i = 0; i < len; i++) {
+        tx_frame[i] = buffer[(ptr + i) & buffer_mask];
+      }
+      if ((status & ETHMAC_BD_PAD) && len < ETHMAC_MIN_FRAME) {
+        tx_frame.resize(ETHMAC_MIN_FRAME, 0);
+      }
+      tx_busy = true;
+      tx_done = cycle + wire_cycles(tx_frame.size() + 4);
+      return;
+    }
+    if (cycle < tx_done) {
+      return;
+    }
+    pcap_write(tx_frame);
+    if (tx_frames == 0) {
+      first_cycle = cycle;
+    }
+    last_cycle = cycle;
+    tx_frames++;
+    tx_bytes += tx_frame.size();
+    peer_reply(tx_frame);
+
+    status &= ~(ETHMAC_BD_READY | 0x1ff);
+    if (status & ETHMAC_BD_IRQ) {
+      regs[ETHMAC_INT_SOURCE / 4] |= ETHMAC_INT_TXB;
+    }
+    tx_bd = (status & ETHMAC_BD_WRAP) || tx_bd + 1 >= tx_bd_num() ? 0 : tx_bd + 1;
+    tx_busy = false;
+  }
+
+  void receive(void) {
+    while (pcap_pending && pcap_next_cycle <= cycle) {
+      rx_queue.insert(make_pair(pcap_next_cycle, pcap_next));
+      pcap_read();
+    }
+    if (rx_queue.empty() || rx_queue.begin()->first > cycle || cycle < rx_free
+        || !(regs[ETHMAC_MODER / 4] & ETHMAC_MODER_RXEN)) {
+      return;
+    }
+    unsigned index = tx_bd_num() + rx_bd;
+    if (index >= ETHMAC_BD_COUNT) {
+      return;
+    }
+    uint32_t &status = bd(index, 0);
+    if (!(status & ETHMAC_BD_READY)) {
+      return;
+    }
+
+    vector<uint8_t> frame = rx_queue.begin()->second;
+    rx_queue.erase(rx_queue.begin());
+    if (!accept(frame)) {
+      return;
+    }
+    pcap_write(frame);
+    // The controller stores the frame check sequence as well
+    uint32_t crc = crc32(&frame[0], frame.size());
+    for (unsigned i = 0; i < 4; i++) {
+      frame.push_back(crc >> (8 * i));
+    }
+    uint32_t ptr = bd(index, 1);
+    for (size_t i = 0; i < frame.size(); i++) {
+      buffer[(ptr + i) & buffer_mask] = frame[i];
+    }
+    rx_frames++;
+    rx_bytes += frame.size() - 4;
+    rx_free = cycle + wire_cycles(frame.size());
+
+    status = (frame.size() << 16) | (status & 0xffff & ~(ETHMAC_BD_READY | 0xff));
+    if (status & ETHMAC_BD_IRQ) {
+      regs[ETHMAC_INT_SOURCE / 4] |= ETHMAC_INT_RXB;
+    }
+    unsigned rx_num = ETHMAC_BD_COUNT - tx_bd_num();
+    rx_bd = (status & ETHMAC_BD_WRAP) || rx_bd + 1 >= rx_num ? 0 : rx_bd + 1;
+  }
+
+public:
+  EthMacEmu(void)
+    : buffer_mask(0), pcap_in(NULL), pcap_swapped(false), pcap_nsec(false),
+      pcap_out(NULL), peer(false), peer_delay(ETHMAC_PEER_DELAY)
   {
-    // Increment our own internal time reference
-    m_tickcount++;
+    static const uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    memcpy(peer_mac, mac, 6);
+    reset();
+  }
 
-    // Make sure any combinatorial logic depending upon
-    // inputs that may have changed before we called tick()
-    // has settled before the rising edge of the clock.
-    c->clock = 0;
-    c->eval();
+  ~EthMacEmu(void)
+  {
+    close();
+  }
 
-    if (trace) {
-      c_trace->dump(10*m_tickcount+5);
+  // Read received frames from a pcap file, with the time of the first
+  // frame mapped to the first cycle
+  bool open_input(const char *path)
+  {
+    pcap_in = fopen(path, "rb");
+    uint8_t hdr[24];
+    if (pcap_in == NULL || fread(hdr, 1, sizeof(hdr), pcap_in) != sizeof(hdr)) {
+      return false;
     }
-    // Toggle the clock
-    // Rising edge
-    c->clock = 1;
-    c->eval();
+    uint32_t magic = get32(hdr, false);
+    pcap_swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    pcap_nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+    if (!pcap_swapped && !pcap_nsec && magic != 0xa1b2c3d4) {
+      return false;
+    }
+    if (get32(hdr + 20, pcap_swapped) != 1) {
+      return false; // not Ethernet
+    }
+    pcap_read();
+    return true;
+  }
 
-    //UART emulation
-    if (UART_on)
-    {
-      emu_uart(uart_in, uart_out);
+  // Write sent and received frames to a pcap file
+  bool open_output(const char *path)
+  {
+    pcap_out = fopen(path, "wb");
+    if (pcap_out == NULL) {
+      return false;
+    }
+    uint8_t hdr[24];
+    put32(hdr, 0xa1b2c3d4);
+    hdr[4] = 2; hdr[5] = 0; hdr[6] = 4; hdr[7] = 0;
+    put32(hdr + 8, 0);
+    put32(hdr + 12, 0);
+    put32(hdr + 16, 65535);
+    put32(hdr + 20, 1);
+    fwrite(hdr, 1, sizeof(hdr), pcap_out);
+    return true;
+  }
+
+  // Enable the peer, spec is <ip>[:<delay in cycles>]
+  bool set_peer(const char *spec)
+  {
+    unsigned a, b, c, d;
+    unsigned long long delay = ETHMAC_PEER_DELAY;
+    int n = sscanf(spec, "%u.%u.%u.%u:%llu", &a, &b, &c, &d, &delay);
+    if (n < 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+      return false;
+    }
+    peer_ip[0] = a; peer_ip[1] = b; peer_ip[2] = c; peer_ip[3] = d;
+    peer_delay = delay;
+    peer = true;
+    return true;
+  }
+
+  // Bring the controller back to its state after power-up, with the input
+  // file at the first frame again. Frames that were written to the output
+  // file are kept.
+  void reset(void)
+  {
+    cycle = 0;
+    fill(buffer.begin(), buffer.end(), 0);
+    memset(regs, 0, sizeof(regs));
+    regs[ETHMAC_TX_BD_NUM / 4] = 0x40;
+    tx_bd = 0;
+    tx_busy = false;
+    tx_done = 0;
+    tx_frame.clear();
+    rx_bd = 0;
+    rx_free = 0;
+    rx_queue.clear();
+    tx_frames = tx_bytes = rx_frames = rx_bytes = 0;
+    first_cycle = last_cycle = 0;
+
+    pcap_first = true;
+    pcap_start = 0;
+    pcap_pending = false;
+    pcap_next_cycle = 0;
+    pcap_next.clear();
+    if (pcap_in != NULL && fseek(pcap_in, 24, SEEK_SET) == 0) {
+      pcap_read();
+    }
+  }
+
+  #if EMU_SAVABLE
+  void save(VerilatedSerialize &os)
+  {
+    os.write(&cycle, sizeof(cycle));
+    save_frame(os, buffer);
+    os.write(&buffer_mask, sizeof(buffer_mask));
+    os.write(regs, sizeof(regs));
+    os.write(&tx_bd, sizeof(tx_bd));
+    os.write(&tx_busy, sizeof(tx_busy));
+    os.write(&tx_done, sizeof(tx_done));
+    save_frame(os, tx_frame);
+    os.write(&rx_bd, sizeof(rx_bd));
+    os.write(&rx_free, sizeof(rx_free));
+    size_t count = rx_queue.size();
+    os.write(&count, sizeof(count));
+    for (multimap<uint64_t, vector<uint8_t> >::iterator it = rx_queue.begin();
+         it != rx_queue.end(); ++it) {
+      os.write(&it->first, sizeof(it->first));
+      save_frame(os, it->second);
+    }
+
+    long in_pos = pcap_in != NULL ? ftell(pcap_in) : -1;
+    os.write(&in_pos, sizeof(in_pos));
+    os.write(&pcap_first, sizeof(pcap_first));
+    os.write(&pcap_start, sizeof(pcap_start));
+    os.write(&pcap_pending, sizeof(pcap_pending));
+    os.write(&pcap_next_cycle, sizeof(pcap_next_cycle));
+    save_frame(os, pcap_next);
+    if (pcap_out != NULL) {
+      fflush(pcap_out);
+    }
+    long out_pos = pcap_out != NULL ? ftell(pcap_out) : -1;
+    os.write(&out_pos, sizeof(out_pos));
+
+    os.write(&tx_frames, sizeof(tx_frames));
+    os.write(&tx_bytes, sizeof(tx_bytes));
+    os.write(&rx_frames, sizeof(rx_frames));
+    os.write(&rx_bytes, sizeof(rx_bytes));
+    os.write(&first_cycle, sizeof(first_cycle));
+    os.write(&last_cycle, sizeof(last_cycle));
+  }
+
+  // Frames that the output file got after the snapshot was taken are
+  // dropped, so that they are not written twice when the cycles are
+  // emulated again
+  void restore(VerilatedDeserialize &os)
+  {
+    os.read(&cycle, sizeof(cycle));
+    restore_frame(os, buffer);
+    os.read(&buffer_mask, sizeof(buffer_mask));
+    os.read(regs, sizeof(regs));
+    os.read(&tx_bd, sizeof(tx_bd));
+    os.read(&tx_busy, sizeof(tx_busy));
+    os.read(&tx_done, sizeof(tx_done));
+    restore_frame(os, tx_frame);
+    os.read(&rx_bd, sizeof(rx_bd));
+    os.read(&rx_free, sizeof(rx_free));
+    size_t count;
+    os.read(&count, sizeof(count));
+    rx_queue.clear();
+    for (size_t i = 0; i < count; i++) {
+      uint64_t when;
+      vector<uint8_t> frame;
+      os.read(&when, sizeof(when));
+      restore_frame(os, frame);
+      rx_queue.insert(make_pair(when, frame));
+    }
+
+    long in_pos;
+    os.read(&in_pos, sizeof(in_pos));
+    os.read(&pcap_first, sizeof(pcap_first));
+    os.read(&pcap_start, sizeof(pcap_start));
+    os.read(&pcap_pending, sizeof(pcap_pending));
+    os.read(&pcap_next_cycle, sizeof(pcap_next_cycle));
+    restore_frame(os, pcap_next);
+    if (pcap_in != NULL && in_pos >= 0) {
+      fseek(pcap_in, in_pos, SEEK_SET);
+    }
+    long out_pos;
+    os.read(&out_pos, sizeof(out_pos));
+    if (pcap_out != NULL && out_pos >= 0) {
+      fflush(pcap_out);
+      if (ftruncate(fileno(pcap_out), out_pos) == 0) {
+        fseek(pcap_out, out_pos, SEEK_SET);
+      }
+    }
+
+    os.read(&tx_frames, sizeof(tx_frames));
+    os.read(&tx_bytes, sizeof(tx_bytes));
+    os.read(&rx_frames, sizeof(rx_frames));
+    os.read(&rx_bytes, sizeof(rx_bytes));
+    os.read(&first_cycle, sizeof(first_cycle));
+    os.read(&last_cycle, sizeof(last_cycle));
+  }
+  #endif /* EMU_SAVABLE */
+
+  void close(void)
+  {
+    if (pcap_in != NULL) {
+      fclose(pcap_in);
+      pcap_in = NULL;
+    }
+    if (pcap_out != NULL) {
+      fclose(pcap_out);
+      pcap_out = NULL;
+    }
+  }
+
+  // One cycle of the controller with the OCP command of that cycle
+  void tick(unsigned addr_bits, uint32_t cmd, uint32_t addr, uint32_t data,
+            uint32_t byte_en, int *resp, int *rdata, int *intr)
+  {
+    if (buffer.empty()) {
+      buffer.resize((size_t)1 << addr_bits);
+      buffer_mask = buffer.size() - 1;
+    }
+    cycle++;
+
+    *resp = OCP_RESP_NULL;
+    *rdata = 0;
+    bool is_reg = ((addr | 0xfff) & buffer_mask) == buffer_mask;
+    uint32_t off = addr & 0xfff;
+    if (cmd == OCP_CMD_WR) {
+      if (!is_reg) {
+        for (unsigned i = 0; i < 4; i++) {
+          if (byte_en & (8 >> i)) {
+            buffer[((addr & ~3) + i) & buffer_mask] = data >> (24 - 8 * i);
+          }
+        }
+      } else if (off == ETHMAC_INT_SOURCE) {
+        regs[off / 4] &= ~data;
+      } else if (off < ETHMAC_REG_SPACE) {
+        regs[off / 4] = data;
+      }
+      *resp = OCP_RESP_DVA;
+    } else if (cmd == OCP_CMD_RD) {
+      if (!is_reg) {
+        uint32_t a = addr & ~3;
+        *rdata = (buffer[a & buffer_mask] << 24) | (buffer[(a+1) & buffer_mask] << 16)
+          | (buffer[(a+2) & buffer_mask] << 8) | buffer[(a+3) & buffer_mask];
+      } else if (off < ETHMAC_REG_SPACE) {
+        *rdata = regs[off / 4];
+      }
+      *resp = OCP_RESP_DVA;
+    }
+
+    transmit();
+    receive();
+    *intr = (regs[ETHMAC_INT_SOURCE / 4] & regs[ETHMAC_INT_MASK / 4]) != 0;
+  }
+
+  void report(ostream &out)
+  {
+    out << "patemu: ethmac: " << tx_frames << " frames (" << tx_bytes
+        << " bytes) sent, " << rx_frames << " frames (" << rx_bytes
+        << " bytes) received" << endl;
+    if (tx_frames > 1 && last_cycle > first_cycle) {
+      out << "patemu: ethmac: " << (double)tx_bytes * 8 * FREQ / (last_cycle - first_cycle) / 1e6
+          << " Mbit/s sent" << endl;
+    }
+  }
+};
+
+static EthMacEmu ethmac;
+
+void patemu_ethmac(int addr_bits, int cmd, int addr, int data, int byte_en,
+                   int *resp, int *rdata, int *intr)
+{
+  ethmac.tick(addr_bits, cmd, addr, data, byte_en, resp, rdata, intr);
+}
+#endif /* IO_ETHMAC */
+
+class Emulator
+{
+  unsigned long m_tickcount;
+  public: VPatmos *c;
+  #if CORE_COUNT > 1
+  // The cores, from the table generated along with emulator_config.h
+  VPatmos_PatmosCore *cores[CORE_COUNT];
+  #endif
+  #if VM_TRACE
+  TraceFile *c_trace;
+  #endif
+  // For Uart:
+  bool UART_on;
+  int baudrate;
+  int freq;
+  char in_byte;
+  char out_byte;
+  int sample_counter_out;
+  int sample_counter_in;
+  int bit_counter_out;
+  int bit_counter_in;
+  char state;
+  bool writing;
+  string write_str;
+  int write_cntr;
+  int write_len;
+  unsigned uart_baud_counter;
+  // Output is buffered until a newline, a full buffer or uart_flush()
+  string uart_out_buf;
+  int uart_out_fd;
+  // Input is read ahead from the file descriptor
+  unsigned char uart_in_buf[UART_IN_BUFSIZE];
+  size_t uart_in_pos;
+  size_t uart_in_len;
+  bool uart_in_eof;
+  // Transmit at one bit per cycle instead of the baud rate
+  bool uart_fast;
+  bool trace;
+  // Wave forms are dumped for cycles trace_first to trace_last only
+  uint64_t trace_first;
+  uint64_t trace_last;
+  ostream *outputTarget = &std::cout;
+  // If set, UART output is appended here instead of written to a file
+  string *uart_capture;
+  // Byte written to the UART in the last cycle, or -1
+  int uart_out_byte;
+  #if EMU_SAVABLE
+  // For the trace ring buffer, the emulator keeps two checkpoints, taken
+  // ring_cycles apart, and the UART input and key changes since the older
+  // one, such that the last cycles can be replayed with tracing enabled.
+  long int ring_cycles;
+  string ring_path[2];
+  uint64_t ring_start[2];
+  int ring_count;
+  vector<pair<uint64_t, unsigned char> > uart_in_log;
+  vector<pair<uint64_t, uint32_t> > keys_log;
+  bool replaying;
+  size_t replay_pos;
+  size_t keys_replay_pos;
+  #endif /* EMU_SAVABLE */
+  // Performance statistics, updated by emu_perf()
+  uint64_t perf_counts[CORE_COUNT][PERF_EVENTS];
+  uint64_t perf_cycles;
+  // Profiler state, see emu_prof(). Samples are taken every prof_interval
+  // cycles and counted per PC, which are mapped to the function symbols
+  // from the ELF file when writing the profile.
+  struct ProfSymbol {
+    val_t addr;
+    val_t size;
+    string name;
+    bool operator<(const ProfSymbol &other) const { return addr < other.addr; }
+  };
+  long int prof_interval;
+  long int prof_countdown;
+  unsigned int prof_base[CORE_COUNT];
+  val_t prof_pc[CORE_COUNT];
+  unordered_map<val_t, array<uint64_t, PROF_EVENTS> > prof_counts[CORE_COUNT];
+  vector<ProfSymbol> prof_symbols;
+  // Halt state of each core, updated by halt_step(): 0 while running, 1
+  // after its return to address 0 and 2 once the exit code was taken one
+  // cycle later
+  unsigned core_halt[CORE_COUNT];
+  uint32_t core_exit[CORE_COUNT];
+  #ifdef IO_TIMER
+  // Timer registers of each core and the state of the cores for
+  // warp_step(). A core spins if it has executed within WARP_SPIN_BYTES of
+  // code for spin_cycles, without writes and without reading devices other
+  // than the timer.
+  struct TimerRegs {
+    QData *cycle;
+    QData *cycle_intr;
+    CData *usec_sub;
+    QData *usec;
+    QData *usec_intr;
+  } timers[CORE_COUNT];
+  long int warp_threshold;
+  long int warp_max;
+  uint32_t spin_lo[CORE_COUNT];
+  uint32_t spin_hi[CORE_COUNT];
+  long int spin_cycles[CORE_COUNT];
+  bool spin_timer[CORE_COUNT];
+  uint64_t warp_count;
+  uint64_t warp_cycles;
+  #endif /* IO_TIMER */
+  // State of memtrace_step(): the current method of each core, and the
+  // stack cache operation in the execute stage in the last cycle
+  uint32_t memtrace_base[CORE_COUNT];
+  uint32_t memtrace_sc_op[CORE_COUNT];
+  uint32_t memtrace_sc_arg[CORE_COUNT];
+  // Fetch PC of each core, updated by update_pc()
+  unsigned int pc_base[CORE_COUNT];
+  val_t pc[CORE_COUNT];
+  // Entry point of the loaded program
+  val_t entry_pc;
+
+  // Lockstep checking of core 0 against the instruction set model. The
+  // bundle in the memory stage is sampled after each cycle; it retires
+  // with the next enabled cycle.
+  IsaSim *isa;
+  bool isa_synced;
+  bool isa_slot_valid;
+  uint32_t isa_slot_pc;
+  uint32_t isa_slot_base;
+  uint64_t isa_bundles;
+  unsigned isa_skipped;
+
+  //elf - mem - ram
+  #ifdef EXTMEM_SSRAM32CTRL
+  SparseMem<uint32_t> ram_buf;
+  uint32_t ram_addr_cnt;
+  uint32_t ram_address;
+  uint32_t ram_counter;
+  #endif /* EXTMEM_SSRAM32CTRL */
+
+  #ifdef EXTMEM_SRAMCTRL
+  SparseMem<uint16_t> ram_buf;
+  #endif /* EXTMEM_SRAMCTRL */
+
+  #ifdef EXTMEM_MEMBRIDGE
+  enum { RAM_IDLE, RAM_READ, RAM_WRITE };
+  SparseMem<uint32_t> ram_buf;
+  MemTiming *ram_timing;
+  uint32_t ram_state;
+  uint32_t ram_address;
+  uint32_t ram_counter;
+  // Cycle from which the current burst may transfer data
+  uint64_t ram_ready;
+  #endif /* EXTMEM_MEMBRIDGE */
+
+public:
+  Emulator(void)
+  #ifdef EXTMEM_EMULATED
+    : ram_buf((size_t)1 << EXTMEM_ADDR_BITS)
+  #endif
+  {
+    #if VM_TRACE
+    Verilated::traceEverOn(true);
+    c_trace = NULL;
+    #endif
+    c = new VPatmos;
+    #if CORE_COUNT > 1
+    VPatmos_PatmosCore *core_table[CORE_COUNT] = { PATMOS_CORES(c) };
+    copy(core_table, core_table + CORE_COUNT, cores);
+    #endif
+    #ifdef IO_TIMER
+    QData *timer_cycle[CORE_COUNT] = { PATMOS_TIMERS(c, cycleReg) };
+    QData *timer_cycle_intr[CORE_COUNT] = { PATMOS_TIMERS(c, cycleIntrReg) };
+    CData *timer_usec_sub[CORE_COUNT] = { PATMOS_TIMERS(c, usecSubReg) };
+    QData *timer_usec[CORE_COUNT] = { PATMOS_TIMERS(c, usecReg) };
+    QData *timer_usec_intr[CORE_COUNT] = { PATMOS_TIMERS(c, usecIntrReg) };
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      timers[n].cycle = timer_cycle[n];
+      timers[n].cycle_intr = timer_cycle_intr[n];
+      timers[n].usec_sub = timer_usec_sub[n];
+      timers[n].usec = timer_usec[n];
+      timers[n].usec_intr = timer_usec_intr[n];
+    }
+    warp_threshold = 0;
+    #endif /* IO_TIMER */
+    m_tickcount = 0l;
+
+    //for UART
+    UART_on = false;
+    uart_baud_counter = 0;
+    uart_out_fd = STDOUT_FILENO;
+    uart_in_pos = 0;
+    uart_in_len = 0;
+    uart_in_eof = false;
+    uart_fast = false;
+    uart_capture = NULL;
+    uart_out_byte = -1;
+    #if EMU_SAVABLE
+    ring_cycles = 0;
+    ring_count = 0;
+    replaying = false;
+    replay_pos = 0;
+    keys_replay_pos = 0;
+    #endif /* EMU_SAVABLE */
+    c->io_UartCmp_rx = 1; // keep UART tx high when idle
+    outputTarget = &cout; // default uart print to terminal
+
+    #ifdef EXTMEM_SSRAM32CTRL
+    ram_addr_cnt = 0;
+    ram_address = 0;
+    ram_counter = 0;
+    #endif /* EXTMEM_SSRAM32CTRL */
+
+    #ifdef EXTMEM_MEMBRIDGE
+    ram_timing = new_extmem_timing();
+    ram_state = RAM_IDLE;
+    ram_address = 0;
+    ram_counter = 0;
+    ram_ready = 0;
+    #endif /* EXTMEM_MEMBRIDGE */
+
+    perf_reset();
+    prof_interval = 0;
+    prof_reset();
+    trace = false;
+    trace_first = 0;
+    trace_last = UINT64_MAX;
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      pc_base[n] = 0;
+      pc[n] = 0;
+    }
+    entry_pc = 0;
+    isa = NULL;
+    halt_reset();
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      memtrace_base[n] = 0;
+      memtrace_sc_op[n] = 0;
+    }
+  }
+
+  ~Emulator(void)
+  {
+    uart_flush();
+    stopTrace();
+    delete isa;
+    #ifdef EXTMEM_MEMBRIDGE
+    delete ram_timing;
+    #endif
+    delete c;
+    c = NULL;
+  }
+
+  // Dump wave forms for cycles first to last. The file is opened right
+  // away, but only the cycles in the window are written to it.
+  void setTrace(uint64_t first = 0, uint64_t last = UINT64_MAX){
+    #if VM_TRACE
+    trace = true;
+    trace_first = first;
+    trace_last = last;
+    if (!c_trace){
+      c_trace = new TraceFile;
+			c->trace(c_trace, 99);
+			c_trace->open(TRACE_FILE);
+    }
+    #else
+    cerr << "patemu: warning: emulator built without tracing support, ignoring -v" << endl;
+    #endif
+  }
+
+  void stopTrace(){
+    #if VM_TRACE
+    if (trace){
+      if (c_trace) {
+        c_trace->close();
+        delete c_trace;
+        c_trace = NULL;
+      }
+    }
+    #endif
+    trace = false;
+  }
+
+  void reset(int cycles)
+  {
+    c->reset = 1;
+    // Make sure any inheritance gets applied
+    for (int i = 0; i < cycles; i++)
+    {
+      this->tick(STDIN_FILENO, STDOUT_FILENO);
+    }
+    c->reset = 0;
+  }
+
+  void tick(int uart_in,int uart_out)
+  {
+    // Increment our own internal time reference
+    m_tickcount++;
+
+    // Make sure any combinatorial logic depending upon
+    // inputs that may have changed before we called tick()
+    // has settled before the rising edge of the clock.
+    c->clock = 0;
+    c->eval();
+
+    #if VM_TRACE
+    bool dump = trace && m_tickcount >= trace_first && m_tickcount <= trace_last;
+    if (dump) {
+      c_trace->dump(10*m_tickcount+5);
+    }
+    #endif
+    // Toggle the clock
+    // Rising edge
+    c->clock = 1;
+    c->eval();
+
+    //UART emulation
+    if (UART_on)
+    {
+      emu_uart(uart_in, uart_out);
+    }
+
+    #if VM_TRACE
+    if (dump) {
+      c_trace->dump(10*m_tickcount+10);
+    }
+    // Close the file at the end of the window, such that it is complete
+    // even if the emulator does not terminate normally
+    if (trace && m_tickcount >= trace_last) {
+      stopTrace();
+    }
+    #endif
+  }
+
+  long int get_tick_count(void)
+  {
+    return m_tickcount;
+  }
+
+  bool done(void) { return (Verilated::gotFinish()); }
+
+  // UART methods below
+  void UART_init()
+  {
+    baudrate = BAUDRATE;
+    freq = FREQ;
+    UART_on = true;
+  }
+
+
+  void emu_uart(int uart_in,int uart_out) {//int uart_in, int uart_out
+    // Pass on data from UART
+    uart_out_byte = -1;
+    if (c->Patmos__DOT__UartCmp__DOT__uart__DOT__uartOcpEmu_Cmd == 0x1
+        && (c->Patmos__DOT__UartCmp__DOT__uart__DOT__uartOcpEmu_Addr & 0xff) == 0x04) {
+      unsigned char d = c->Patmos__DOT__UartCmp__DOT__uart__DOT__uartOcpEmu_Data;
+      uart_out_byte = d;
+      #if EMU_SAVABLE
+      if (replaying) {
+        // Output was already written when the cycle was first emulated
+      } else
+      #endif /* EMU_SAVABLE */
+      if (uart_capture != NULL) {
+        uart_capture->push_back(d);
+      } else {
+        if (uart_out != uart_out_fd) {
+          uart_flush();
+          uart_out_fd = uart_out;
+        }
+        uart_out_buf.push_back(d);
+        if (d == '\n' || uart_out_buf.size() >= UART_OUT_BUFSIZE) {
+          uart_flush();
+        }
+      }
+    }
+
+    // In fast mode, the transmitter sees a baud tick in every cycle, while
+    // input still arrives at the configured baud rate
+    bool baud_tick;
+    if (uart_fast) {
+      c->Patmos__DOT__UartCmp__DOT__uart__DOT__tx_baud_counter = FREQ/BAUDRATE;
+      baud_tick = m_tickcount % (FREQ/BAUDRATE + 1) == 0;
+    } else {
+      baud_tick = c->Patmos__DOT__UartCmp__DOT__uart__DOT__tx_baud_tick;
+    }
+
+    // Pass on data to UART
+    if (baud_tick) {
+      uart_baud_counter = (uart_baud_counter + 1) % 10;
+    }
+    #if EMU_SAVABLE
+    if (replaying) {
+      // Replay the recorded input, the file descriptor has moved on
+      if (replay_pos < uart_in_log.size()
+          && uart_in_log[replay_pos].first == m_tickcount) {
+        uart_rx(uart_in_log[replay_pos++].second);
+      }
+      return;
+    }
+    #endif /* EMU_SAVABLE */
+    if (baud_tick && uart_baud_counter == 0) {
+      // Only look for new input when the read-ahead buffer is empty
+      if (uart_in_pos == uart_in_len && !uart_in_eof) {
+        struct pollfd pfd;
+        pfd.fd = uart_in;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) > 0) {
+          ssize_t r = read(uart_in, uart_in_buf, UART_IN_BUFSIZE);
+          if (r < 0) {
+            cerr << "patemu: error: Cannot read UART input" << endl;
+          } else if (r == 0) {
+            uart_in_eof = true;
+          } else {
+            uart_in_pos = 0;
+            uart_in_len = r;
+          }
+        }
+      }
+      if (uart_in_pos < uart_in_len) {
+        unsigned char d = uart_in_buf[uart_in_pos++];
+        #if EMU_SAVABLE
+        if (ring_cycles > 0) {
+          uart_in_log.push_back(make_pair((uint64_t)m_tickcount, d));
+        }
+        #endif /* EMU_SAVABLE */
+        uart_rx(d);
+      }
+    }
+  }
+
+  // Write buffered UART output
+  void uart_flush(void) {
+    size_t done = 0;
+    while (done < uart_out_buf.size()) {
+      ssize_t w = write(uart_out_fd, uart_out_buf.data() + done,
+                        uart_out_buf.size() - done);
+      if (w <= 0) {
+        if (w < 0 && errno == EINTR) {
+          continue;
+        }
+        cerr << "patemu: error: Cannot write UART output" << endl;
+        break;
+      }
+      done += w;
+    }
+    uart_out_buf.clear();
+  }
+
+  void UART_fast(bool fast)
+  {
+    uart_fast = fast;
+  }
+
+  // Make the UART receive a byte
+  void uart_rx(unsigned char d) {
+    c->Patmos__DOT__UartCmp__DOT__uart__DOT__rx_state = 0x3; // rx_stop_bit
+    c->Patmos__DOT__UartCmp__DOT__uart__DOT__rx_baud_tick = 1;
+    c->Patmos__DOT__UartCmp__DOT__uart__DOT__rxd_reg2 = 1;
+    c->Patmos__DOT__UartCmp__DOT__uart__DOT__rx_buff = d;
+  }
+
+  int get_uart_out_byte(void)
+  {
+    return uart_out_byte;
+  }
+
+  void emu_keys(void){
+    #if EMU_SAVABLE
+    if (replaying) {
+      // Replay the recorded changes, the state of rand() has moved on
+      if (keys_replay_pos < keys_log.size()
+          && keys_log[keys_replay_pos].first == m_tickcount) {
+        c->io_Keys_key = keys_log[keys_replay_pos++].second;
+      }
+      return;
+    }
+    #endif /* EMU_SAVABLE */
+    if ((rand() % 0x10000) == 0) {
+      c->io_Keys_key = rand();
+      #if EMU_SAVABLE
+      if (ring_cycles > 0) {
+        keys_log.push_back(make_pair((uint64_t)m_tickcount, (uint32_t)c->io_Keys_key));
+      }
+      #endif /* EMU_SAVABLE */
+    }
+  }
+
+  void UART_to_file(string path)
+  {
+    static ofstream outFile;
+    if (!outFile.is_open())
+    {
+      outFile.open(path);
+    }
+    outputTarget = &outFile;
+  }
+
+  void UART_to_console(void)
+  {
+    outputTarget = &cout;
+  }
+
+  void UART_to_string(string *buf)
+  {
+    uart_capture = buf;
+  }
+
+  // Read a big-endian word from the ELF image
+  static inline val_t load_be32(const unsigned char *p)
+  {
+    return (((val_t)p[0] << 24) | ((val_t)p[1] << 16) |
+            ((val_t)p[2] << 8) | ((val_t)p[3] << 0));
+  }
+
+  // Write a word to the ISPMs of all cores, the address must map to the ISPM
+  void write_ispm(val_t paddr, val_t word)
+  {
+    val_t addr = (paddr - (0x1 << OCMEM_ADDR_BITS)) >> 3;
+    for (unsigned n = 0; n < CORE_COUNT; n++)
+    {
+      auto &mem_even = CORE_PVT(n, fetch__DOT__MemBlock__DOT__mem);
+      auto &mem_odd = CORE_PVT(n, fetch__DOT__MemBlock_1__DOT__mem);
+      unsigned size = sizeof(mem_even) / sizeof(mem_even[0]);
+      assert(addr < size && "Instructions mapped to ISPM exceed size");
+
+      // Write to even or odd block
+      if ((paddr & 0x4) == 0)
+      {
+        mem_even[addr] = word;
+      }
+      else
+      {
+        mem_odd[addr] = word;
+      }
+    }
+  }
+
+  // Load an ELF file into the ISPM and the external memory. The file is
+  // mapped into memory and copied segment by segment, word by word.
+  // Returns false if the file is not a Patmos ELF file.
+  bool readelf(int fd, val_t &entry)
+  {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+      cerr << "readelf: cannot read ELF file.\n";
+      return false;
+    }
+    size_t size = st.st_size;
+
+    // private mapping, in case libelf modifies the image
+    unsigned char *image = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED)
+    {
+      cerr << "readelf: cannot map ELF file: " << strerror(errno) << "\n";
+      return false;
+    }
+
+    // check libelf version
+    elf_version(EV_CURRENT);
+
+    // open elf binary
+    Elf *elf = elf_memory((char *)image, size);
+    bool ok = readelf_image(elf, image, size, entry);
+    if (elf != NULL)
+    {
+      elf_end(elf);
+    }
+    munmap(image, size);
+    return ok;
+  }
+
+  // Check the headers of a mapped ELF file and copy its segments
+  bool readelf_image(Elf *elf, const unsigned char *image, size_t size, val_t &entry)
+  {
+    // check file kind
+    if (elf == NULL || elf_kind(elf) != ELF_K_ELF)
+    {
+      cerr << "readelf: ELF file must be of kind ELF.\n";
+      return false;
+    }
+
+    // get elf header
+    GElf_Ehdr hdr;
+    if (gelf_getehdr(elf, &hdr) == NULL)
+    {
+      cerr << "readelf: cannot read ELF header.\n";
+      return false;
+    }
+
+    if (hdr.e_machine != 0xBEEB)
+    {
+      cerr << "readelf: unsupported architecture: ELF file is not a Patmos ELF file.\n";
+      return false;
+    }
+
+    // check class
+    int ec = gelf_getclass(elf);
+    if (ec != ELFCLASS32)
+    {
+      cerr << "readelf: unsupported architecture: ELF file is not a 32bit Patmos ELF file.\n";
+      return false;
+    }
+
+    // get program headers
+    size_t n;
+    if (elf_getphdrnum(elf, &n) != 0)
+    {
+      cerr << "readelf: cannot read program headers.\n";
+      return false;
+    }
+
+    for (size_t i = 0; i < n; i++)
+    {
+      // get program header
+      GElf_Phdr phdr;
+      if (gelf_getphdr(elf, i, &phdr) == NULL)
+      {
+        cerr << "readelf: cannot read program header " << i << ".\n";
+        return false;
+      }
+
+      if (phdr.p_type == PT_LOAD)
+      {
+        // the segment must be within the file and word-aligned
+        //assert(phdr.p_vaddr == phdr.p_paddr);
+        if (phdr.p_filesz > phdr.p_memsz || (phdr.p_paddr & 0x3) != 0
+            || phdr.p_offset > size || phdr.p_filesz > size - phdr.p_offset)
+        {
+          cerr << "readelf: invalid segment " << i << ".\n";
+          return false;
+        }
+
+        const unsigned char *data = image + phdr.p_offset;
+        size_t fullwords = phdr.p_filesz / 4;
+        size_t filewords = (phdr.p_filesz + 3) / 4;
+        size_t memwords = (phdr.p_memsz + 3) / 4;
+
+        // a partial word at the end of the file contents is padded with zeros
+        unsigned char tail[4] = { 0, 0, 0, 0 };
+        memcpy(tail, data + 4 * fullwords, phdr.p_filesz - 4 * fullwords);
+
+        // copy executable code that maps to the ISPM
+        if ((phdr.p_flags & PF_X) != 0)
+        {
+          for (size_t w = 0; w < memwords; w++)
+          {
+            val_t paddr = phdr.p_paddr + 4 * w;
+            if ((paddr >> OCMEM_ADDR_BITS) == 0x1)
+            {
+              val_t word = w < fullwords ? load_be32(data + 4 * w) :
+                (w < filewords ? load_be32(tail) : 0);
+              write_ispm(paddr, word);
+            }
+          }
+        }
+
+        // copy the whole segment to the external memory and clear .bss
+        val_t base = phdr.p_paddr >> 2;
+        for (size_t w = 0; w < fullwords; w++)
+        {
+          write_extmem(base + w, load_be32(data + 4 * w));
+        }
+        if (fullwords < filewords)
+        {
+          write_extmem(base + fullwords, load_be32(tail));
+        }
+        clear_extmem(base + filewords, memwords - filewords);
+      }
+    }
+
+    // function symbols for the profiler
+    if (prof_interval > 0)
+    {
+      read_symbols(elf);
+    }
+
+    // get entry point
+    entry = hdr.e_entry;
+    return true;
+  }
+
+  void read_symbols(Elf *elf)
+  {
+    prof_symbols.clear();
+    Elf_Scn *scn = NULL;
+    while ((scn = elf_nextscn(elf, scn)) != NULL)
+    {
+      GElf_Shdr shdr;
+      if (gelf_getshdr(scn, &shdr) == NULL || shdr.sh_type != SHT_SYMTAB)
+      {
+        continue;
+      }
+      Elf_Data *data = elf_getdata(scn, NULL);
+      size_t count = shdr.sh_entsize > 0 ? shdr.sh_size / shdr.sh_entsize : 0;
+      for (size_t i = 0; data != NULL && i < count; i++)
+      {
+        GElf_Sym sym;
+        if (gelf_getsym(data, i, &sym) == NULL
+            || GELF_ST_TYPE(sym.st_info) != STT_FUNC)
+        {
+          continue;
+        }
+        const char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+        ProfSymbol ps = { sym.st_value, sym.st_size, name != NULL ? name : "" };
+        prof_symbols.push_back(ps);
+      }
+    }
+    sort(prof_symbols.begin(), prof_symbols.end());
+  }
+
+  #ifdef EXTMEM_SSRAM32CTRL //TODO test this
+  void write_extmem(val_t address, val_t word)
+  {
+    ram_buf[address] = word;
+  }
+
+  void clear_extmem(val_t address, size_t words)
+  {
+    ram_buf.zero(address, words);
+  }
+
+  void init_extmem() {
+    //only needed for random init
+    ram_buf.set_random(true);
+  }
+
+  void emu_extmem() {
+    // Start of request
+    if (c->io_sSRam32CtrlPins_ramOut_nadsc != 1) {
+      ram_address = c->io_sSRam32CtrlPins_ramOut_addr;
+      ram_addr_cnt = ram_address;
+      ram_counter = 0;
+    }
+
+    // Advance address for burst
+    if (c->io_sSRam32CtrlPins_ramOut_nadv != 1) {
+      ram_addr_cnt++;
+    }
+
+    // Read from external memory
+    if (c->io_sSRam32CtrlPins_ramOut_noe != 1) {
+      ram_counter++;
+      if (ram_counter >= SRAM_CYCLES) {
+        c->io_sSRam32CtrlPins_ramIn_din = ram_buf.read(ram_address);
+        if (ram_address <= ram_addr_cnt) {
+          ram_address++;
+        }
+      }
+    }
+
+    // Write to external memory
+    if (c->io_sSRam32CtrlPins_ramOut_nbwe == 0) {
+      uint32_t nbw = c->io_sSRam32CtrlPins_ramOut_nbw;
+      uint32_t mask = 0x00000000;
+      for (unsigned i = 0; i < 4; i++) {
+        if ((nbw & (1 << i)) == 0) {
+          mask |= 0xff << (i*8);
+        }
+      }
+
+      uint32_t &word = ram_buf[ram_address];
+      word &= ~mask;
+      word |= mask & ((unsigned long int) c->io_sSRam32CtrlPins_ramOut_dout);
+
+      if (ram_address <= ram_addr_cnt) {
+        ram_address++;
+      }
+    }
+  }
+
+#endif /*EXTMEM_SSRAM32CTRL*/
+
+#ifdef EXTMEM_SRAMCTRL
+  void write_extmem(val_t address, val_t word) {
+    ram_buf[(address << 1) | 0] = word & 0xffff;
+    ram_buf[(address << 1) | 1] = word >> 16;
+  }
+
+  void clear_extmem(val_t address, size_t words) {
+    ram_buf.zero(address << 1, words << 1);
+  }
+
+  void init_extmem() {
+    //only needed for random init
+    ram_buf.set_random(true);
+  }
+
+  void emu_extmem() {
+    uint32_t address = (uint32_t) c->io_SRamCtrl_ramOut_addr;
+    // Read from external memory unconditionally
+    c->io_SRamCtrl_ramIn_din = ram_buf.read(address);
+
+    // Write to external memory
+    if (c->io_SRamCtrl_ramOut_nwe != 1) {
+      uint16_t mask = 0x0000;
+      if (c->io_SRamCtrl_ramOut_nub != 1) {
+        mask |= 0xff00;
+      }
+      if (c->io_SRamCtrl_ramOut_nlb != 1) {
+        mask |= 0x00ff;
+      }
+      uint16_t &word = ram_buf[address];
+      word &= ~mask;
+      word |= mask & ((unsigned long int) c->io_SRamCtrl_ramOut_dout);
+    }
+  }
+#endif /*EXTMEM_SRAMCTRL*/
+
+#ifdef EXTMEM_MEMBRIDGE
+  void write_extmem(val_t address, val_t word) {
+    ram_buf[address] = word;
+  }
+
+  void clear_extmem(val_t address, size_t words) {
+    ram_buf.zero(address, words);
+  }
+
+  void init_extmem() {
+    //only needed for random init
+    ram_buf.set_random(true);
+  }
+
+  // Write one word of a write burst, respecting the byte enables
+  void write_burst_word(void) {
+    uint32_t byte_en = c->io_MemBridge_M_DataByteEn;
+    uint32_t mask = 0x00000000;
+    for (unsigned i = 0; i < 4; i++) {
+      if ((byte_en & (1 << i)) != 0) {
+        mask |= 0xff << (i*8);
+      }
+    }
+    uint32_t &word = ram_buf[ram_address + ram_counter];
+    word &= ~mask;
+    word |= mask & (uint32_t) c->io_MemBridge_M_Data;
+    ram_counter++;
+  }
+
+  // Emulate the memory as an OCP burst slave. The timing model decides
+  // when the data of a read burst becomes available and when a write burst
+  // is acknowledged; the transfer itself takes one word per cycle.
+  void emu_extmem() {
+    c->io_MemBridge_S_CmdAccept = 0;
+    c->io_MemBridge_S_DataAccept = 0;
+    c->io_MemBridge_S_Resp = OCP_RESP_NULL;
+
+    switch (ram_state) {
+    case RAM_IDLE: {
+      uint32_t cmd = c->io_MemBridge_M_Cmd;
+      if (cmd != OCP_CMD_RD && cmd != OCP_CMD_WR) {
+        break;
+      }
+      uint32_t addr = c->io_MemBridge_M_Addr;
+      bool write = cmd == OCP_CMD_WR;
+      ram_address = (addr >> 2) & ~(EXTMEM_BURST_LENGTH-1);
+      ram_counter = 0;
+      ram_ready = m_tickcount + ram_timing->access(m_tickcount, addr, write);
+      c->io_MemBridge_S_CmdAccept = 1;
+      if (write) {
+        // The first word of a write burst comes with the command
+        ram_ready += EXTMEM_BURST_LENGTH;
+        c->io_MemBridge_S_DataAccept = 1;
+        write_burst_word();
+        ram_state = RAM_WRITE;
+      } else {
+        ram_state = RAM_READ;
+      }
+      break;
+    }
+    case RAM_READ:
+      if (m_tickcount >= ram_ready) {
+        c->io_MemBridge_S_Resp = OCP_RESP_DVA;
+        c->io_MemBridge_S_Data = ram_buf.read(ram_address + ram_counter);
+        if (++ram_counter == EXTMEM_BURST_LENGTH) {
+          ram_state = RAM_IDLE;
+        }
+      }
+      break;
+    case RAM_WRITE:
+      if (ram_counter < EXTMEM_BURST_LENGTH) {
+        if (c->io_MemBridge_M_DataValid) {
+          c->io_MemBridge_S_DataAccept = 1;
+          write_burst_word();
+        }
+      } else if (m_tickcount >= ram_ready) {
+        c->io_MemBridge_S_Resp = OCP_RESP_DVA;
+        ram_state = RAM_IDLE;
+      }
+      break;
+    }
+  }
+#endif /*EXTMEM_MEMBRIDGE*/
+
+  // Print the statistics of the external memory timing model
+  void extmem_report(ostream &out)
+  {
+    #ifdef EXTMEM_MEMBRIDGE
+    ram_timing->report(out);
+    #endif
+  }
+
+  // Read a word from the external memory, for tracing
+  val_t read_extmem(val_t address)
+  {
+    #if defined(EXTMEM_SSRAM32CTRL) || defined(EXTMEM_MEMBRIDGE)
+    return ram_buf.read(address);
+    #elif defined(EXTMEM_SRAMCTRL)
+    return ram_buf.read((address << 1) | 0) | ((val_t)ram_buf.read((address << 1) | 1) << 16);
+    #else
+    return 0;
+    #endif
+  }
+
+  // Bytes of external memory that the program has written to
+  size_t extmem_footprint(void)
+  {
+    #ifdef EXTMEM_EMULATED
+    return ram_buf.footprint();
+    #else
+    return 0;
+    #endif
+  }
+
+  void init_icache(val_t entry)
+  {
+    
+    tick(STDIN_FILENO, STDOUT_FILENO);
+    if (entry == 0)
+    {
+      return;
+    }
+    for (unsigned n = 0; n < CORE_COUNT; n++)
+    {
+      if (entry >= 0x20000)
+      {
+#ifdef ICACHE_METHOD
+        //init for method cache
+        CORE_PUB(n, fetch__DOT__pcNext) = -1;
+        CORE_PUB(n, icache__DOT__repl__DOT__hitNext) = 0;
+#endif /* ICACHE_METHOD */
+#ifdef ICACHE_LINE
+        //init for icache
+        CORE_PUB(n, fetch__DOT__pcNext) = (entry >> 2) - 1;
+#endif /* ICACHE_LINE */
+        CORE_PUB(n, fetch__DOT__relBaseNext) = 0;
+        CORE_PUB(n, fetch__DOT__relocNext) = (entry >> 2) - 1;
+        CORE_PUB(n, fetch__DOT__selCacheNext) = 1;
+        CORE_PUB(n, icache__DOT__repl__DOT__selCacheNext) = 1;
+      }
+      else
+      {
+        // pcReg for ispm starts at entry point - ispm base
+        CORE_PUB(n, fetch__DOT__pcNext) = ((entry - 0x10000) >> 2) - 1;
+        CORE_PUB(n, fetch__DOT__relBaseNext) = (entry - 0x10000) >> 2;
+        CORE_PUB(n, fetch__DOT__relocNext) = 0x10000 >> 2;
+        CORE_PUB(n, fetch__DOT__selSpmNext) = 1;
+        CORE_PUB(n, icache__DOT__repl__DOT__selSpmNext) = 1;
+      }
+      CORE_PUB(n, icache__DOT__repl__DOT__callRetBaseNext) = (entry >> 2);
+#ifdef ICACHE_METHOD
+      CORE_PUB(n, icache__DOT__ctrl__DOT__callRetBaseNext) = (entry >> 2);
+#endif /* ICACHE_METHOD */
+#ifdef ICACHE_LINE
+      CORE_PUB(n, fetch__DOT__relBaseNext) = (entry >> 2);
+#endif /* ICACHE_LINE */
     }
-
-    if (trace) {
-      c_trace->dump(10*m_tickcount+10);
-      c_trace->flush();
+  }
+  // Update the fetch PC of the enabled cores, to be called once in each cycle
+  void update_pc()
+  {
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      if (!core_enabled(n)) {
+        continue;
+      }
+      pc[n] = (pc_base[n] + CORE_PUB(n, fetch__DOT__pcNext)) * 4 - CORE_PUB(n, fetch__DOT__relBaseNext) * 4;
+      pc_base[n] = CORE_PUB(n, icache__DOT__repl__DOT__callRetBaseNext);
     }
   }
 
-  long int get_tick_count(void)
+  val_t get_pc(unsigned n = 0)
   {
-    return m_tickcount;
+    return pc[n];
   }
 
-  bool done(void) { return (Verilated::gotFinish()); }
+  bool core_enabled(unsigned n = 0)
+  {
+    return CORE_PVT(n, enableReg);
+  }
 
-  // UART methods below
-  void UART_init()
+  // Return to address 0 on core 0 halts the execution
+  bool at_halt(unsigned n = 0)
   {
-    baudrate = BAUDRATE;
-    freq = FREQ;
-    UART_on = true;
+    return (CORE_PVT(n, memory__DOT__memReg_mem_brcf) == 1
+            || CORE_PVT(n, memory__DOT__memReg_mem_ret) == 1)
+      && CORE_PVT(n, icache__DOT__repl__DOT__callRetBaseReg) == 0;
   }
 
+  // The return value of main() is passed in r1
+  uint32_t exit_code(unsigned n = 0)
+  {
+    return CORE_PVT(n, decode__DOT__rf__DOT__rf)[1];
+  }
 
-  void emu_uart(int uart_in,int uart_out) {//int uart_in, int uart_out
-    static unsigned baud_counter = 0;
+  void halt_reset(void)
+  {
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      core_halt[n] = 0;
+      core_exit[n] = 0;
+    }
+  }
 
-    // Pass on data from UART
-    if (c->Patmos__DOT__UartCmp__DOT__uart__DOT__uartOcpEmu_Cmd == 0x1
-        && (c->Patmos__DOT__UartCmp__DOT__uart__DOT__uartOcpEmu_Addr & 0xff) == 0x04) {
-      unsigned char d = c->Patmos__DOT__UartCmp__DOT__uart__DOT__uartOcpEmu_Data;
-      int w = write(uart_out, &d, 1);
-      if (w != 1) {
-        cerr << "patemu: error: Cannot write UART output" << endl;
+  // Watch all cores for their return to address 0, to be called in every
+  // cycle. Like for core 0 in the main loop, the exit code is taken one
+  // cycle after the return.
+  void halt_step(void)
+  {
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      if (core_halt[n] == 1) {
+        core_exit[n] = exit_code(n);
+        core_halt[n] = 2;
+      } else if (core_halt[n] == 0 && at_halt(n)) {
+        core_halt[n] = 1;
       }
     }
+  }
 
-    // Pass on data to UART
-    bool baud_tick = c->Patmos__DOT__UartCmp__DOT__uart__DOT__tx_baud_tick;
-    if (baud_tick) {
-      baud_counter = (baud_counter + 1) % 10;
-    }
-    if (baud_tick && baud_counter == 0) {
-      struct pollfd pfd;
-      pfd.fd = uart_in;
-      pfd.events = POLLIN;
-      if (poll(&pfd, 1, 0) > 0) {
-        unsigned char d;
-        int r = read(uart_in, &d, 1);
-        if (r != 0) {
-          if (r != 1) {
-            cerr << "patemu: error: Cannot read UART input" << endl;
-          } else {
-            c->Patmos__DOT__UartCmp__DOT__uart__DOT__rx_state = 0x3; // rx_stop_bit
-            c->Patmos__DOT__UartCmp__DOT__uart__DOT__rx_baud_tick = 1;
-            c->Patmos__DOT__UartCmp__DOT__uart__DOT__rxd_reg2 = 1;
-            c->Patmos__DOT__UartCmp__DOT__uart__DOT__rx_buff = d;
-          }
-        }
+  // Write the exit codes as JSON array, with null for cores that did not halt
+  void halt_json(ostream &out)
+  {
+    out << "[";
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      out << (n > 0 ? ", " : "");
+      if (core_halt[n] == 2) {
+        out << core_exit[n];
+      } else {
+        out << "null";
       }
     }
+    out << "]";
   }
 
-  void emu_keys(void){
-    if ((rand() % 0x10000) == 0) {
-      c->io_Keys_key = rand();
+  void halt_report(ostream &out)
+  {
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      out << "patemu: core " << n;
+      if (core_halt[n] == 2) {
+        out << " exit code " << core_exit[n] << endl;
+      } else {
+        out << " did not halt" << endl;
+      }
     }
   }
 
-  void UART_to_file(string path)
+  #ifdef IO_TIMER
+  // Fast-forward when all cores spin for at least threshold cycles, by at
+  // most max cycles at once
+  void warp_enable(long int threshold, long int max)
   {
-    static ofstream outFile;
-    if (!outFile.is_open())
-    {
-      outFile.open(path);
+    warp_threshold = threshold;
+    warp_max = max;
+    warp_count = 0;
+    warp_cycles = 0;
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      spin_cycles[n] = 0;
     }
-    outputTarget = &outFile;
   }
 
-  void UART_to_console(void)
+  // Cycles until the first of the timer interrupts of all cores
+  uint64_t warp_limit(void)
   {
-    outputTarget = &cout;
+    uint64_t limit = UINT64_MAX;
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      const TimerRegs &t = timers[n];
+      if (*t.cycle_intr > *t.cycle) {
+        limit = min(limit, (uint64_t)(*t.cycle_intr - *t.cycle));
+      }
+      if (*t.usec_intr > *t.usec) {
+        limit = min(limit, (*t.usec_intr - *t.usec - 1) * CYCLES_PER_USEC
+                    + (CYCLES_PER_USEC - *t.usec_sub));
+      }
+    }
+    return limit;
   }
 
-  //static val_t readelf(istream &is, Patmos_t *c)
-  val_t readelf(istream &is)
+  // Skip idle cycles, to be called in every cycle after warp_enable(). If
+  // all cores that did not halt spin and one of them polls the timer, the
+  // program waits for time to pass. The timers and the cycle count then
+  // advance at once, but never past a timer interrupt or the cycle limit.
+  // The rest of the system does not advance. A deadline that the program
+  // polls for is not visible in the timer, so the warp cannot stop at it
+  // and the loop may see it up to warp_max cycles late; the usage text of
+  // -W states that timing is not exact.
+  void warp_step(long int limit)
   {
-    vector<unsigned char> elfbuf;
-    elfbuf.reserve(1 << 20);
-
-    // read the whole stream.
-    while (!is.eof())
-    {
-      char buf[1024];
-
-      // read into buffer
-      is.read(&buf[0], sizeof(buf));
+    bool idle = true;
+    bool polling = false;
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      if (core_halt[n] != 0) {
+        continue;
+      }
+      uint32_t pc = (CORE_PVT(n, memory__DOT__memReg_base)
+                     + CORE_PVT(n, memory__DOT__memReg_relPc)) * 4;
+      uint32_t cmd = CORE_PUB(n, memory__DOT__io_localInOut_M_Cmd);
+      uint32_t device = CORE_PUB(n, memory__DOT__io_localInOut_M_Addr) >> 16;
+      bool timer_read = cmd == OCP_CMD_RD && device == IO_DEVICE(IO_TIMER_OFFSET);
+      bool quiet = cmd == OCP_CMD_IDLE || timer_read
+        || (cmd == OCP_CMD_RD && device == IO_DEVICE(IO_CPUINFO_OFFSET));
+      if (!quiet || CORE_PUB(n, memory__DOT__io_globalInOut_M_Cmd) == OCP_CMD_WR) {
+        spin_cycles[n] = 0;
+      } else if (spin_cycles[n] > 0
+                 && max(spin_hi[n], pc) - min(spin_lo[n], pc) <= WARP_SPIN_BYTES) {
+        spin_lo[n] = min(spin_lo[n], pc);
+        spin_hi[n] = max(spin_hi[n], pc);
+        spin_cycles[n]++;
+        spin_timer[n] |= timer_read;
+      } else {
+        spin_lo[n] = spin_hi[n] = pc;
+        spin_cycles[n] = 1;
+        spin_timer[n] = timer_read;
+      }
+      idle &= spin_cycles[n] >= warp_threshold;
+      polling |= spin_timer[n];
+    }
+    if (!idle || !polling) {
+      return;
+    }
 
-      // check how much was read
-      streamsize count = is.gcount();
-      assert(count <= 1024);
+    uint64_t skip = warp_max;
+    if (limit >= 0) {
+      long int left = limit - (long int)m_tickcount;
+      skip = min(skip, (uint64_t)max(left, 0L));
+    }
+    uint64_t intr = warp_limit();
+    skip = min(skip, intr > WARP_MARGIN ? intr - WARP_MARGIN : 0);
+    if (skip == 0) {
+      return;
+    }
 
-      // write into main memory
-      for (unsigned i = 0; i < count; i++)
-        elfbuf.push_back(buf[i]);
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      const TimerRegs &t = timers[n];
+      uint64_t sub = *t.usec_sub + skip;
+      *t.cycle += skip;
+      *t.usec += sub / CYCLES_PER_USEC;
+      *t.usec_sub = sub % CYCLES_PER_USEC;
+      // The cores would have spent the skipped cycles in their loops
+      if (prof_interval > 0 && core_halt[n] == 0) {
+        prof_counts[n][prof_pc[n]][PROF_CYCLES] += skip;
+      }
+      spin_cycles[n] = 0;
     }
+    m_tickcount += skip;
+    perf_cycles += skip;
+    warp_count++;
+    warp_cycles += skip;
+  }
 
-    // check libelf version
-    elf_version(EV_CURRENT);
+  void warp_report(ostream &out)
+  {
+    out << "patemu: " << warp_count << " fast-forwards, "
+        << warp_cycles << " cycles skipped" << endl;
+  }
+  #endif /* IO_TIMER */
 
-    // open elf binary
-    Elf *elf = elf_memory((char *)&elfbuf[0], elfbuf.size());
-    assert(elf);
+  void perf_reset(void)
+  {
+    memset(perf_counts, 0, sizeof(perf_counts));
+    perf_cycles = 0;
+  }
 
-    // check file kind
-    Elf_Kind ek = elf_kind(elf);
-    if (ek != ELF_K_ELF)
-    {
-      cerr << "readelf: ELF file must be of kind ELF.\n";
-      exit(EXIT_FAILURE);
-    }
+  void perf_count(unsigned n, bool ic_hit, bool ic_miss, bool dc_hit, bool dc_miss,
+                  bool sc_spill, bool sc_fill, bool wc_hit, bool wc_miss,
+                  bool mem_read, bool mem_write, bool enable)
+  {
+    uint64_t *counts = perf_counts[n];
+    counts[PERF_IC_HIT] += ic_hit;
+    counts[PERF_IC_MISS] += ic_miss;
+    counts[PERF_DC_HIT] += dc_hit;
+    counts[PERF_DC_MISS] += dc_miss;
+    counts[PERF_SC_SPILL] += sc_spill;
+    counts[PERF_SC_FILL] += sc_fill;
+    counts[PERF_WC_HIT] += wc_hit;
+    counts[PERF_WC_MISS] += wc_miss;
+    counts[PERF_MEM_READ] += mem_read;
+    counts[PERF_MEM_WRITE] += mem_write;
+    counts[PERF_STALL] += !enable;
+  }
 
-    // get elf header
-    GElf_Ehdr hdr;
-    GElf_Ehdr *tmphdr = gelf_getehdr(elf, &hdr);
-    assert(tmphdr);
+  // Sample the signals that feed the performance counters of all cores
+  void emu_perf(void)
+  {
+    perf_cycles++;
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      perf_count(n, CORE_PUB(n, io_perf_ic_hit), CORE_PUB(n, io_perf_ic_miss),
+                 CORE_PUB(n, io_perf_dc_hit), CORE_PUB(n, io_perf_dc_miss),
+                 CORE_PUB(n, io_perf_sc_spill), CORE_PUB(n, io_perf_sc_fill),
+                 CORE_PUB(n, io_perf_wc_hit), CORE_PUB(n, io_perf_wc_miss),
+                 CORE_PUB(n, io_perf_mem_read), CORE_PUB(n, io_perf_mem_write),
+                 CORE_PVT(n, enableReg));
+    }
+  }
 
-    if (hdr.e_machine != 0xBEEB)
-    {
-      cerr << "readelf: unsupported architecture: ELF file is not a Patmos ELF file.\n";
-      exit(EXIT_FAILURE);
+  // Write the statistics as JSON array with one object per core
+  void perf_json(ostream &out)
+  {
+    out << "[";
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      out << (n > 0 ? ", " : "") << "{\"core\": " << n
+          << ", \"cycles\": " << perf_cycles;
+      for (unsigned i = 0; i < PERF_EVENTS; i++) {
+        out << ", \"" << perf_names[i] << "\": " << perf_counts[n][i];
+      }
+      out << "}";
     }
+    out << "]";
+  }
 
-    // check class
-    int ec = gelf_getclass(elf);
-    if (ec != ELFCLASS32)
-    {
-      cerr << "readelf: unsupported architecture: ELF file is not a 32bit Patmos ELF file.\n";
-      exit(EXIT_FAILURE);
+  // Write the statistics as CSV, with one line per core
+  void perf_csv(ostream &out, bool header)
+  {
+    if (header) {
+      out << "core,cycles";
+      for (unsigned i = 0; i < PERF_EVENTS; i++) {
+        out << "," << perf_names[i];
+      }
+      out << endl;
+    }
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      out << n << "," << perf_cycles;
+      for (unsigned i = 0; i < PERF_EVENTS; i++) {
+        out << "," << perf_counts[n][i];
+      }
+      out << endl;
     }
+  }
 
-    // get program headers
-    size_t n;
-    int ntmp = elf_getphdrnum(elf, &n);
-    assert(ntmp == 0);
+  // Take a profile sample every interval cycles
+  void prof_enable(long int interval)
+  {
+    prof_interval = interval;
+    prof_reset();
+  }
 
-    for (size_t i = 0; i < n; i++)
-    {
-      // get program header
-      GElf_Phdr phdr;
-      GElf_Phdr *phdrtmp = gelf_getphdr(elf, i, &phdr);
-      assert(phdrtmp);
+  void prof_reset(void)
+  {
+    prof_countdown = prof_interval;
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      prof_base[n] = 0;
+      prof_pc[n] = 0;
+      prof_counts[n].clear();
+    }
+  }
 
-      if (phdr.p_type == PT_LOAD)
-      {
-        // some assertions
-        //assert(phdr.p_vaddr == phdr.p_paddr);
-        assert(phdr.p_filesz <= phdr.p_memsz);
+  // Track the fetch PC like update_pc(), for each core. Stall cycles while
+  // switching to another method are counted as method cache stalls of the
+  // target method.
+  void prof_sample(unsigned n, val_t pcNext, val_t relBaseNext,
+                   unsigned int callRetBaseNext, bool enable, bool sample)
+  {
+    if (enable) {
+      prof_pc[n] = (prof_base[n] + pcNext) * 4 - relBaseNext * 4;
+      prof_base[n] = callRetBaseNext;
+    }
+    if (sample) {
+      if (enable) {
+        array<uint64_t, PROF_EVENTS> &counts = prof_counts[n][prof_pc[n]];
+        counts[PROF_CYCLES] += prof_interval;
+        counts[PROF_INSTRS] += prof_interval;
+      } else if (callRetBaseNext != prof_base[n]) {
+        array<uint64_t, PROF_EVENTS> &counts = prof_counts[n][(val_t)callRetBaseNext * 4];
+        counts[PROF_CYCLES] += prof_interval;
+        counts[PROF_MCACHE_STALLS] += prof_interval;
+      } else {
+        array<uint64_t, PROF_EVENTS> &counts = prof_counts[n][prof_pc[n]];
+        counts[PROF_CYCLES] += prof_interval;
+        counts[PROF_STALLS] += prof_interval;
+      }
+    }
+  }
 
-        // copy from the buffer into the on-chip memories
-        for (size_t k = 0; k < phdr.p_memsz; k++)
-        {
-          if ((phdr.p_flags & PF_X) != 0 &&
-              ((phdr.p_paddr + k) >> OCMEM_ADDR_BITS) == 0x1 &&
-              ((phdr.p_paddr + k) & 0x3) == 0)
-          {
-            // Address maps to ISPM and is at a word boundary
-
-            val_t word = k >= phdr.p_filesz ? 0 : 
-              (((val_t)elfbuf[phdr.p_offset + k + 0] << 24) |
-               ((val_t)elfbuf[phdr.p_offset + k + 1] << 16) |
-               ((val_t)elfbuf[phdr.p_offset + k + 2] << 8) | 
-               ((val_t)elfbuf[phdr.p_offset + k + 3] << 0));
-            val_t addr = ((phdr.p_paddr + k) - (0x1 << OCMEM_ADDR_BITS)) >> 3;
-            #if CORE_COUNT == 1
-            unsigned size = (sizeof(c->Patmos__DOT__cores_0__DOT__fetch__DOT__MemBlock__DOT__mem) / //ANTHON THIS MIGHT BE WRONG - SHOULD BE OKAY
-                             sizeof(c->Patmos__DOT__cores_0__DOT__fetch__DOT__MemBlock__DOT__mem[0]));
-            #endif
-            #if CORE_COUNT > 1
-            unsigned size = (sizeof(c->__PVT__Patmos__DOT__cores_0->__PVT__fetch__DOT__MemBlock__DOT__mem) / //ANTHON THIS MIGHT BE WRONG - SHOULD BE OKAY
-                             sizeof(c->__PVT__Patmos__DOT__cores_0->__PVT__fetch__DOT__MemBlock__DOT__mem[0]));
-            #endif
-            assert(addr < size && "Instructions mapped to ISPM exceed size");
-  
-            // Write to even or odd block
-            #if CORE_COUNT == 1
-            if (((phdr.p_paddr + k) & 0x4) == 0)
-            {
-              
-              c->Patmos__DOT__cores_0__DOT__fetch__DOT__MemBlock__DOT__mem[addr] = word;
-            }
-            else
-            {
-              c->Patmos__DOT__cores_0__DOT__fetch__DOT__MemBlock_1__DOT__mem[addr] = word;
-            }
-            #endif
-            #if CORE_COUNT > 1
-            if (((phdr.p_paddr + k) & 0x4) == 0)
-            {
+  // To be called in every cycle when profiling
+  void emu_prof(void)
+  {
+    bool sample = --prof_countdown == 0;
+    if (sample) {
+      prof_countdown = prof_interval;
+    }
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      prof_sample(n, CORE_PUB(n, fetch__DOT__pcNext), CORE_PUB(n, fetch__DOT__relBaseNext),
+                  CORE_PUB(n, icache__DOT__repl__DOT__callRetBaseNext),
+                  CORE_PVT(n, enableReg), sample);
+    }
+  }
 
-              c->__PVT__Patmos__DOT__cores_0->__PVT__fetch__DOT__MemBlock__DOT__mem[addr] = word;
-            }
-            else
-            {
-              c->__PVT__Patmos__DOT__cores_0->__PVT__fetch__DOT__MemBlock_1__DOT__mem[addr] = word;
-            }
-            #endif
+  // Name of the function that contains addr
+  string prof_symbol(val_t addr)
+  {
+    ProfSymbol key = { addr, 0, "" };
+    vector<ProfSymbol>::iterator it =
+      upper_bound(prof_symbols.begin(), prof_symbols.end(), key);
+    if (it != prof_symbols.begin()) {
+      --it;
+      if (it->size == 0 || addr < it->addr + it->size) {
+        return it->name;
+      }
+    }
+    ostringstream name;
+    name << "0x" << hex << addr;
+    return name.str();
+  }
 
-          }
+  // Write the profile in callgrind format, one file per core. For more
+  // than one core, the core number is appended to the file name.
+  void prof_write(const string &path, const char *elf)
+  {
+    static const char *event_names = "Cycles Instructions Stalls MCacheStalls";
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      string core_path = CORE_COUNT > 1 ? path + "-" + to_string(n) : path;
+      ofstream out(core_path);
+      if (!out.good()) {
+        cerr << "patemu: error: Cannot open profile file " << core_path << endl;
+        exit(EXIT_FAILURE);
+      }
 
-          if (((phdr.p_paddr + k) & 0x3) == 0)
-          {
-            // Address maps to SRAM and is at a word boundary
-            val_t word = k >= phdr.p_filesz ? 0 : (((val_t)elfbuf[phdr.p_offset + k + 0] << 24) | ((val_t)elfbuf[phdr.p_offset + k + 1] << 16) | ((val_t)elfbuf[phdr.p_offset + k + 2] << 8) | ((val_t)elfbuf[phdr.p_offset + k + 3] << 0));
+      // group the samples by function, in address order
+      map<string, vector<pair<val_t, array<uint64_t, PROF_EVENTS> > > > functions;
+      array<uint64_t, PROF_EVENTS> total = {};
+      for (auto &sample : prof_counts[n]) {
+        functions[prof_symbol(sample.first)].push_back(sample);
+        for (unsigned i = 0; i < PROF_EVENTS; i++) {
+          total[i] += sample.second[i];
+        }
+      }
 
-            val_t addr = ((phdr.p_paddr + k) >> 2);
-            write_extmem(addr, word);
+      out << "# callgrind format" << endl
+          << "version: 1" << endl
+          << "creator: patemu" << endl
+          << "cmd: " << (elf != NULL ? elf : "") << endl
+          << "part: 1" << endl
+          << "thread: " << n + 1 << endl
+          << "positions: instr" << endl
+          << "events: " << event_names << endl
+          << "summary:";
+      for (unsigned i = 0; i < PROF_EVENTS; i++) {
+        out << " " << total[i];
+      }
+      out << endl << endl;
+      if (elf != NULL) {
+        out << "ob=" << elf << endl;
+      }
+      for (auto &fn : functions) {
+        sort(fn.second.begin(), fn.second.end());
+        out << "fn=" << fn.first << endl;
+        for (auto &sample : fn.second) {
+          out << "0x" << hex << sample.first << dec;
+          for (unsigned i = 0; i < PROF_EVENTS; i++) {
+            out << " " << sample.second[i];
           }
+          out << endl;
         }
+        out << endl;
       }
     }
-
-    // get entry point
-    val_t entry = hdr.e_entry;
-
-    elf_end(elf);
-
-    return entry;
   }
 
-  #ifdef EXTMEM_SSRAM32CTRL //TODO test this
-  void write_extmem(val_t address, val_t word)
+  // Reset the processor and load an ELF file, returns false if the file
+  // cannot be opened or is not a Patmos ELF file
+  bool load_program(const char *path, int uart_in, int uart_out)
   {
-    ram_buf[address] = word; // This gives segmentation fault dumb on second run!
-  }
+    reset(1);
+    tick(uart_in, uart_out);
+    UART_init();
 
-  void init_extmem() {
-    //only needed for random init
-    for (int i = 0; i < (1 << EXTMEM_ADDR_BITS); i++) {
-      write_extmem(i, rand());
+    val_t entry = 0;
+    if (path != NULL)
+    {
+      int fd = open(path, O_RDONLY);
+      if (fd < 0)
+      {
+        return false;
+      }
+      bool ok = readelf(fd, entry);
+      close(fd);
+      if (!ok)
+      {
+        return false;
+      }
     }
-  } 
-
-static void emu_extmem() {
-  static uint32_t addr_cnt;
-  static uint32_t address;
-  static uint32_t counter;
+    entry_pc = entry;
 
-  // Start of request
-  if (c->io_sSRam32CtrlPins_ramOut_nadsc != 1) {
-    address = c->Patmos__io_sSRam32CtrlPins_ramOut_addr.to_ulong();
-    addr_cnt = address;
-    counter = 0;
-  }
+    reset(5);
+    tick(uart_in, uart_out);
 
-  // Advance address for burst
-  if (c->io_sSRam32CtrlPins_ramOut_nadv != 1) {
-    addr_cnt++;
+    init_icache(entry);
+    return true;
   }
 
-  // Read from external memory
-  if (c->io_sSRam32CtrlPins_ramOut_noe != 1) {
-    counter++;
-    if (counter >= SRAM_CYCLES) {
-      c->io_sSRam32CtrlPins_ramIn_din = ram_buf[address];
-      if (address <= addr_cnt) {
-        address++;
-      }
+  // Bring the emulator back to its initial state to run another program on
+  // the same model. State that is not affected by the reset signal, such as
+  // the register file, keeps the values from the previous program.
+  void clear_state(bool random)
+  {
+    m_tickcount = 0;
+    Verilated::gotFinish(false);
+    uart_baud_counter = 0;
+    uart_in_pos = 0;
+    uart_in_len = 0;
+    uart_in_eof = false;
+    perf_reset();
+    prof_reset();
+    halt_reset();
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      pc_base[n] = 0;
+      pc[n] = 0;
     }
+    #ifdef EXTMEM_EMULATED
+    ram_buf.clear();
+    ram_buf.set_random(random);
+    #endif
+    #ifdef EXTMEM_MEMBRIDGE
+    delete ram_timing;
+    ram_timing = new_extmem_timing();
+    ram_state = RAM_IDLE;
+    #endif
+    #ifdef IO_ETHMAC
+    ethmac.reset();
+    #endif
   }
 
-  // Write to external memory
-  if (c->io_sSRam32CtrlPins_ramOut_nbwe == 0) {
-    uint32_t nbw = c->io_sSRam32CtrlPins_ramOut_nbw;
-    uint32_t mask = 0x00000000;
-    for (unsigned i = 0; i < 4; i++) {
-      if ((nbw & (1 << i)) == 0) {
-        mask |= 0xff << (i*8);
+  // Print the state of the enabled cores, prefixed with the core number
+  // if there is more than one
+  void print_state()
+  {
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      if (!core_enabled(n)) {
+        continue;
+      }
+      #if CORE_COUNT > 1
+      *outputTarget << n << ": ";
+      #endif
+      *outputTarget << pc[n] << " - ";
+      for (unsigned i = 0; i < 32; i++) {
+        *outputTarget << CORE_PVT(n, decode__DOT__rf__DOT__rf)[i] << " ";
       }
-    }
-
-    ram_buf[address] &= ~mask;
-    ram_buf[address] |= mask & ((unsigned long int) c->io_sSRam32CtrlPins_ramOut_dout);
 
-    if (address <= addr_cnt) {
-      address++;
+      *outputTarget << endl;
     }
   }
-}
-
-#endif /*EXTMEM_SSRAM32CTRL*/
 
-#ifdef EXTMEM_SRAMCTRL
-  void write_extmem(val_t address, val_t word) {
-    ram_buf[(address << 1) | 0] = word & 0xffff;
-    ram_buf[(address << 1) | 1] = word >> 16;
+  // Write the state of core 0 like print_state() to a binary trace, with
+  // the bundle at the PC as found in the external memory
+  void trace_state(RegTraceWriter &writer)
+  {
+    RegTraceRecord rec;
+    rec.pc = pc[0];
+    rec.bundle[0] = read_extmem(pc[0] >> 2);
+    rec.bundle[1] = (rec.bundle[0] >> 31) ? read_extmem((pc[0] >> 2) + 1) : 0;
+    for (unsigned i = 0; i < 32; i++) {
+      rec.regs[i] = CORE_PVT(0, decode__DOT__rf__DOT__rf)[i];
+    }
+    writer.write(rec);
   }
 
-  void init_extmem() {
-    //only needed for random init
-    for (int i = 0; i < (1 << EXTMEM_ADDR_BITS)/2; i++) {
-      write_extmem(i, rand());
+  static void memtrace_access(MemTraceWriter &writer, uint64_t cycle, unsigned n,
+                              unsigned kind, unsigned space, uint32_t addr,
+                              unsigned byte_en)
+  {
+    // Byte enables are big-endian, the first byte is in bit 3
+    unsigned first = 0;
+    while (first < 3 && !(byte_en & (8 >> first))) {
+      first++;
     }
+    MemTraceRecord rec;
+    rec.cycle = cycle;
+    rec.core = n;
+    rec.kind = kind;
+    rec.space = space;
+    rec.size = __builtin_popcount(byte_en & 0xf);
+    rec.addr = addr + first;
+    writer.write(rec);
   }
 
-  void emu_extmem() {
-    uint32_t address = (uint32_t) c->io_SRamCtrl_ramOut_addr;
-    // Read from external memory unconditionally
-    c->io_SRamCtrl_ramIn_din = ram_buf[address];
+  // Write the accesses of the memory stages of all cores in this cycle to
+  // a memory access trace, along with changes of the method in the method
+  // cache and the stack cache operations that left the execute stage
+  void memtrace_step(MemTraceWriter &writer)
+  {
+    for (unsigned n = 0; n < CORE_COUNT; n++) {
+      uint32_t cmd = CORE_PUB(n, memory__DOT__io_localInOut_M_Cmd);
+      if (cmd != OCP_CMD_IDLE) {
+        memtrace_access(writer, m_tickcount, n,
+                        cmd == OCP_CMD_WR ? MEMTRACE_WRITE : MEMTRACE_READ,
+                        MEMTRACE_LOCAL, CORE_PUB(n, memory__DOT__io_localInOut_M_Addr),
+                        CORE_PUB(n, memory__DOT__io_localInOut_M_ByteEn));
+      }
+      cmd = CORE_PUB(n, memory__DOT__io_globalInOut_M_Cmd);
+      if (cmd != OCP_CMD_IDLE) {
+        // Stack accesses are relative to the stack top
+        unsigned space = CORE_PUB(n, memory__DOT__io_globalInOut_M_AddrSpace);
+        uint32_t addr = CORE_PUB(n, memory__DOT__io_globalInOut_M_Addr);
+        if (space == MEMTRACE_STACK) {
+          addr += CORE_PUB(n, execute__DOT__io_scex_stackTop);
+        }
+        memtrace_access(writer, m_tickcount, n,
+                        cmd == OCP_CMD_WR ? MEMTRACE_WRITE : MEMTRACE_READ,
+                        space, addr, CORE_PUB(n, memory__DOT__io_globalInOut_M_ByteEn));
+      }
 
-    // Write to external memory
-    if (c->io_SRamCtrl_ramOut_nwe != 1) {
-      uint16_t mask = 0x0000;
-      if (c->io_SRamCtrl_ramOut_nub != 1) {
-        mask |= 0xff00;
+      uint32_t base = CORE_PVT(n, icache__DOT__repl__DOT__callRetBaseReg);
+      if (base != memtrace_base[n] && base != 0) {
+        // The size of a method is in the word before it
+        MemTraceRecord rec;
+        rec.cycle = m_tickcount;
+        rec.core = n;
+        rec.kind = MEMTRACE_METHOD;
+        rec.space = 0;
+        rec.size = read_extmem(base - 1);
+        rec.addr = base * 4;
+        writer.write(rec);
       }
-      if (c->io_SRamCtrl_ramOut_nlb != 1) {
-        mask |= 0x00ff;
+      memtrace_base[n] = base;
+
+      // The operation was sampled in the last cycle and took effect if the
+      // pipeline was enabled
+      if (memtrace_sc_op[n] != 0 && CORE_PVT(n, enableReg)) {
+        MemTraceRecord rec;
+        rec.cycle = m_tickcount;
+        rec.core = n;
+        rec.kind = MEMTRACE_STACK_OP;
+        rec.space = memtrace_sc_op[n];
+        rec.size = 0;
+        rec.addr = memtrace_sc_arg[n];
+        writer.write(rec);
       }
-      ram_buf[address] &= ~mask;
-      ram_buf[address] |= mask & ((unsigned long int) c->io_SRamCtrl_ramOut_dout);
+      memtrace_sc_op[n] = CORE_PUB(n, execute__DOT__io_exsc_op);
+      memtrace_sc_arg[n] = (memtrace_sc_op[n] == MEMTRACE_SC_SET_ST
+                            || memtrace_sc_op[n] == MEMTRACE_SC_SET_MT)
+        ? CORE_PUB(n, execute__DOT__io_exsc_opData)
+        : CORE_PUB(n, execute__DOT__io_exsc_opOff);
     }
   }
-#endif /*EXTMEM_SRAMCTRL*/
 
-  void init_icache(val_t entry)
+  // Check core 0 against the instruction set model, starting with the
+  // bundle at the entry point of the program
+  void lockstep_enable(void)
   {
-    
-    tick(STDIN_FILENO, STDOUT_FILENO);
-    if (entry != 0)
-    {
-      if (entry >= 0x20000)
-      {
-#ifdef ICACHE_METHOD
-        //init for method cache
-#if CORE_COUNT == 1
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__pcNext = -1;
-        c->Patmos__DOT__cores_0__DOT__icache__DOT__repl__DOT__hitNext = 0;
-// add multicore support, at the moment only for the method cache and not the ISPM
-#endif
-       
+    isa = new IsaSim(PIPE_COUNT);
+    isa_synced = false;
+    isa_slot_valid = false;
+    isa_bundles = 0;
+    isa_skipped = 0;
+  }
 
-#if CORE_COUNT > 1
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__pcNext = -1;
-        c->__PVT__Patmos__DOT__cores_0->icache__DOT__repl__DOT__hitNext = 0;
+  // Absolute address and method base of the bundle in the memory stage
+  void lockstep_sample(uint32_t &slot_pc, uint32_t &slot_base)
+  {
+    slot_base = CORE_PVT(0, memory__DOT__memReg_base);
+    slot_pc = slot_base + CORE_PVT(0, memory__DOT__memReg_relPc);
+    slot_pc *= 4;
+    slot_base *= 4;
+  }
 
-        c->__PVT__Patmos__DOT__cores_1->fetch__DOT__pcNext = -1;
-        c->__PVT__Patmos__DOT__cores_1->icache__DOT__repl__DOT__hitNext = 0;
-#endif
-#if CORE_COUNT > 2
-        c->__PVT__Patmos__DOT__cores_2->fetch__DOT__pcNext = -1;
-        c->__PVT__Patmos__DOT__cores_2->icache__DOT__repl__DOT__hitNext = 0;
-#endif
-#if CORE_COUNT > 3
-        c->__PVT__Patmos__DOT__cores_3->fetch__DOT__pcNext = -1;
-        c->__PVT__Patmos__DOT__cores_3->icache__DOT__repl__DOT__hitNext = 0;
-#endif
-#if CORE_COUNT > 4
-        c->__PVT__Patmos__DOT__cores_4->fetch__DOT__pcNext = -1;
-        c->__PVT__Patmos__DOT__cores_4->icache__DOT__repl__DOT__hitNext = 0;
-#endif
-#if CORE_COUNT > 5
-        c->__PVT__Patmos__DOT__cores_5->fetch__DOT__pcNext = -1;
-        c->__PVT__Patmos__DOT__cores_5->icache__DOT__repl__DOT__hitNext = 0;
-#endif
-#if CORE_COUNT > 6
-        c->__PVT__Patmos__DOT__cores_6->fetch__DOT__pcNext = -1;
-        c->__PVT__Patmos__DOT__cores_6->icache__DOT__repl__DOT__hitNext = 0;
-#endif
-#if CORE_COUNT > 7
-        c->__PVT__Patmos__DOT__cores_7->fetch__DOT__pcNext = -1;
-        c->__PVT__Patmos__DOT__cores_7->icache__DOT__repl__DOT__hitNext = 0;
-#endif
-#endif /* ICACHE_METHOD */
-#ifdef ICACHE_LINE
-        //init for icache
-        #if CORE_COUNT == 1
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__pcNext = (entry >> 2) - 1;
-        #endif
-        #if CORE_COUNT > 1
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__pcNext = (entry >> 2) - 1;
-        #endif
-#endif /* ICACHE_LINE */
-#if CORE_COUNT == 1
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__relBaseNext = 0;
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__selCacheNext = 1;
-        c->Patmos__DOT__cores_0__DOT__icache__DOT__repl__DOT__selCacheNext = 1;
-#endif
-#if CORE_COUNT > 1
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__relBaseNext = 0;
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__selCacheNext = 1;
-        c->__PVT__Patmos__DOT__cores_0->icache__DOT__repl__DOT__selCacheNext = 1;
-
-        c->__PVT__Patmos__DOT__cores_1->fetch__DOT__relBaseNext = 0;
-        c->__PVT__Patmos__DOT__cores_1->fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_1->fetch__DOT__selCacheNext = 1;
-        c->__PVT__Patmos__DOT__cores_1->icache__DOT__repl__DOT__selCacheNext = 1;
-#endif
-#if CORE_COUNT > 2
-        c->__PVT__Patmos__DOT__cores_2->fetch__DOT__relBaseNext = 0;
-        c->__PVT__Patmos__DOT__cores_2->fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_2->fetch__DOT__selCacheNext = 1;
-        c->__PVT__Patmos__DOT__cores_2->icache__DOT__repl__DOT__selCacheNext = 1;
-#endif
-#if CORE_COUNT > 3
-        c->__PVT__Patmos__DOT__cores_3->fetch__DOT__relBaseNext = 0;
-        c->__PVT__Patmos__DOT__cores_3->fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_3->fetch__DOT__selCacheNext = 1;
-        c->__PVT__Patmos__DOT__cores_3->icache__DOT__repl__DOT__selCacheNext = 1;
-#endif
-#if CORE_COUNT > 4
-        c->__PVT__Patmos__DOT__cores_4->fetch__DOT__relBaseNext = 0;
-        c->__PVT__Patmos__DOT__cores_4->fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_4->fetch__DOT__selCacheNext = 1;
-        c->__PVT__Patmos__DOT__cores_4->icache__DOT__repl__DOT__selCacheNext = 1;
-#endif
-#if CORE_COUNT > 5
-        c->__PVT__Patmos__DOT__cores_5->fetch__DOT__relBaseNext = 0;
-        c->__PVT__Patmos__DOT__cores_5->fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_5->fetch__DOT__selCacheNext = 1;
-        c->__PVT__Patmos__DOT__cores_5->icache__DOT__repl__DOT__selCacheNext = 1;
-#endif
-#if CORE_COUNT > 6
-        c->__PVT__Patmos__DOT__cores_6->fetch__DOT__relBaseNext = 0;
-        c->__PVT__Patmos__DOT__cores_6->fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_6->fetch__DOT__selCacheNext = 1;
-        c->__PVT__Patmos__DOT__cores_6->icache__DOT__repl__DOT__selCacheNext = 1;
-#endif
-#if CORE_COUNT > 7
-        c->__PVT__Patmos__DOT__cores_7->fetch__DOT__relBaseNext = 0;
-        c->__PVT__Patmos__DOT__cores_7->fetch__DOT__relocNext = (entry >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_7->fetch__DOT__selCacheNext = 1;
-        c->__PVT__Patmos__DOT__cores_7->icache__DOT__repl__DOT__selCacheNext = 1;
-#endif
+  void lockstep_regs(uint32_t *regs)
+  {
+    for (unsigned i = 0; i < 32; i++) {
+      regs[i] = CORE_PVT(0, decode__DOT__rf__DOT__rf)[i];
+    }
+    regs[0] = 0;
+  }
+
+  void lockstep_report(const char *what, uint32_t bundle_pc, const uint32_t *regs)
+  {
+    cerr << "patemu: lockstep mismatch in cycle " << m_tickcount
+         << " after " << isa_bundles << " bundles: " << what << endl;
+    cerr << hex << "patemu: model at 0x" << bundle_pc
+         << ", hardware at 0x" << isa_slot_pc << endl;
+    for (unsigned i = 1; i < 32; i++) {
+      if (regs[i] != isa->reg[i]) {
+        cerr << dec << "patemu: r" << i << hex << ": model 0x" << isa->reg[i]
+             << ", hardware 0x" << regs[i] << endl;
       }
-      else
-      {
-        // pcReg for ispm starts at entry point - ispm base
-#if CORE_COUNT == 1
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__pcNext = ((entry - 0x10000) >> 2) - 1;
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__relBaseNext = (entry - 0x10000) >> 2;
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__relocNext = 0x10000 >> 2;
-        c->Patmos__DOT__cores_0__DOT__fetch__DOT__selSpmNext = 1;
-        c->Patmos__DOT__cores_0__DOT__icache__DOT__repl__DOT__selSpmNext = 1;
-#endif
-#if CORE_COUNT > 1
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__pcNext = ((entry - 0x10000) >> 2) - 1;
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__relBaseNext = (entry - 0x10000) >> 2;
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__relocNext = 0x10000 >> 2;
-        c->__PVT__Patmos__DOT__cores_0->fetch__DOT__selSpmNext = 1;
-        c->__PVT__Patmos__DOT__cores_0->icache__DOT__repl__DOT__selSpmNext = 1;
-#endif 
-      }
-#if CORE_COUNT == 1
-      c->Patmos__DOT__cores_0__DOT__icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
-#endif 
-#if CORE_COUNT > 1
-      c->__PVT__Patmos__DOT__cores_0->icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
+    }
+    cerr << "patemu: model registers:";
+    for (unsigned i = 0; i < 32; i++) {
+      cerr << " " << isa->reg[i];
+    }
+    cerr << endl << "patemu: model predicates:";
+    for (unsigned i = 0; i < 8; i++) {
+      cerr << " " << isa->pred[i];
+    }
+    cerr << dec << endl;
+  }
 
-      c->__PVT__Patmos__DOT__cores_1->icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 2
-      c->__PVT__Patmos__DOT__cores_2->icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 3
-      c->__PVT__Patmos__DOT__cores_3->icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 4
-      c->__PVT__Patmos__DOT__cores_4->icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 5
-      c->__PVT__Patmos__DOT__cores_5->icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 6
-      c->__PVT__Patmos__DOT__cores_6->icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 7
-      c->__PVT__Patmos__DOT__cores_7->icache__DOT__repl__DOT__callRetBaseNext = (entry >> 2);
-#endif
+  // Step the model for the bundle that retired in the last cycle and
+  // compare the register file. Returns false at the first mismatch.
+  bool lockstep_step(void)
+  {
+    if (isa == NULL) {
+      return true;
+    }
 
-#ifdef ICACHE_METHOD
-#if CORE_COUNT == 1
-      c->Patmos__DOT__cores_0__DOT__icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
-#endif 
-#if CORE_COUNT > 1
-      c->__PVT__Patmos__DOT__cores_0->icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
+    uint32_t regs[32];
+    if (isa_synced && isa_slot_valid && core_enabled()) {
+      lockstep_regs(regs);
+      const char *what = "register file differs";
+      uint32_t bundle_pc = isa->pc;
+      if (isa_slot_pc == isa->pc) {
+        uint32_t instr_a = read_extmem(bundle_pc >> 2);
+        uint32_t instr_b = read_extmem((bundle_pc >> 2) + 1);
+        isa->step(instr_a, instr_b);
+        if (isa->unsupported != NULL) {
+          cerr << "patemu: lockstep checking stops at 0x" << hex << bundle_pc
+               << dec << ", " << isa->unsupported << " is not modelled" << endl;
+          delete isa;
+          isa = NULL;
+          return true;
+        }
+        for (unsigned i = 0; i < isa->pending_count; i++) {
+          isa->adopt(isa->pending[i], regs[isa->pending[i]]);
+        }
+        isa_bundles++;
+        isa_skipped = 0;
+      } else if (++isa_skipped > LOCKSTEP_MAX_SKIP) {
+        what = "control flow differs";
+        lockstep_report(what, bundle_pc, regs);
+        return false;
+      }
+      if (memcmp(regs, isa->reg, sizeof(regs)) != 0) {
+        lockstep_report(what, bundle_pc, regs);
+        return false;
+      }
+    }
 
-      c->__PVT__Patmos__DOT__cores_1->icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 2
-      c->__PVT__Patmos__DOT__cores_2->icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 3
-      c->__PVT__Patmos__DOT__cores_3->icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 4
-      c->__PVT__Patmos__DOT__cores_4->icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 5
-      c->__PVT__Patmos__DOT__cores_5->icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 6
-      c->__PVT__Patmos__DOT__cores_6->icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 7
-      c->__PVT__Patmos__DOT__cores_7->icache__DOT__ctrl__DOT__callRetBaseNext = (entry >> 2);
-#endif
-#endif /* ICACHE_METHOD */
-#ifdef ICACHE_LINE
-#if CORE_COUNT == 1
-      c->Patmos__DOT__cores_0__DOT__fetch__DOT__relBaseNext = (entry >> 2);
-#endif
-#if CORE_COUNT > 1
-      c->__PVT__Patmos__DOT__cores_0->fetch__DOT__relBaseNext = (entry >> 2);
-#endif
-#endif /* ICACHE_LINE */
+    // Until the entry point reaches the memory stage, the pipeline only
+    // holds the start-up code of the emulator
+    lockstep_sample(isa_slot_pc, isa_slot_base);
+    isa_slot_valid = true;
+    if (!isa_synced && isa_slot_pc == entry_pc) {
+      isa->reset(isa_slot_pc, isa_slot_base);
+      lockstep_regs(isa->reg);
+      isa_synced = true;
     }
+    return true;
   }
-  void print_state()
-  {
-    static unsigned int baseReg = 0;
-    #if CORE_COUNT == 1
-    *outputTarget << ((baseReg + c->Patmos__DOT__cores_0__DOT__fetch__DOT__pcNext) * 4 - c->Patmos__DOT__cores_0__DOT__fetch__DOT__relBaseNext * 4) << " - ";
-    baseReg = c->Patmos__DOT__cores_0__DOT__icache__DOT__repl__DOT__callRetBaseNext;
 
-    for (unsigned i = 0; i < 32; i++) {
-      *outputTarget << c->Patmos__DOT__cores_0__DOT__decode__DOT__rf__DOT__rf[i] << " ";
+  #if EMU_SAVABLE
+  // Snapshots contain the Verilator model, the emulator state and the
+  // contents of the external memory. The state of UART input files and of
+  // the wave form dump is not included.
+  void save_state(const char *path)
+  {
+    VerilatedSave os;
+    os.open(path);
+    if (!os.isOpen()) {
+      cerr << "patemu: error: Cannot open snapshot file " << path << endl;
+      exit(EXIT_FAILURE);
     }
+
+    uint32_t header [3] = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, CORE_COUNT };
+    os.write(header, sizeof(header));
+    os << *c;
+
+    os.write(&m_tickcount, sizeof(m_tickcount));
+    os.write(&UART_on, sizeof(UART_on));
+    os.write(&uart_baud_counter, sizeof(uart_baud_counter));
+    os.write(pc_base, sizeof(pc_base));
+    os.write(pc, sizeof(pc));
+    #ifdef EXTMEM_EMULATED
+    ram_buf.save(os);
+    #endif
+    #ifdef EXTMEM_SSRAM32CTRL
+    os.write(&ram_addr_cnt, sizeof(ram_addr_cnt));
+    os.write(&ram_address, sizeof(ram_address));
+    os.write(&ram_counter, sizeof(ram_counter));
+    #endif
+    #ifdef EXTMEM_MEMBRIDGE
+    os.write(&ram_state, sizeof(ram_state));
+    os.write(&ram_address, sizeof(ram_address));
+    os.write(&ram_counter, sizeof(ram_counter));
+    os.write(&ram_ready, sizeof(ram_ready));
+    ram_timing->save(os);
+    #endif
+    #ifdef IO_ETHMAC
+    ethmac.save(os);
     #endif
-    #if CORE_COUNT > 1
-      *outputTarget << ((baseReg + c->__PVT__Patmos__DOT__cores_0->fetch__DOT__pcNext) * 4 - c->__PVT__Patmos__DOT__cores_0->fetch__DOT__relBaseNext * 4) << " - ";
-    baseReg = c->__PVT__Patmos__DOT__cores_0->icache__DOT__repl__DOT__callRetBaseNext;
 
-    for (unsigned i = 0; i < 32; i++) {
-      *outputTarget << c->__PVT__Patmos__DOT__cores_0->__PVT__decode__DOT__rf__DOT__rf[i] << " ";
+    os.close();
+  }
+
+  void restore_state(const char *path)
+  {
+    VerilatedRestore os;
+    os.open(path);
+    if (!os.isOpen()) {
+      cerr << "patemu: error: Cannot open snapshot file " << path << endl;
+      exit(EXIT_FAILURE);
     }
+
+    uint32_t header [3];
+    os.read(header, sizeof(header));
+    if (header[0] != SNAPSHOT_MAGIC || header[1] != SNAPSHOT_VERSION) {
+      cerr << "patemu: error: " << path << " is not a compatible snapshot file" << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (header[2] != CORE_COUNT) {
+      cerr << "patemu: error: Snapshot " << path << " is for " << header[2]
+           << " cores, emulator has " << CORE_COUNT << endl;
+      exit(EXIT_FAILURE);
+    }
+    os >> *c;
+
+    os.read(&m_tickcount, sizeof(m_tickcount));
+    os.read(&UART_on, sizeof(UART_on));
+    os.read(&uart_baud_counter, sizeof(uart_baud_counter));
+    os.read(pc_base, sizeof(pc_base));
+    os.read(pc, sizeof(pc));
+    #ifdef EXTMEM_EMULATED
+    ram_buf.restore(os);
+    #endif
+    #ifdef EXTMEM_SSRAM32CTRL
+    os.read(&ram_addr_cnt, sizeof(ram_addr_cnt));
+    os.read(&ram_address, sizeof(ram_address));
+    os.read(&ram_counter, sizeof(ram_counter));
+    #endif
+    #ifdef EXTMEM_MEMBRIDGE
+    os.read(&ram_state, sizeof(ram_state));
+    os.read(&ram_address, sizeof(ram_address));
+    os.read(&ram_counter, sizeof(ram_counter));
+    os.read(&ram_ready, sizeof(ram_ready));
+    ram_timing->restore(os);
+    #endif
+    #ifdef IO_ETHMAC
+    ethmac.restore(os);
     #endif
 
-    *outputTarget << endl;
+    os.close();
   }
-  
+
+  // Keep the last cycles in a ring buffer, see ring_step() and ring_dump()
+  void ring_init(long int cycles, const string &path)
+  {
+    ring_cycles = cycles;
+    ring_path[0] = path + ".ring0";
+    ring_path[1] = path + ".ring1";
+    ring_count = 0;
+    uart_in_log.clear();
+    keys_log.clear();
+    ring_step();
+  }
+
+  // Take a checkpoint if the last one is ring_cycles old, replacing the
+  // older one
+  void ring_step(void)
+  {
+    if (ring_cycles == 0) {
+      return;
+    }
+    int last = (ring_count - 1) & 1;
+    if (ring_count > 0 && (long int)(m_tickcount - ring_start[last]) < ring_cycles) {
+      return;
+    }
+    int next = ring_count & 1;
+    save_state(ring_path[next].c_str());
+    ring_start[next] = m_tickcount;
+    ring_count++;
+
+    // Drop the input that cannot be replayed anymore
+    uint64_t oldest = ring_count > 1 ? ring_start[next ^ 1] : ring_start[next];
+    size_t keep = 0;
+    while (keep < uart_in_log.size() && uart_in_log[keep].first < oldest) {
+      keep++;
+    }
+    uart_in_log.erase(uart_in_log.begin(), uart_in_log.begin() + keep);
+    keep = 0;
+    while (keep < keys_log.size() && keys_log[keep].first < oldest) {
+      keep++;
+    }
+    keys_log.erase(keys_log.begin(), keys_log.begin() + keep);
+  }
+
+  // Go back to the older checkpoint and emulate the cycles up to the
+  // current one again, dumping the last ring_cycles of them to the wave
+  // forms file. The emulator ends up in the same state as before.
+  void ring_dump(bool keys)
+  {
+    if (ring_cycles == 0) {
+      return;
+    }
+    uint64_t end = m_tickcount;
+    int older = ring_count > 1 ? ring_count & 1 : 0;
+    restore_state(ring_path[older].c_str());
+
+    uint64_t first = end > (uint64_t)ring_cycles ? end - ring_cycles : 0;
+    setTrace(first, end);
+    replaying = true;
+    replay_pos = 0;
+    keys_replay_pos = 0;
+    while (m_tickcount < end) {
+      tick(-1, -1);
+      if (keys) {
+        emu_keys();
+      }
+      emu_extmem();
+      if (core_enabled()) {
+        update_pc();
+      }
+    }
+    replaying = false;
+    stopTrace();
+
+    unlink(ring_path[0].c_str());
+    unlink(ring_path[1].c_str());
+    ring_cycles = 0;
+  }
+  #endif /* EMU_SAVABLE */
 };
 
+// In batch and server mode, $finish ends the current job only
+static bool finish_ends_job = false;
+
 // Override Verilator definition so first $finish ends simulation
 // Note: VL_USER_FINISH needs to be defined when compiling Verilator code
 void vl_finish(const char *filename, int linenum, const char *hier)
 {
   Verilated::flushCall();
+  if (finish_ends_job) {
+    Verilated::gotFinish(true);
+    return;
+  }
   exit(0);
 }
 
 static void usage(ostream &out, const char *name) {
   out << "Usage: " << name
-      << " <options> [file]" << endl;
+      << " <options> [file]" << endl
+      << "       " << name
+      << " <options> -B <report> [-j <N>] file..." << endl
+      << "       " << name
+      << " <options> -s <socket> [-j <N>]" << endl;
 }
 
 static void help(ostream &out) {
   out << endl << "Options:" << endl
+      << "  -b            Print load time and simulation speed in cycles per second" << endl
+      << "  -B <report>   Run all files in batch mode, write results to <report>" << endl
+      << "  -s <socket>   Run jobs from clients of Unix domain socket <socket>" << endl
+      << "  -j <N>        Distribute batch mode runs or jobs over <N> processes" << endl
       << "  -h            Print this help" << endl
       << "  -i            Initialize memory with random values" << endl
       << "  -l <N>        Stop after <N> cycles" << endl
-      << "  -v            Dump wave forms file \"Patmos.vcd\"" << endl
-      << "  -r            Print register values in each cycle" << endl
+      << "  -v            Dump wave forms file \"" TRACE_FILE "\"" << endl
+      << "  -w <F>:<L>    Dump wave forms for cycles <F> to <L> only" << endl
+      << "  -t <addr>     Start dumping wave forms when core 0 reaches address <addr>" << endl
+      << "  -u <byte>     Start dumping wave forms when <byte> is written to the UART" << endl
+      << "  -r            Print register values of all cores in each cycle" << endl
+      << "  -E <file>     Write register values of core 0 in each cycle to a binary" << endl
+      << "                trace <file>, see tools/c/include/regtrace.h" << endl
+      << "  -M <file>     Write the memory accesses, method cache requests and stack" << endl
+      << "                cache operations of all cores to a binary trace <file>," << endl
+      << "                see tools/c/include/memtrace.h" << endl
+      << "  -L            Check each bundle of core 0 against an instruction set" << endl
+      << "                model, stop at the first difference in the registers" << endl
+      #ifdef IO_ETHMAC
+      << "  -x <file>     Receive the Ethernet frames in pcap <file>, at their" << endl
+      << "                time relative to the first frame" << endl
+      << "  -X <file>     Write sent and received Ethernet frames to pcap <file>" << endl
+      << "  -e <addr>[:N] Emulate a network peer with IP address <addr>, which" << endl
+      << "                answers ARP, ICMP echo and UDP after <N> cycles" << endl
+      #endif /* IO_ETHMAC */
+      << "  -p <file>     Write per-core performance statistics to <file>, as CSV" << endl
+      << "                if it ends in .csv, as JSON otherwise; in batch mode," << endl
+      << "                the statistics are added to the report instead" << endl
+      << "  -g <file>     Write a profile of the fetch PCs in callgrind format" << endl
+      << "                to <file>, with -<core> appended for multicores" << endl
+      << "  -G <N>        Take a profile sample every <N> cycles (default: 100)," << endl
+      << "                1 counts every cycle and instruction exactly" << endl
+      #ifdef IO_TIMER
+      << "  -W <K>[:<N>]  Fast-forward by up to <N> cycles (default: " << WARP_MAX_DEFAULT << ")" << endl
+      << "                when all cores spin for <K> cycles polling the timer." << endl
+      << "                Timing is not exact: timer interrupts stay on time, but" << endl
+      << "                polled deadlines may be seen up to <N> cycles late" << endl
+      #endif /* IO_TIMER */
+      #if EMU_SAVABLE
+      << "  -S <file>     Save a snapshot of the emulator state to <file>" << endl
+      << "  -c <N>        Save the snapshot in cycle <N> (default: at the end)" << endl
+      << "  -P <addr>     Save the snapshot when core 0 reaches address <addr>" << endl
+      << "  -R <file>     Restore the emulator state from snapshot <file>" << endl
+      << "                instead of loading an ELF file" << endl
+      << "  -n <N>        Dump wave forms for the last <N> cycles before the trigger" << endl
+      << "                of -t/-u or the end of the emulation only" << endl
+      #endif /* EMU_SAVABLE */
       #ifdef IO_KEYS
       << "  -k            Simulate random input from keys" << endl
       #endif /* IO_KEYS */
       #ifdef IO_UART      
       << "  -I <file>     Read input for UART from file <file>" << endl
       << "  -O <file>     Write output from UART to file <file>" << endl
+      << "  -f            Fast UART, transmit without waiting for the baud rate" << endl
       #endif
   ;
 }
    
 
+// Escape a string for use in a JSON report
+static string json_escape(const string &str) {
+  ostringstream out;
+  for (size_t i = 0; i < str.size(); i++) {
+    unsigned char ch = str[i];
+    switch (ch) {
+    case '"': out << "\\\""; break;
+    case '\\': out << "\\\\"; break;
+    case '\n': out << "\\n"; break;
+    case '\r': out << "\\r"; break;
+    case '\t': out << "\\t"; break;
+    default:
+      if (ch < 0x20 || ch >= 0x7f) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", ch);
+        out << buf;
+      } else {
+        out << ch;
+      }
+    }
+  }
+  return out.str();
+}
+
+// Write the result of a run as JSON fields, for batch and server mode. The
+// status is "error" if the program could not be loaded, "halt", "finish" if
+// the model executed $finish, or "limit".
+static void report_run(ostream &report, Emulator *emu, const string &elf,
+                       bool loaded, bool halt, bool perf, const string &uart) {
+  const char *status = !loaded ? "error"
+    : (halt ? "halt" : (emu->done() ? "finish" : "limit"));
+  uint32_t exit_code = halt ? emu->exit_code() : 0;
+  report << "\"elf\": \"" << json_escape(elf) << "\""
+         << ", \"status\": \"" << status << "\""
+         << ", \"exit\": " << exit_code;
+  if (CORE_COUNT > 1) {
+    report << ", \"core_exit\": ";
+    emu->halt_json(report);
+  }
+  report << ", \"cycles\": " << emu->get_tick_count()
+         << ", \"extmem_bytes\": " << emu->extmem_footprint();
+  if (perf) {
+    report << ", \"perf\": ";
+    emu->perf_json(report);
+  }
+  report << ", \"uart\": \"" << json_escape(uart) << "\"";
+}
+
+// Run every stride-th file of the list on a single model, starting at
+// first. Writes one JSON record per line and returns the number of runs
+// that did not halt with exit code 0.
+static int run_batch(const vector<string> &files, size_t first, size_t stride,
+                     ostream &report, long int limit, bool random, bool perf) {
+  int failures = 0;
+  Emulator *emu = new Emulator();
+  string uart;
+  emu->UART_to_string(&uart);
+  finish_ends_job = true;
+
+  for (size_t k = first; k < files.size(); k += stride) {
+    emu->clear_state(random);
+    uart.clear();
+
+    bool halt = false;
+    bool loaded = emu->load_program(files[k].c_str(), -1, STDOUT_FILENO);
+    while (loaded && !emu->done() && (limit < 0 || emu->get_tick_count() < limit)) {
+      emu->tick(-1, STDOUT_FILENO);
+      emu->emu_extmem();
+      if (perf) {
+        emu->emu_perf();
+      }
+      emu->halt_step();
+      // Return to address 0 halts the execution after one more iteration
+      if (halt) {
+        break;
+      }
+      halt = emu->at_halt();
+    }
+
+    if (!halt || emu->exit_code() != 0) {
+      failures++;
+    }
+    report << "{\"index\": " << k << ", ";
+    report_run(report, emu, files[k], loaded, halt, perf, uart);
+    report << "}" << endl;
+  }
+
+  delete emu;
+  return failures;
+}
+
+// Batch mode with several worker processes. Each worker writes its part of
+// the report to a separate file, which are merged in list order at the end.
+static int run_batch_parallel(const vector<string> &files, int jobs,
+                              const char *report_path, long int limit, bool random,
+                              bool perf) {
+  vector<pid_t> workers;
+  for (int j = 0; j < jobs; j++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      cerr << "patemu: error: Cannot fork batch worker" << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      ofstream part(string(report_path) + "." + to_string(j));
+      int failures = run_batch(files, j, jobs, part, limit, random, perf);
+      part.close();
+      _exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    workers.push_back(pid);
+  }
+
+  int result = EXIT_SUCCESS;
+  for (size_t j = 0; j < workers.size(); j++) {
+    int status;
+    if (waitpid(workers[j], &status, 0) < 0
+        || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+      result = EXIT_FAILURE;
+    }
+  }
+
+  vector<pair<size_t, string> > records;
+  for (int j = 0; j < jobs; j++) {
+    string part_path = string(report_path) + "." + to_string(j);
+    ifstream part(part_path);
+    string line;
+    while (getline(part, line)) {
+      size_t index = 0;
+      sscanf(line.c_str(), "{\"index\": %zu", &index);
+      records.push_back(make_pair(index, line));
+    }
+    part.close();
+    unlink(part_path.c_str());
+  }
+  sort(records.begin(), records.end());
+
+  // Runs of a worker that died have no records, report them as errors
+  ofstream report(report_path);
+  size_t missing = 0;
+  size_t i = 0;
+  for (size_t k = 0; k < files.size(); k++) {
+    if (i < records.size() && records[i].first == k) {
+      report << records[i++].second << endl;
+      continue;
+    }
+    report << "{\"index\": " << k << ", \"elf\": \"" << json_escape(files[k])
+           << "\", \"status\": \"error\", \"exit\": 0, \"cycles\": 0"
+           << ", \"extmem_bytes\": 0, \"uart\": \"\"}" << endl;
+    missing++;
+  }
+  if (missing > 0) {
+    cerr << "patemu: error: Batch worker died, " << missing
+         << " entries reported as errors" << endl;
+    result = EXIT_FAILURE;
+  }
+  return result;
+}
+
+// Server mode. Each worker process keeps a model ready and runs one job
+// per connection to the socket. A job starts with a header of
+// "<key> <value>" lines, which ends with an empty line:
+//   elf <path>     the program to run, required
+//   limit <N>      stop after <N> cycles (default: -l)
+//   perf 1         add the performance statistics to the result
+// Everything the client sends after the header is input for the UART,
+// until it shuts down its side of the connection. The server sends the
+// UART output in frames of a line "uart <n>" followed by <n> bytes, and
+// ends with a line "done <result>", where the result is a record of the
+// batch report without the index. Invalid headers get "error <message>".
+
+static bool send_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, data, len);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return false;
+    }
+    data += w;
+    len -= w;
+  }
+  return true;
+}
+
+static bool send_uart(int fd, const string &uart) {
+  string frame = "uart " + to_string(uart.size()) + "\n" + uart;
+  return send_all(fd, frame.data(), frame.size());
+}
+
+// Read the header of a job, byte by byte to leave the UART input unread
+static bool read_header(int fd, map<string, string> &header) {
+  string line;
+  char ch;
+  while (line.size() < 4096) {
+    ssize_t r = read(fd, &ch, 1);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    if (ch != '\n') {
+      line.push_back(ch);
+      continue;
+    }
+    if (line.empty()) {
+      return true;
+    }
+    size_t sep = line.find(' ');
+    if (sep == string::npos) {
+      return false;
+    }
+    header[line.substr(0, sep)] = line.substr(sep + 1);
+    line.clear();
+  }
+  return false;
+}
+
+static void serve_job(Emulator *emu, int conn, long int limit, bool random,
+                      bool perf) {
+  map<string, string> header;
+  if (!read_header(conn, header) || header.count("elf") == 0) {
+    const char *msg = "error Invalid job header\n";
+    send_all(conn, msg, strlen(msg));
+    return;
+  }
+  if (header.count("limit") > 0) {
+    limit = atol(header["limit"].c_str());
+  }
+  perf = perf || header["perf"] == "1";
+
+  string uart;
+  emu->clear_state(random);
+  emu->UART_to_string(&uart);
+
+  bool halt = false;
+  bool connected = true;
+  bool loaded = emu->load_program(header["elf"].c_str(), -1, STDOUT_FILENO);
+  while (loaded && !emu->done() && (limit < 0 || emu->get_tick_count() < limit)) {
+    emu->tick(conn, STDOUT_FILENO);
+    emu->emu_extmem();
+    if (perf) {
+      emu->emu_perf();
+    }
+    emu->halt_step();
+    // Return to address 0 halts the execution after one more iteration
+    if (halt) {
+      break;
+    }
+    halt = emu->at_halt();
+    if (uart.size() >= UART_OUT_BUFSIZE || (!uart.empty() && uart.back() == '\n')) {
+      connected = send_uart(conn, uart);
+      uart.clear();
+      if (!connected) {
+        break;
+      }
+    }
+  }
+  if (!connected || (!uart.empty() && !send_uart(conn, uart))) {
+    return;
+  }
+
+  // The output was sent already
+  ostringstream result;
+  result << "done {";
+  report_run(result, emu, header["elf"], loaded, halt, perf, "");
+  result << "}\n";
+  send_all(conn, result.str().data(), result.str().size());
+}
+
+static void serve_jobs(int sock, long int limit, bool random, bool perf,
+                       bool uart_fast) {
+  Emulator *emu = new Emulator();
+  emu->UART_fast(uart_fast);
+  finish_ends_job = true;
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      cerr << "patemu: error: Cannot accept connection" << endl;
+      break;
+    }
+    serve_job(emu, conn, limit, random, perf);
+    close(conn);
+  }
+  delete emu;
+}
+
+// Start a server worker with the signals of the parent unblocked, returns
+// its process id or -1
+static pid_t spawn_server_worker(int sock, const sigset_t &events, long int limit,
+                                 bool random, bool perf, bool uart_fast) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    cerr << "patemu: error: Cannot fork server worker" << endl;
+    return -1;
+  }
+  if (pid == 0) {
+    sigprocmask(SIG_UNBLOCK, &events, NULL);
+    serve_jobs(sock, limit, random, perf, uart_fast);
+    _exit(EXIT_FAILURE);
+  }
+  return pid;
+}
+
+static int run_server(const char *path, int jobs, long int limit, bool random,
+                      bool perf, bool uart_fast) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    cerr << "patemu: error: Socket path too long " << path << endl;
+    return EXIT_FAILURE;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Replace the socket of a previous server, but nothing else
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(sock, SOMAXCONN) < 0) {
+    cerr << "patemu: error: Cannot listen on socket " << path << endl;
+    return EXIT_FAILURE;
+  }
+  // Clients that go away must not take the server with them
+  signal(SIGPIPE, SIG_IGN);
+
+  // All workers accept connections on the same socket. The parent replaces
+  // workers that die, and stops them when it is interrupted or terminated.
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  sigset_t events = stop;
+  sigaddset(&events, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &events, NULL);
+  vector<pid_t> workers;
+  for (int j = 0; j < jobs; j++) {
+    pid_t pid = spawn_server_worker(sock, events, limit, random, perf, uart_fast);
+    if (pid < 0) {
+      break;
+    }
+    workers.push_back(pid);
+  }
+  bool ok = workers.size() == (size_t)jobs;
+  int sig;
+  while (ok && sigwait(&events, &sig) == 0 && sig == SIGCHLD) {
+    pid_t pid;
+    while (ok && (pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+      size_t j = find(workers.begin(), workers.end(), pid) - workers.begin();
+      if (j == workers.size()) {
+        continue;
+      }
+      cerr << "patemu: error: Server worker " << pid << " died, restarting it" << endl;
+      // Do not spin if workers die right away
+      sleep(1);
+      workers[j] = spawn_server_worker(sock, events, limit, random, perf, uart_fast);
+      if (workers[j] < 0) {
+        workers.erase(workers.begin() + j);
+        ok = false;
+      }
+    }
+  }
+  for (size_t j = 0; j < workers.size(); j++) {
+    kill(workers[j], SIGTERM);
+    waitpid(workers[j], NULL, 0);
+  }
+  close(sock);
+  unlink(path);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char **argv, char **env)
 {
   Verilated::commandArgs(argc, argv);
-  Emulator *emu = new Emulator();
   int opt;
   int limit = -1;
   bool halt = false;
   bool reg_print = false;
+  bool bench = false;
+  bool vcd = false;
+  bool random = false;
+  const char *batch_report = NULL;
+  const char *server_path = NULL;
+  int jobs = 1;
+  const char *save_path = NULL;
+  const char *restore_path = NULL;
+  long int save_cycle = -1;
+  long long save_pc = -1;
+  uint64_t trace_first = 0;
+  uint64_t trace_last = UINT64_MAX;
+  long long trigger_pc = -1;
+  int trigger_uart = -1;
+  long int ring_cycles = 0;
+  const char *perf_path = NULL;
+  const char *prof_path = NULL;
+  const char *regtrace_path = NULL;
+  const char *memtrace_path = NULL;
+  long int prof_interval = 100;
+  bool lockstep = false;
+  bool mismatch = false;
+  long int warp_threshold = 0;
+  long int warp_max = WARP_MAX_DEFAULT;
 
   int uart_in = STDIN_FILENO;
   int uart_out = STDOUT_FILENO;
   bool keys = false;
+  bool uart_fast = false;
   
   //Parse Arguments
-  while ((opt = getopt(argc, argv, "hvl:iO:I:rk")) != -1){
+  while ((opt = getopt(argc, argv, "bB:s:hj:vl:iO:I:frkS:R:c:P:w:t:u:n:p:g:G:E:M:Lx:X:e:W:")) != -1){
     switch (opt) {
+      case 'b':
+        bench = true;
+        break;
+      case 'B':
+        batch_report = optarg;
+        break;
+      case 's':
+        server_path = optarg;
+        break;
+      case 'j':
+        jobs = atoi(optarg);
+        if (jobs < 1) {
+          cerr << argv[0] << ": error: Invalid number of jobs " << optarg << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'v':
-        emu->setTrace();
+        vcd = true;
+        break;
+      case 'w': {
+        char *end;
+        trace_first = strtoull(optarg, &end, 0);
+        if (*end == ':' && *(end+1) != '\0') {
+          trace_last = strtoull(end+1, &end, 0);
+        }
+        if (*end != '\0' && *end != ':') {
+          cerr << argv[0] << ": error: Invalid cycle window " << optarg << endl;
+          exit(EXIT_FAILURE);
+        }
+        vcd = true;
+        break;
+      }
+      case 't':
+        trigger_pc = strtoll(optarg, NULL, 0);
+        vcd = true;
+        break;
+      case 'u':
+        trigger_uart = strtol(optarg, NULL, 0) & 0xff;
+        vcd = true;
         break;
       case 'l':
         limit = atoi(optarg);
         break;
       case 'i':
-        emu->init_extmem();
+        random = true;
         break;
       #ifdef IO_UART
       case 'I':
@@ -784,10 +3482,87 @@ int main(int argc, char **argv, char **env)
           }
         }
         break;
+      case 'f':
+        uart_fast = true;
+        break;
       #endif
       case 'r':
         reg_print = true;
         break;
+      case 'E':
+        regtrace_path = optarg;
+        break;
+      case 'M':
+        memtrace_path = optarg;
+        break;
+      case 'L':
+        lockstep = true;
+        break;
+      #ifdef IO_ETHMAC
+      case 'x':
+        if (!ethmac.open_input(optarg)) {
+          cerr << argv[0] << ": error: Cannot read pcap file " << optarg << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'X':
+        if (!ethmac.open_output(optarg)) {
+          cerr << argv[0] << ": error: Cannot open pcap file " << optarg << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'e':
+        if (!ethmac.set_peer(optarg)) {
+          cerr << argv[0] << ": error: Invalid peer address " << optarg << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      #endif /* IO_ETHMAC */
+      case 'p':
+        perf_path = optarg;
+        break;
+      case 'g':
+        prof_path = optarg;
+        break;
+      case 'G':
+        prof_interval = atol(optarg);
+        if (prof_interval < 1) {
+          cerr << argv[0] << ": error: Invalid sampling interval " << optarg << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      #ifdef IO_TIMER
+      case 'W': {
+        char *end;
+        warp_threshold = strtol(optarg, &end, 0);
+        if (*end == ':') {
+          warp_max = strtol(end + 1, &end, 0);
+        }
+        if (*end != '\0' || warp_threshold < 1 || warp_max < 1) {
+          cerr << argv[0] << ": error: Invalid fast-forward parameters " << optarg << endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      }
+      #endif /* IO_TIMER */
+      #if EMU_SAVABLE
+      case 'S':
+        save_path = optarg;
+        break;
+      case 'R':
+        restore_path = optarg;
+        break;
+      case 'c':
+        save_cycle = atol(optarg);
+        break;
+      case 'P':
+        save_pc = strtoll(optarg, NULL, 0);
+        break;
+      case 'n':
+        ring_cycles = atol(optarg);
+        vcd = true;
+        break;
+      #endif /* EMU_SAVABLE */
       #ifdef IO_KEYS
       case 'k':
       keys = true;
@@ -804,34 +3579,106 @@ int main(int argc, char **argv, char **env)
     }
   }
 
-  
-  emu->reset(1);
-  emu->tick(uart_in, uart_out);
-  emu->UART_init();
+  if (server_path != NULL)
+  {
+    // Server mode, runs until it is terminated
+    exit(run_server(server_path, jobs, limit, random, perf_path != NULL, uart_fast));
+  }
+
+  if (batch_report != NULL)
+  {
+    // Batch mode, the model is created in each worker process
+    vector<string> files(argv + optind, argv + argc);
+    if (jobs > 1) {
+      exit(run_batch_parallel(files, jobs, batch_report, limit, random,
+                                perf_path != NULL));
+    }
+    ofstream report(batch_report);
+    if (!report.good()) {
+      cerr << argv[0] << ": error: Cannot open report file " << batch_report << endl;
+      exit(EXIT_FAILURE);
+    }
+    exit(run_batch(files, 0, 1, report, limit, random, perf_path != NULL) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  // Tracing starts later if it waits for a trigger or for the end
+  bool triggered = trigger_pc < 0 && trigger_uart < 0;
+  Emulator *emu = new Emulator();
+  if (vcd && triggered && ring_cycles == 0) {
+    emu->setTrace(trace_first, trace_last);
+  }
+  if (random) {
+    emu->init_extmem();
+  }
+  emu->UART_fast(uart_fast);
+  if (prof_path != NULL) {
+    emu->prof_enable(prof_interval);
+  }
+  if (lockstep) {
+    // The model starts at the entry point, which is only known for programs
+    if (optind >= argc || restore_path != NULL) {
+      cerr << argv[0] << ": error: Lockstep checking needs an ELF file" << endl;
+      exit(EXIT_FAILURE);
+    }
+    emu->lockstep_enable();
+  }
+  #ifdef IO_TIMER
+  if (warp_threshold > 0) {
+    emu->warp_enable(warp_threshold, warp_max);
+  }
+  #endif /* IO_TIMER */
 
-  val_t entry = 0;
-  if (optind < argc)
+  #if EMU_SAVABLE
+  if (restore_path != NULL)
   {
-    ifstream *fs = new ifstream(argv[optind]);
-    if (!fs->good())
+    // The snapshot already contains the program and the state after reset
+    emu->restore_state(restore_path);
+  }
+  else
+  #endif /* EMU_SAVABLE */
+  {
+    const char *elf = optind < argc ? argv[optind] : NULL;
+    chrono::steady_clock::time_point load_start = chrono::steady_clock::now();
+    if (!emu->load_program(elf, uart_in, uart_out))
     {
-      cerr << "Error: Cannot open elf file " << endl;
+      cerr << "Error: Cannot load elf file " << endl;
       exit(EXIT_FAILURE);
     }
-    entry = emu->readelf(*fs);
+    if (bench && elf != NULL) {
+      chrono::duration<double> secs = chrono::steady_clock::now() - load_start;
+      struct stat st;
+      cerr << "patemu: loaded " << elf << " ("
+           << (stat(elf, &st) == 0 ? (long long)st.st_size : 0) << " bytes) in "
+           << secs.count() << " s" << endl;
+    }
   }
 
-  emu->reset(5);
-  emu->tick(uart_in, uart_out);
 
-  emu->init_icache(entry);
+  #if EMU_SAVABLE
+  if (ring_cycles > 0) {
+    emu->ring_init(ring_cycles, TRACE_FILE);
+  }
+  #endif /* EMU_SAVABLE */
 
+  RegTraceWriter regtrace;
+  if (regtrace_path != NULL && !regtrace.open(regtrace_path, true)) {
+    cerr << argv[0] << ": error: Cannot open trace file " << regtrace_path << endl;
+    exit(EXIT_FAILURE);
+  }
+  MemTraceWriter memtrace;
+  if (memtrace_path != NULL && !memtrace.open(memtrace_path, true)) {
+    cerr << argv[0] << ": error: Cannot open trace file " << memtrace_path << endl;
+    exit(EXIT_FAILURE);
+  }
 
   int cnt = 0;
   int waituart = 0;
   if(reg_print){
     printf("Patmos start\n");
   }
+
+  long int bench_start_tick = emu->get_tick_count();
+  chrono::steady_clock::time_point bench_start = chrono::steady_clock::now();
   while (limit < 0 || emu->get_tick_count() < limit)
   {
     cnt++;
@@ -840,36 +3687,123 @@ int main(int argc, char **argv, char **env)
       emu->emu_keys();
     }
     emu->emu_extmem();
+    if (perf_path != NULL) {
+      emu->emu_perf();
+    }
+    if (prof_path != NULL) {
+      emu->emu_prof();
+    }
+    if (memtrace_path != NULL) {
+      emu->memtrace_step(memtrace);
+    }
+    if (lockstep && !emu->lockstep_step()) {
+      mismatch = true;
+      break;
+    }
+    emu->halt_step();
      // Return to address 0 halts the execution after one more iteration
     if (halt) {
       break;
     }
-    #if CORE_COUNT == 1
-    if (reg_print && emu->c->Patmos__DOT__cores_0__DOT__enableReg) {
+    emu->update_pc();
+    if (reg_print) {
       emu->print_state();
     }
+    if (regtrace_path != NULL && emu->core_enabled()) {
+      emu->trace_state(regtrace);
+    }
+    halt = emu->at_halt();
+    #ifdef IO_TIMER
+    if (warp_threshold > 0 && !halt) {
+      emu->warp_step(limit);
+    }
+    #endif /* IO_TIMER */
+
+    if (!triggered
+        && ((trigger_pc >= 0 && emu->get_pc() == (val_t)trigger_pc)
+            || (trigger_uart >= 0 && emu->get_uart_out_byte() == trigger_uart))) {
+      triggered = true;
+      #if EMU_SAVABLE
+      if (ring_cycles > 0) {
+        emu->ring_dump(keys);
+      } else
+      #endif /* EMU_SAVABLE */
+      {
+        emu->setTrace(max(trace_first, (uint64_t)emu->get_tick_count()), trace_last);
+      }
+    }
 
-    if ((emu->c->Patmos__DOT__cores_0__DOT__memory__DOT__memReg_mem_brcf == 1
-         || emu->c->Patmos__DOT__cores_0__DOT__memory__DOT__memReg_mem_ret == 1)
-        && emu->c->Patmos__DOT__cores_0__DOT__icache__DOT__repl__DOT__callRetBaseReg == 0) {
-      halt = true;
+    #if EMU_SAVABLE
+    emu->ring_step();
+    if (save_path != NULL
+        && ((save_cycle >= 0 && emu->get_tick_count() >= save_cycle)
+            || (save_pc >= 0 && emu->get_pc() == (val_t)save_pc))) {
+      emu->save_state(save_path);
+      save_path = NULL;
     }
-    #endif
-    #if CORE_COUNT > 1
-    if (reg_print && emu->c->__PVT__Patmos__DOT__cores_0->__PVT__enableReg) {
-      emu->print_state();
+    #endif /* EMU_SAVABLE */
+  }
+
+  emu->uart_flush();
+  regtrace.close();
+  memtrace.close();
+  #ifdef IO_ETHMAC
+  ethmac.close();
+  #endif /* IO_ETHMAC */
+
+  if (prof_path != NULL) {
+    emu->prof_write(prof_path, optind < argc ? argv[optind] : NULL);
+  }
+
+  if (perf_path != NULL) {
+    ofstream perf_out(perf_path);
+    if (!perf_out.good()) {
+      cerr << argv[0] << ": error: Cannot open statistics file " << perf_path << endl;
+      exit(EXIT_FAILURE);
     }
+    size_t len = strlen(perf_path);
+    if (len >= 4 && strcmp(perf_path + len - 4, ".csv") == 0) {
+      emu->perf_csv(perf_out, true);
+    } else {
+      emu->perf_json(perf_out);
+      perf_out << endl;
+    }
+  }
 
-    if ((emu->c->__PVT__Patmos__DOT__cores_0->__PVT__memory__DOT__memReg_mem_brcf == 1
-         || emu->c->__PVT__Patmos__DOT__cores_0->__PVT__memory__DOT__memReg_mem_ret == 1)
-        && emu->c->__PVT__Patmos__DOT__cores_0->__PVT__icache__DOT__repl__DOT__callRetBaseReg == 0) {
-      halt = true;
+  #if EMU_SAVABLE
+  // Without a trigger, the ring buffer holds the last cycles of the run
+  emu->ring_dump(keys);
+
+  // Save at the end of the simulation if no other point was given
+  if (save_path != NULL && save_cycle < 0 && save_pc < 0) {
+    emu->save_state(save_path);
+  }
+  #endif /* EMU_SAVABLE */
+
+  if (bench) {
+    chrono::duration<double> secs = chrono::steady_clock::now() - bench_start;
+    long int cycles = emu->get_tick_count() - bench_start_tick;
+    cerr << "patemu: " << cycles << " cycles in " << secs.count() << " s, "
+         << (secs.count() > 0 ? cycles / secs.count() : 0) << " cycles/s, "
+         << EMU_THREADS << " thread(s), " << CORE_COUNT << " core(s)" << endl;
+    cerr << "patemu: " << emu->extmem_footprint() / 1024
+         << " KB of external memory touched" << endl;
+    emu->extmem_report(cerr);
+    #ifdef IO_ETHMAC
+    ethmac.report(cerr);
+    #endif /* IO_ETHMAC */
+    #ifdef IO_TIMER
+    if (warp_threshold > 0) {
+      emu->warp_report(cerr);
+    }
+    #endif /* IO_TIMER */
+    if (CORE_COUNT > 1) {
+      emu->halt_report(cerr);
     }
-    #endif
   }
 
   emu->stopTrace();
-  exit(EXIT_SUCCESS);
+  exit(mismatch ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 
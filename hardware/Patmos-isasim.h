@@ -0,0 +1,432 @@
+/*
+   Instruction set model of Patmos for lockstep checking of the emulator
+   (patemu -L), following isasim/src/main/scala/patsim/PatSim.scala and
+   the pipeline in hardware/src/main/scala/patmos.
+
+   The model executes one bundle per call of step(). Both operations of a
+   bundle read their operands before either of them writes its result, as
+   in the hardware. Delayed control flow takes effect after the delay
+   slots, non-delayed control flow immediately.
+
+   Some results depend on state that the model does not have: loaded
+   values and the stack cache pointers. For these, step() records the
+   destination register in pending[], and the caller copies the value from
+   the hardware with adopt(). Exceptions and interrupts are not modelled;
+   a trap or an illegal operation sets unsupported.
+*/
+
+#ifndef _PATMOS_ISASIM_H_
+#define _PATMOS_ISASIM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// Opcodes, bits 26..22 of an instruction
+#define ISA_OPC_ALUL       0x1f
+#define ISA_OPC_ALU        0x08
+#define ISA_OPC_SPC        0x09
+#define ISA_OPC_LDT        0x0a
+#define ISA_OPC_STT        0x0b
+#define ISA_OPC_STC        0x0c
+#define ISA_OPC_CALLND     0x10
+#define ISA_OPC_CALL       0x11
+#define ISA_OPC_BRND       0x12
+#define ISA_OPC_BR         0x13
+#define ISA_OPC_BRCFND     0x14
+#define ISA_OPC_BRCF       0x15
+#define ISA_OPC_TRAP       0x16
+#define ISA_OPC_CFLRND     0x18
+#define ISA_OPC_CFLR       0x19
+
+// Sub-opcodes of ALU and special register operations, bits 6..4
+#define ISA_ALU_R          0
+#define ISA_ALU_U          1
+#define ISA_ALU_M          2
+#define ISA_ALU_C          3
+#define ISA_ALU_P          4
+#define ISA_ALU_B          5
+#define ISA_ALU_CI         6
+#define ISA_SPC_MTS        2
+#define ISA_SPC_MFS        3
+
+// Unary ALU operations, bits 3..0
+#define ISA_UFUNC_SEXT8    0
+#define ISA_UFUNC_SEXT16   1
+#define ISA_UFUNC_ZEXT16   2
+#define ISA_UFUNC_ABS      3
+
+// Register-indirect control flow, bits 3..0
+#define ISA_JFUNC_RET      0
+#define ISA_JFUNC_XRET     1
+#define ISA_JFUNC_CALL     4
+#define ISA_JFUNC_BR       5
+#define ISA_JFUNC_BRCF     10
+
+// Special registers
+#define ISA_SPEC_FL        0
+#define ISA_SPEC_SL        2
+#define ISA_SPEC_SH        3
+#define ISA_SPEC_SS        5
+#define ISA_SPEC_ST        6
+#define ISA_SPEC_SRB       7
+#define ISA_SPEC_SRO       8
+#define ISA_SPEC_SXB       9
+#define ISA_SPEC_SXO       10
+
+class IsaSim {
+public:
+  uint32_t reg[32];
+  bool pred[8];
+  uint32_t spec[16];
+
+  // Byte address of the next bundle and base address of the current method
+  uint32_t pc;
+  uint32_t base;
+
+  // Destination registers whose values must be taken from the hardware
+  unsigned pending_count;
+  unsigned pending[2];
+
+  // Reason why the model cannot follow the program any more, or NULL
+  const char *unsupported;
+
+private:
+  unsigned pipes;
+
+  // Control flow that waits for its delay slots
+  bool branched;
+  unsigned delay;
+  uint32_t target_pc;
+  uint32_t target_base;
+  bool target_call;
+
+  // Results of the current bundle for special registers
+  uint32_t mul_lo, mul_hi;
+  uint32_t spec_val[16];
+
+  struct Result {
+    bool valid;
+    unsigned rd;
+    uint32_t val;
+    bool pending;
+  };
+
+  static uint32_t bits(uint32_t instr, unsigned hi, unsigned lo) {
+    return (instr >> lo) & ((1u << (hi - lo + 1)) - 1);
+  }
+
+  bool get_pred(unsigned p) const {
+    return pred[p & 7] ^ ((p >> 3) & 1);
+  }
+
+  static uint32_t alu(unsigned func, uint32_t op1, uint32_t op2) {
+    unsigned shamt = op2 & 0x1f;
+    switch (func) {
+    case 0x0: return op1 + op2;
+    case 0x1: return op1 - op2;
+    case 0x2: return op1 ^ op2;
+    case 0x3: return op1 << shamt;
+    case 0x4: return op1 >> shamt;
+    case 0x5: return (uint32_t)((int32_t)op1 >> shamt);
+    case 0x6: return op1 | op2;
+    case 0x7: return op1 & op2;
+    case 0xb: return ~(op1 | op2);
+    case 0xc: return (op1 << 1) + op2;
+    case 0xd: return (op1 << 2) + op2;
+    default:  return op1 + op2;
+    }
+  }
+
+  static bool cmp(unsigned func, uint32_t op1, uint32_t op2) {
+    switch (func) {
+    case 0x0: return op1 == op2;
+    case 0x1: return op1 != op2;
+    case 0x2: return (int32_t)op1 < (int32_t)op2;
+    case 0x3: return (int32_t)op1 <= (int32_t)op2;
+    case 0x4: return op1 < op2;
+    case 0x5: return op1 <= op2;
+    case 0x6: return (op1 >> (op2 & 0x1f)) & 1;
+    default:  return false;
+    }
+  }
+
+  static bool pred_op(unsigned func, bool op1, bool op2) {
+    switch (func) {
+    case 0:  return op1 | op2;
+    case 1:  return op1 & op2;
+    case 2:  return op1 ^ op2;
+    default: return !(op1 | op2);
+    }
+  }
+
+  void branch(uint32_t new_pc, uint32_t new_base, unsigned slots, bool call) {
+    branched = true;
+    target_pc = new_pc;
+    target_base = new_base;
+    target_call = call;
+    delay = slots;
+  }
+
+  // Operations that may be issued in both pipelines. Results are only
+  // computed here, writes happen after both operations have been decoded.
+  void execute_alu(uint32_t instr, uint32_t imm, bool exec, Result &res,
+                   bool *pred_wr, bool *pred_val, uint32_t *spec_wr) {
+    unsigned opcode = bits(instr, 26, 22);
+    unsigned rd = bits(instr, 21, 17);
+    uint32_t rs1 = reg[bits(instr, 16, 12)];
+    uint32_t rs2 = reg[bits(instr, 11, 7)];
+    unsigned opc = bits(instr, 6, 4);
+    unsigned func = bits(instr, 3, 0);
+
+    res.valid = false;
+    res.pending = false;
+    if (!exec) {
+      return;
+    }
+    res.rd = rd;
+
+    if ((opcode >> 3) == 0) {
+      res.valid = true;
+      res.val = alu(bits(instr, 24, 22), rs1, bits(instr, 11, 0));
+    } else if (opcode == ISA_OPC_ALUL) {
+      res.valid = true;
+      res.val = alu(func, rs1, imm);
+    } else if (opcode == ISA_OPC_ALU) {
+      unsigned pd = bits(instr, 19, 17);
+      switch (opc) {
+      case ISA_ALU_R:
+        res.valid = true;
+        res.val = alu(func, rs1, rs2);
+        break;
+      case ISA_ALU_U:
+        res.valid = true;
+        switch (func) {
+        case ISA_UFUNC_SEXT8:  res.val = (int32_t)(int8_t)rs1; break;
+        case ISA_UFUNC_SEXT16: res.val = (int32_t)(int16_t)rs1; break;
+        case ISA_UFUNC_ZEXT16: res.val = rs1 & 0xffff; break;
+        case ISA_UFUNC_ABS:    res.val = (int32_t)rs1 < 0 ? -rs1 : rs1; break;
+        default:
+          res.valid = false;
+          unsupported = "illegal operation";
+          break;
+        }
+        break;
+      case ISA_ALU_M: {
+        uint64_t prod = func == 0
+          ? (uint64_t)((int64_t)(int32_t)rs1 * (int64_t)(int32_t)rs2)
+          : (uint64_t)rs1 * (uint64_t)rs2;
+        spec_wr[ISA_SPEC_SL] = 1;
+        spec_wr[ISA_SPEC_SH] = 1;
+        mul_lo = (uint32_t)prod;
+        mul_hi = (uint32_t)(prod >> 32);
+        break;
+      }
+      case ISA_ALU_C:
+        pred_wr[pd] = true;
+        pred_val[pd] = cmp(func, rs1, rs2);
+        break;
+      case ISA_ALU_CI:
+        pred_wr[pd] = true;
+        pred_val[pd] = cmp(func, rs1, bits(instr, 11, 7));
+        break;
+      case ISA_ALU_P:
+        pred_wr[pd] = true;
+        pred_val[pd] = pred_op((func >> 2 & 2) | (func & 1),
+                               get_pred(bits(instr, 15, 12)),
+                               get_pred(bits(instr, 10, 7)));
+        break;
+      case ISA_ALU_B: {
+        unsigned pos = bits(instr, 11, 7);
+        res.valid = true;
+        res.val = (rs1 & ~(1u << pos)) | ((uint32_t)get_pred(func) << pos);
+        break;
+      }
+      default:
+        unsupported = "illegal operation";
+        break;
+      }
+    } else if (opcode == ISA_OPC_SPC && opc == ISA_SPC_MTS) {
+      if (func == ISA_SPEC_FL) {
+        for (unsigned i = 0; i < 8; i++) {
+          pred_wr[i] = true;
+          pred_val[i] = (rs1 >> i) & 1;
+        }
+      } else {
+        spec_wr[func] = 1;
+        spec_val[func] = rs1;
+      }
+    } else if (opcode == ISA_OPC_SPC && opc == ISA_SPC_MFS) {
+      res.valid = true;
+      if (func == ISA_SPEC_FL) {
+        res.val = 0;
+        for (unsigned i = 0; i < 8; i++) {
+          res.val |= (uint32_t)pred[i] << i;
+        }
+      } else if (func == ISA_SPEC_SS || func == ISA_SPEC_ST) {
+        res.pending = true;
+      } else {
+        res.val = spec[func];
+      }
+    } else {
+      unsupported = "illegal operation";
+    }
+  }
+
+public:
+  IsaSim(unsigned pipe_count) : pipes(pipe_count) {
+    reset(0, 0);
+  }
+
+  // Start execution at byte address start in the method at base
+  void reset(uint32_t start, uint32_t method) {
+    memset(reg, 0, sizeof(reg));
+    memset(spec, 0, sizeof(spec));
+    for (unsigned i = 0; i < 8; i++) {
+      pred[i] = i == 0;
+    }
+    pc = start;
+    base = method;
+    delay = 0;
+    pending_count = 0;
+    unsupported = NULL;
+  }
+
+  // Execute the bundle at pc, made of the words instr_a and instr_b
+  void step(uint32_t instr_a, uint32_t instr_b) {
+    bool bundle = (instr_a >> 31) != 0;
+    bool long_imm = bits(instr_a, 26, 22) == ISA_OPC_ALUL;
+    bool dual = bundle && !long_imm && pipes > 1;
+    uint32_t next = pc + (bundle ? 8 : 4);
+
+    uint32_t instrs[2] = { instr_a, instr_b };
+    Result res[2];
+    bool pred_wr[8] = { false };
+    bool pred_val[8];
+    uint32_t spec_wr[16] = { 0 };
+    branched = false;
+    pending_count = 0;
+
+    for (unsigned i = 0; i < (dual ? 2u : 1u); i++) {
+      uint32_t instr = instrs[i];
+      bool exec = get_pred(bits(instr, 30, 27));
+      unsigned opcode = bits(instr, 26, 22);
+      res[i].valid = false;
+      res[i].pending = false;
+
+      // Memory, stack and control-flow operations exist only in the
+      // first pipeline
+      if (i == 0 && (opcode == ISA_OPC_LDT || opcode == ISA_OPC_STT
+                     || opcode == ISA_OPC_STC || (opcode & 0x10))
+          && opcode != ISA_OPC_ALUL) {
+        if (!exec) {
+          continue;
+        }
+        uint32_t rs1 = reg[bits(instr, 16, 12)];
+        uint32_t rs2 = reg[bits(instr, 11, 7)];
+        uint32_t imm22 = bits(instr, 21, 0);
+        int32_t simm22 = (int32_t)(imm22 << 10) >> 10;
+        bool nd = !(opcode & 1);
+        switch (opcode) {
+        case ISA_OPC_LDT:
+          res[i].valid = true;
+          res[i].pending = true;
+          res[i].rd = bits(instr, 21, 17);
+          break;
+        case ISA_OPC_STT:
+        case ISA_OPC_STC:
+          break;
+        case ISA_OPC_CALL:
+        case ISA_OPC_CALLND:
+          branch(imm22 << 2, imm22 << 2, nd ? 0 : 3, true);
+          break;
+        case ISA_OPC_BR:
+        case ISA_OPC_BRND:
+          branch(pc + (simm22 << 2), base, nd ? 0 : 2, false);
+          break;
+        case ISA_OPC_BRCF:
+        case ISA_OPC_BRCFND:
+          branch(imm22 << 2, imm22 << 2, nd ? 0 : 3, false);
+          break;
+        case ISA_OPC_CFLR:
+        case ISA_OPC_CFLRND:
+          switch (bits(instr, 3, 0)) {
+          case ISA_JFUNC_RET:
+            branch(spec[ISA_SPEC_SRB] + spec[ISA_SPEC_SRO], spec[ISA_SPEC_SRB],
+                   nd ? 0 : 3, false);
+            break;
+          case ISA_JFUNC_XRET:
+            branch(spec[ISA_SPEC_SXB] + spec[ISA_SPEC_SXO], spec[ISA_SPEC_SXB],
+                   nd ? 0 : 3, false);
+            break;
+          case ISA_JFUNC_CALL:
+            branch(rs1, rs1, nd ? 0 : 3, true);
+            break;
+          case ISA_JFUNC_BR:
+            branch(rs1, base, nd ? 0 : 2, false);
+            break;
+          case ISA_JFUNC_BRCF:
+            branch(rs1 + rs2, rs1, nd ? 0 : 3, false);
+            break;
+          default:
+            unsupported = "illegal operation";
+            break;
+          }
+          break;
+        case ISA_OPC_TRAP:
+          unsupported = "trap";
+          break;
+        default:
+          unsupported = "illegal operation";
+          break;
+        }
+        continue;
+      }
+
+      execute_alu(instr, instr_b, exec, res[i], pred_wr, pred_val, spec_wr);
+    }
+
+    // Write back, the first pipeline wins for the same destination
+    for (int i = dual ? 1 : 0; i >= 0; i--) {
+      if (res[i].valid && res[i].rd != 0) {
+        if (res[i].pending) {
+          pending[pending_count++] = res[i].rd;
+        } else {
+          reg[res[i].rd] = res[i].val;
+        }
+      }
+    }
+    for (unsigned i = 1; i < 8; i++) {
+      if (pred_wr[i]) {
+        pred[i] = pred_val[i];
+      }
+    }
+    for (unsigned i = 0; i < 16; i++) {
+      if (spec_wr[i]) {
+        spec[i] = (i == ISA_SPEC_SL) ? mul_lo
+          : (i == ISA_SPEC_SH) ? mul_hi : spec_val[i];
+      }
+    }
+
+    // Control flow after the delay slots
+    if (!branched && delay > 0) {
+      delay--;
+      branched = delay == 0;
+    }
+    if (branched && delay == 0) {
+      if (target_call) {
+        spec[ISA_SPEC_SRB] = base;
+        spec[ISA_SPEC_SRO] = next - base;
+      }
+      next = target_pc;
+      base = target_base;
+    }
+    pc = next;
+  }
+
+  // Set a register that step() left pending to its value in the hardware
+  void adopt(unsigned rd, uint32_t val) {
+    reg[rd] = val;
+  }
+};
+
+#endif /* _PATMOS_ISASIM_H_ */
@@ -38,6 +38,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <gelf.h>
 #include <libelf.h>
 
@@ -57,6 +59,10 @@ static void write_extmem(val_t address, val_t word) {
   ram_buf[address] = word;
 }
 
+static void clear_extmem(val_t address, size_t words) {
+  memset(&ram_buf[address], 0, words * sizeof(uint32_t));
+}
+
 static void init_extmem(Patmos_t *c, bool random) {
   // Get SRAM properties
   uint32_t addr_bits = c->Patmos__io_sSRam32CtrlPins_ramOut_addr.width();
@@ -134,6 +140,10 @@ static void write_extmem(val_t address, val_t word) {
   ram_buf[(address << 1) | 1] = word >> 16;
 }
 
+static void clear_extmem(val_t address, size_t words) {
+  memset(&ram_buf[address << 1], 0, words * 2 * sizeof(uint16_t));
+}
+
 static void init_extmem(Patmos_t *c, bool random) {
   // Get SRAM properties
   uint32_t addr_bits = c->Patmos_ramCtrl__addrReg.width();
@@ -180,6 +190,7 @@ static void emu_extmem(Patmos_t *c) {
 #ifndef EXTMEM_SSRAM32CTRL
 #ifndef EXTMEM_SRAMCTRL
 static void write_extmem(val_t address, val_t word) {}
+static void clear_extmem(val_t address, size_t words) {}
 static void init_extmem(Patmos_t *c, bool random) {}
 static void emu_extmem(Patmos_t *c) {}
 #endif
@@ -382,34 +393,51 @@ static void emu_ethmac(Patmos_t *c, int ethmac_tap) {
 }
 #endif /* IO_ETHMAC */
 
-// Read an elf executable image into the on-chip memories
-static val_t readelf(istream &is, Patmos_t *c)
-{
-  vector<unsigned char> elfbuf;
-  elfbuf.reserve(1 << 20);
+// Read a big-endian word from the ELF image
+static inline val_t load_be32(const unsigned char *p) {
+  return (((val_t)p[0] << 24) | ((val_t)p[1] << 16) |
+          ((val_t)p[2] << 8) | ((val_t)p[3] << 0));
+}
 
-  // read the whole stream.
-  while (!is.eof())
-  {
-    char buf[1024];
+// Write a word to the ISPM, the address must map to the ISPM
+static void write_ispm(Patmos_t *c, val_t paddr, val_t word) {
+  val_t addr = (paddr - (0x1 << OCMEM_ADDR_BITS)) >> 3;
+  unsigned size = (sizeof(c->Patmos_PatmosCore_fetch_MemBlock__mem.contents) /
+                   sizeof(c->Patmos_PatmosCore_fetch_MemBlock__mem.contents[0]));
+  assert(addr < size && "Instructions mapped to ISPM exceed size");
 
-    // read into buffer
-    is.read(&buf[0], sizeof(buf));
+  // Write to even or odd block
+  if ((paddr & 0x4) == 0) {
+    c->Patmos_PatmosCore_fetch_MemBlock__mem.put(addr, word);
+  } else {
+    c->Patmos_PatmosCore_fetch_MemBlock_1__mem.put(addr, word);
+  }
+}
 
-    // check how much was read
-    streamsize count = is.gcount();
-    assert(count <= 1024);
+// Read an elf executable image into the on-chip memories. The file is
+// mapped into memory and copied segment by segment, word by word.
+static val_t readelf(int fd, Patmos_t *c)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    cerr << "readelf: cannot read ELF file.\n";
+    exit(EXIT_FAILURE);
+  }
+  size_t size = st.st_size;
 
-    // write into main memory
-    for(unsigned i = 0; i < count; i++)
-      elfbuf.push_back(buf[i]);
+  // private mapping, in case libelf modifies the image
+  unsigned char *image = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE, fd, 0);
+  if (image == MAP_FAILED) {
+    cerr << "readelf: cannot map ELF file: " << strerror(errno) << "\n";
+    exit(EXIT_FAILURE);
   }
 
   // check libelf version
   elf_version(EV_CURRENT);
 
   // open elf binary
-  Elf *elf = elf_memory((char*)&elfbuf[0], elfbuf.size());
+  Elf *elf = elf_memory((char*)image, size);
   assert(elf);
 
   // check file kind
@@ -451,44 +479,39 @@ static val_t readelf(istream &is, Patmos_t *c)
       // some assertions
       //assert(phdr.p_vaddr == phdr.p_paddr);
       assert(phdr.p_filesz <= phdr.p_memsz);
-
-      // copy from the buffer into the on-chip memories
-      for (size_t k = 0; k < phdr.p_memsz; k++) {
-
-        if ((phdr.p_flags & PF_X) != 0 &&
-            ((phdr.p_paddr + k) >> OCMEM_ADDR_BITS) == 0x1 &&
-            ((phdr.p_paddr + k) & 0x3) == 0) {
-          // Address maps to ISPM and is at a word boundary
-          val_t word = k >= phdr.p_filesz ? 0 :
-            (((val_t)elfbuf[phdr.p_offset + k + 0] << 24) |
-             ((val_t)elfbuf[phdr.p_offset + k + 1] << 16) |
-             ((val_t)elfbuf[phdr.p_offset + k + 2] << 8) |
-             ((val_t)elfbuf[phdr.p_offset + k + 3] << 0));
-          val_t addr = ((phdr.p_paddr + k) - (0x1 << OCMEM_ADDR_BITS)) >> 3;
-          unsigned size = (sizeof(c->Patmos_PatmosCore_fetch_MemBlock__mem.contents) /
-                           sizeof(c->Patmos_PatmosCore_fetch_MemBlock__mem.contents[0]));
-          assert(addr < size && "Instructions mapped to ISPM exceed size");
-
-          // Write to even or odd block
-          if (((phdr.p_paddr + k) & 0x4) == 0) {
-            c->Patmos_PatmosCore_fetch_MemBlock__mem.put(addr, word);
-          } else {
-            c->Patmos_PatmosCore_fetch_MemBlock_1__mem.put(addr, word);
+      assert((phdr.p_paddr & 0x3) == 0 && "Segment is not word-aligned");
+      assert(phdr.p_offset + phdr.p_filesz <= size);
+
+      const unsigned char *data = image + phdr.p_offset;
+      size_t fullwords = phdr.p_filesz / 4;
+      size_t filewords = (phdr.p_filesz + 3) / 4;
+      size_t memwords = (phdr.p_memsz + 3) / 4;
+
+      // a partial word at the end of the file contents is padded with zeros
+      unsigned char tail[4] = { 0, 0, 0, 0 };
+      memcpy(tail, data + 4 * fullwords, phdr.p_filesz - 4 * fullwords);
+
+      // copy executable code that maps to the ISPM
+      if ((phdr.p_flags & PF_X) != 0) {
+        for (size_t w = 0; w < memwords; w++) {
+          val_t paddr = phdr.p_paddr + 4 * w;
+          if ((paddr >> OCMEM_ADDR_BITS) == 0x1) {
+            val_t word = w < fullwords ? load_be32(data + 4 * w) :
+              (w < filewords ? load_be32(tail) : 0);
+            write_ispm(c, paddr, word);
           }
         }
+      }
 
-        if (((phdr.p_paddr + k) & 0x3) == 0) {
-          // Address maps to SRAM and is at a word boundary
-          val_t word = k >= phdr.p_filesz ? 0 :
-            (((val_t)elfbuf[phdr.p_offset + k + 0] << 24) |
-             ((val_t)elfbuf[phdr.p_offset + k + 1] << 16) |
-             ((val_t)elfbuf[phdr.p_offset + k + 2] << 8) |
-             ((val_t)elfbuf[phdr.p_offset + k + 3] << 0));
-
-          val_t addr = ((phdr.p_paddr + k) >> 2);
-          write_extmem(addr, word);
-        }
+      // copy the whole segment to the external memory and clear .bss
+      val_t base = phdr.p_paddr >> 2;
+      for (size_t w = 0; w < fullwords; w++) {
+        write_extmem(base + w, load_be32(data + 4 * w));
       }
+      if (fullwords < filewords) {
+        write_extmem(base + fullwords, load_be32(tail));
+      }
+      clear_extmem(base + filewords, memwords - filewords);
     }
   }
 
@@ -496,6 +519,7 @@ static val_t readelf(istream &is, Patmos_t *c)
   val_t entry = hdr.e_entry;
 
   elf_end(elf);
+  munmap(image, size);
 
   return entry;
 }
@@ -844,12 +868,13 @@ int main (int argc, char* argv[]) {
   // Parse ELF file, if present
   val_t entry = 0;
   if (optind < argc) {
-    ifstream *fs = new ifstream(argv[optind]);
-    if (!fs->good()) {
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
       cerr << argv[0] << ": error: Cannot open elf file " << argv[optind] << endl;
       exit(EXIT_FAILURE);
     }
-    entry = readelf(*fs, c);
+    entry = readelf(fd, c);
+    close(fd);
   }
 
   // Create vcd trace file if necessary
@@ -171,8 +171,10 @@ class Exceptions extends Module {
   io.excdec.excBase := excBaseReg
   io.excdec.excAddr := excAddrReg
 
-  // Wake up
-  when (sleepReg && (exc === UInt(1) || (intr && intrEna))) {
+  // Wake up, also on a pending interrupt while interrupts are disabled, so
+  // software can check for a condition and go to sleep without missing an
+  // interrupt in between
+  when (sleepReg && (exc === UInt(1) || intr)) {
     io.ocp.S.Resp := OcpResp.DVA
     sleepReg := Bool(false)
   }
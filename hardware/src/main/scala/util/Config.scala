@@ -277,14 +277,48 @@ object Config {
       val file_config = new File("build/emulator_config.h") 
       val emuConfig = new PrintWriter(file_config)
       emuConfig.write("#define CORE_COUNT "+coreCount+"\n")
+      emuConfig.write("#define PIPE_COUNT "+pipeCount+"\n")
       emuConfig.write("#define ICACHE_"+ICache.typ.toUpperCase+"\n")
       emuConfig.write("#define IO_UART\n")
-      for (d <- Devs) { emuConfig.write("#define IO_"+d.name.toUpperCase+"\n") }
+      for (d <- Devs) {
+        emuConfig.write("#define IO_"+d.name.toUpperCase+"\n")
+        emuConfig.write("#define IO_"+d.name.toUpperCase+"_OFFSET "+d.offset+"\n")
+      }
       emuConfig.write("#define EXTMEM_"+ExtMem.ram.name.toUpperCase+"\n")
-      emuConfig.write("#define EXTMEM_ADDR_BITS "+ ExtMemAddrWidth +"\n")
+      // Devices without an address width parameter (e.g., MemBridge) are
+      // emulated with 32-bit words, as large as the memory itself
+      val ExtMemAddrBits = if (ExtMemAddrWidth != "") ExtMemAddrWidth
+                           else log2Up(ExtMem.size / 4).toString
+      emuConfig.write("#define EXTMEM_ADDR_BITS "+ ExtMemAddrBits +"\n")
+      emuConfig.write("#define EXTMEM_BURST_LENGTH "+ burstLength +"\n")
+      // Timing model of the external memory, if any
+      val ExtMemTiming = (ExtMemNode \ "Timing")
+      if (!ExtMemTiming.isEmpty) {
+        val timing = ExtMemTiming(0)
+        emuConfig.write("#define EXTMEM_TIMING_"+find(timing, "@type").text.toUpperCase+"\n")
+        for (a <- timing.attributes if a.key != "type") {
+          emuConfig.write("#define EXTMEM_TIMING_"+a.key.toUpperCase+" "+a.value.text+"\n")
+        }
+      }
       emuConfig.write("#define BAUDRATE " + ConstantsForConf.UART_BAUD.toString + "\n") //TODO take baud from configuration .XML
       emuConfig.write("#define FREQ "+ frequency +"\n")
       emuConfig.close();
+
+      // Table of the cores for the emulator, such that it can access all
+      // cores in loops instead of naming each of them
+      val emuCores = new PrintWriter(new File("build/emulator_cores.h"))
+      emuCores.write("#define PATMOS_CORES(c)")
+      if (coreCount > 1) {
+        emuCores.write((0 until coreCount).map(i => " (c)->__PVT__Patmos__DOT__cores_"+i).mkString(","))
+      }
+      emuCores.write("\n")
+      // Each core has its own timer, at the top level of the design
+      if (Devs.exists(d => d.name == "Timer")) {
+        emuCores.write("#define PATMOS_TIMERS(c, sig)")
+        emuCores.write((0 until coreCount).map(i => " &(c)->Patmos__DOT__Timer"+(if (i > 0) "_"+i else "")+"__DOT__##sig").mkString(","))
+        emuCores.write("\n")
+      }
+      emuCores.close();
       
 
       private def devFromXML(node: scala.xml.Node, devs: scala.xml.NodeSeq,
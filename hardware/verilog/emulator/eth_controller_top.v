@@ -0,0 +1,79 @@
+//
+//   Replacement of the Ethernet controller (hardware/ethmac) for the
+//   Verilator emulator. The buffer, the registers and the buffer
+//   descriptors are emulated in Patmos-harness.cpp, which is called
+//   through DPI in every cycle. Like the OCP slave of the controller, the
+//   emulator responds in the cycle after a command.
+//
+
+module eth_controller_top #(
+  parameter BUFF_ADDR_WIDTH = 16
+) (
+  input                        clk,
+  input                        rst,
+
+  input  [2:0]                 M_Cmd,
+  input  [BUFF_ADDR_WIDTH-1:0] M_Addr,
+  input  [31:0]                M_Data,
+  input  [3:0]                 M_ByteEn,
+  output reg [1:0]             S_Resp,
+  output reg [31:0]            S_Data,
+
+  input                        mtx_clk_pad_i,
+  output [3:0]                 mtxd_pad_o,
+  output                       mtxen_pad_o,
+  output                       mtxerr_pad_o,
+
+  input                        mrx_clk_pad_i,
+  input  [3:0]                 mrxd_pad_i,
+  input                        mrxdv_pad_i,
+  input                        mrxerr_pad_i,
+
+  input                        mcoll_pad_i,
+  input                        mcrs_pad_i,
+
+  input                        md_pad_i,
+  output                       mdc_pad_o,
+  output                       md_pad_o,
+  output                       md_padoe_o,
+
+  output reg                   int_o
+);
+
+  import "DPI-C" function void patemu_ethmac(input int addr_bits,
+                                             input int cmd,
+                                             input int addr,
+                                             input int data,
+                                             input int byte_en,
+                                             output int resp,
+                                             output int rdata,
+                                             output int intr);
+
+  int resp;
+  int rdata;
+  int intr;
+
+  always @(posedge clk) begin
+    if (rst) begin
+      S_Resp <= 2'b00;
+      S_Data <= 32'b0;
+      int_o <= 1'b0;
+    end else begin
+      patemu_ethmac(BUFF_ADDR_WIDTH, {29'b0, M_Cmd},
+                    {{(32-BUFF_ADDR_WIDTH){1'b0}}, M_Addr}, M_Data,
+                    {28'b0, M_ByteEn}, resp, rdata, intr);
+      S_Resp <= resp[1:0];
+      S_Data <= rdata;
+      int_o <= intr[0];
+    end
+  end
+
+  // The PHY pins are not emulated
+  assign mtxd_pad_o = 4'b0;
+  assign mtxen_pad_o = 1'b0;
+  assign mtxerr_pad_o = 1'b0;
+  assign mdc_pad_o = 1'b0;
+  assign md_pad_o = 1'b0;
+  assign md_padoe_o = 1'b0;
+
+endmodule
@@ -0,0 +1,270 @@
+/*
+   Models of the Patmos caches for trace-driven simulation, see cachesim.
+
+   The models count hits, misses and transfers to the external memory and
+   follow the replacement and write policies of the hardware: the FIFO
+   method cache (MCacheReplFifo), the direct-mapped data caches with
+   write-through and write-back, the two-way set-associative data cache
+   with LRU replacement, the write combine buffer and the stack cache. The
+   direct-mapped instruction cache (ICacheReplDm) is a read-only
+   DataCacheModel. The models do not know about timing; the caller
+   estimates stall cycles from the transfers.
+*/
+
+#ifndef _CACHEMODEL_H_
+#define _CACHEMODEL_H_
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+// Method cache with FIFO replacement. It holds at most <count> methods,
+// which share <size> bytes of cache memory; methods are evicted in the
+// order they were loaded until the new method fits.
+class MethodCacheModel {
+  struct Entry {
+    uint32_t base;
+    uint32_t words;
+  };
+
+  unsigned count;
+  int32_t free_words;
+  std::deque<Entry> entries;
+
+public:
+  unsigned long long hits, misses;
+
+  MethodCacheModel(uint32_t size, unsigned count)
+    : count(count), free_words(size / 4), hits(0), misses(0) {}
+
+  // Request the method at byte address <base> with <bytes> bytes, returns
+  // the number of words loaded from memory
+  uint32_t request(uint32_t base, uint32_t bytes) {
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (entries[i].base == base) {
+        hits++;
+        return 0;
+      }
+    }
+    misses++;
+    // Sizes are rounded up to double words
+    uint32_t words = (bytes + 3) / 4;
+    words += words & 1;
+    if (entries.size() == count) {
+      free_words += entries.front().words;
+      entries.pop_front();
+    }
+    free_words -= words;
+    while (free_words < 0 && !entries.empty()) {
+      free_words += entries.front().words;
+      entries.pop_front();
+    }
+    Entry e = { base, words };
+    entries.push_back(e);
+    return words;
+  }
+};
+
+// Set-associative cache with one or two ways, LRU replacement and
+// write-back or write-through. Write-through caches do not allocate on
+// writes, write-back caches do.
+class DataCacheModel {
+  struct Line {
+    uint32_t tag;
+    bool valid;
+    bool dirty;
+  };
+
+  unsigned ways;
+  unsigned line_bits;
+  unsigned sets;
+  bool write_through;
+  std::vector<Line> lines;
+  // Way that was used last, per set
+  std::vector<uint8_t> lru;
+
+  Line *lookup(uint32_t addr, unsigned &set) {
+    uint32_t line = addr >> line_bits;
+    set = line % sets;
+    for (unsigned w = 0; w < ways; w++) {
+      Line &l = lines[set * ways + w];
+      if (l.valid && l.tag == line / sets) {
+        lru[set] = w;
+        return &l;
+      }
+    }
+    return NULL;
+  }
+
+  // Replace the least recently used line, returns whether a dirty line
+  // was written back
+  bool allocate(uint32_t addr, unsigned set, bool dirty) {
+    unsigned w = ways == 1 ? 0 : 1 - lru[set];
+    Line &l = lines[set * ways + w];
+    bool write_back = l.valid && l.dirty;
+    if (write_back) {
+      write_backs++;
+    }
+    l.tag = (addr >> line_bits) / sets;
+    l.valid = true;
+    l.dirty = dirty;
+    lru[set] = w;
+    return write_back;
+  }
+
+public:
+  unsigned long long hits, misses, write_backs;
+
+  // Cache with <size> bytes, <ways> ways and lines of <line_size> bytes
+  DataCacheModel(uint32_t size, unsigned ways, uint32_t line_size,
+                 bool write_through)
+    : ways(ways), line_bits(0), write_through(write_through),
+      hits(0), misses(0), write_backs(0) {
+    while ((1U << line_bits) < line_size) {
+      line_bits++;
+    }
+    sets = size / line_size / ways;
+    if (sets == 0) {
+      sets = 1;
+    }
+    Line empty = { 0, false, false };
+    lines.assign(sets * ways, empty);
+    lru.assign(sets, 0);
+  }
+
+  // Read from <addr>, returns whether the line had to be filled;
+  // <write_back> tells whether a dirty line was evicted
+  bool read(uint32_t addr, bool &write_back) {
+    unsigned set;
+    write_back = false;
+    if (lookup(addr, set) != NULL) {
+      hits++;
+      return false;
+    }
+    misses++;
+    write_back = allocate(addr, set, false);
+    return true;
+  }
+
+  // Write to <addr>, returns whether the line had to be filled
+  bool write(uint32_t addr, bool &write_back) {
+    unsigned set;
+    write_back = false;
+    Line *l = lookup(addr, set);
+    if (l != NULL) {
+      hits++;
+      l->dirty = !write_through;
+      return false;
+    }
+    misses++;
+    if (write_through) {
+      return false;
+    }
+    write_back = allocate(addr, set, true);
+    return true;
+  }
+};
+
+// Buffer that combines writes to the same burst. A write to another burst
+// writes the buffer to memory.
+class WriteCombineModel {
+  uint32_t burst_bits;
+  uint32_t tag;
+  bool valid;
+
+public:
+  unsigned long long hits, misses;
+
+  WriteCombineModel(uint32_t burst_size)
+    : burst_bits(0), tag(0), valid(false), hits(0), misses(0) {
+    while ((1U << burst_bits) < burst_size) {
+      burst_bits++;
+    }
+  }
+
+  // Returns whether the buffer was written to memory
+  bool write(uint32_t addr) {
+    if (valid && tag == addr >> burst_bits) {
+      hits++;
+      return false;
+    }
+    misses++;
+    tag = addr >> burst_bits;
+    valid = true;
+    return true;
+  }
+};
+
+// Stack cache, which keeps the area between the stack top and the memory
+// top. Spilling and filling transfer whole bursts, aligned to the burst
+// size, like the hardware does.
+class StackCacheModel {
+  uint32_t size;
+  uint32_t burst;
+  uint32_t stack_top;
+  uint32_t mem_top;
+
+  uint32_t align_down(uint32_t addr) const {
+    return addr - addr % burst;
+  }
+  uint32_t bursts(uint32_t from, uint32_t to) const {
+    return from < to ? (to - align_down(from) + burst - 1) / burst : 0;
+  }
+
+public:
+  unsigned long long spills, fills;
+
+  StackCacheModel(uint32_t size, uint32_t burst)
+    : size(size), burst(burst), stack_top(0), mem_top(0),
+      spills(0), fills(0) {}
+
+  void set_stack_top(uint32_t addr) { stack_top = addr; }
+  void set_mem_top(uint32_t addr) { mem_top = addr; }
+
+  // Reserve <n> bytes, returns the number of bursts spilled
+  uint32_t reserve(uint32_t n) {
+    stack_top -= n;
+    if (mem_top - stack_top <= size) {
+      return 0;
+    }
+    uint32_t b = bursts(stack_top + size, mem_top);
+    mem_top = stack_top + size;
+    spills += b;
+    return b;
+  }
+
+  // Make sure that <n> bytes are in the cache, returns the number of
+  // bursts filled
+  uint32_t ensure(uint32_t n) {
+    if (mem_top - stack_top >= n) {
+      return 0;
+    }
+    uint32_t b = bursts(mem_top, stack_top + n);
+    mem_top = stack_top + n;
+    fills += b;
+    return b;
+  }
+
+  // Free <n> bytes
+  void free(uint32_t n) {
+    bool above = mem_top - stack_top < n;
+    stack_top += n;
+    if (above) {
+      mem_top = stack_top;
+    }
+  }
+
+  // Spill <n> bytes from the bottom of the cache, returns the number of
+  // bursts spilled
+  uint32_t spill(uint32_t n) {
+    if (n > mem_top - stack_top) {
+      n = mem_top - stack_top;
+    }
+    uint32_t b = bursts(mem_top - n, mem_top);
+    mem_top -= n;
+    spills += b;
+    return b;
+  }
+};
+
+#endif /* _CACHEMODEL_H_ */
@@ -0,0 +1,198 @@
+/*
+   Binary memory access trace format, written by the emulator (patemu -M)
+   for offline cache studies and read by the memtrace tool.
+
+   A trace contains, for each core, one record per access of the memory
+   stage, one per request to the method cache and one per operation of the
+   stack cache, in the order of their cycles. The records are encoded as:
+
+   - A header byte:
+       bits 0-1  kind, see MEMTRACE_READ etc.
+       bits 2-3  reads and writes: the address space, see MEMTRACE_STACK etc.
+       bits 4-5  reads and writes: log2 of the access size in bytes
+       bits 2-4  stack operations: the operation, see MEMTRACE_SC_RES etc.
+       bit 6     a byte with the core follows; otherwise, it is the core of
+                 the previous record
+       bit 7     a varint of the cycle distance to the previous record
+                 follows; otherwise, it is the same cycle
+   - Reads, writes and method requests: the zigzag varint of the distance
+     to the previous address of the same kind on the same core. Method
+     requests are followed by the size of the method in bytes as varint.
+   - Stack operations: the operand as varint, in bytes for reserve,
+     ensure, free and spill, the new pointer for setting the stack top and
+     the memory top.
+
+   Stack accesses are recorded with their absolute address, not relative
+   to the stack top. Local accesses go to the data scratchpad or, for
+   addresses from 0xf0000000 on, to I/O devices. The memory stage always
+   reads whole words, so reads are recorded as word accesses. Stack
+   operations are recorded in the cycle after they left the execute stage.
+
+   The records are grouped into blocks, which can be compressed with zstd,
+   see tracefile.h. The magic number of memory access traces is "PMTR".
+*/
+
+#ifndef _MEMTRACE_H_
+#define _MEMTRACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "tracefile.h"
+
+#define MEMTRACE_MAGIC "PMTR"
+#define MEMTRACE_VERSION 1
+#define MEMTRACE_MAX_CORES 256
+
+enum {
+  MEMTRACE_READ = 0,
+  MEMTRACE_WRITE = 1,
+  MEMTRACE_METHOD = 2,
+  MEMTRACE_STACK_OP = 3
+};
+
+// Address spaces, as in the OCP interface of the data caches, with the
+// unused encoding for local accesses
+enum {
+  MEMTRACE_STACK = 0,
+  MEMTRACE_LOCAL = 1,
+  MEMTRACE_DATA = 2,
+  MEMTRACE_UNCACHED = 3
+};
+
+// Stack cache operations, as in the interface of the stack cache
+enum {
+  MEMTRACE_SC_SET_ST = 1,
+  MEMTRACE_SC_SET_MT = 2,
+  MEMTRACE_SC_RES = 3,
+  MEMTRACE_SC_ENS = 4,
+  MEMTRACE_SC_FREE = 5,
+  MEMTRACE_SC_SPILL = 6
+};
+
+struct MemTraceRecord {
+  uint64_t cycle;
+  unsigned core;
+  unsigned kind;
+  // Address space of reads and writes, or the stack operation
+  unsigned space;
+  // Access size or method size in bytes
+  uint32_t size;
+  // Address, or the operand of stack operations
+  uint32_t addr;
+};
+
+// State shared between the encoder and the decoder
+struct MemTraceState {
+  uint64_t cycle;
+  unsigned core;
+  uint32_t addr[MEMTRACE_MAX_CORES][2];
+
+  void reset(void) {
+    cycle = 0;
+    core = 0;
+    memset(addr, 0, sizeof(addr));
+  }
+
+  // Previous address of accesses or method requests
+  uint32_t &last_addr(unsigned core, unsigned kind) {
+    return addr[core][kind == MEMTRACE_METHOD];
+  }
+};
+
+class MemTraceWriter : public TraceFileWriter {
+  MemTraceState state;
+
+public:
+  bool open(const char *path, bool compress) {
+    state.reset();
+    return open_file(path, MEMTRACE_MAGIC, MEMTRACE_VERSION, compress);
+  }
+
+  void write(const MemTraceRecord &rec) {
+    size_t start = buf.size();
+    buf.push_back(0);
+    uint8_t head = rec.kind;
+
+    if (rec.kind == MEMTRACE_STACK_OP) {
+      head |= rec.space << 2;
+    } else if (rec.kind != MEMTRACE_METHOD) {
+      unsigned size_log = rec.size >= 4 ? 2 : rec.size >> 1;
+      head |= rec.space << 2 | size_log << 4;
+    }
+    if (rec.core != state.core) {
+      head |= 1 << 6;
+      buf.push_back(rec.core);
+      state.core = rec.core;
+    }
+    if (rec.cycle != state.cycle) {
+      head |= 1 << 7;
+      put_varint(rec.cycle - state.cycle);
+      state.cycle = rec.cycle;
+    }
+
+    if (rec.kind == MEMTRACE_STACK_OP) {
+      put_varint(rec.addr);
+    } else {
+      uint32_t &last = state.last_addr(rec.core, rec.kind);
+      put_varint(zigzag((int32_t)(rec.addr - last)));
+      last = rec.addr;
+      if (rec.kind == MEMTRACE_METHOD) {
+        put_varint(rec.size);
+      }
+    }
+    buf[start] = head;
+
+    end_record();
+  }
+};
+
+class MemTraceReader : public TraceFileReader {
+  MemTraceState state;
+
+public:
+  // Returns an error message, or NULL if the trace could be opened
+  const char *open(const char *path) {
+    state.reset();
+    return open_file(path, MEMTRACE_MAGIC, MEMTRACE_VERSION,
+                     "not a memory access trace");
+  }
+
+  // Decode the next record, returns false at the end of the trace or
+  // if the trace is corrupt, see failed()
+  bool next(MemTraceRecord &rec) {
+    if (!next_record()) {
+      return false;
+    }
+    uint8_t head = get_byte();
+    if (head & (1 << 6)) {
+      state.core = get_byte();
+    }
+    if (head & (1 << 7)) {
+      state.cycle += get_varint64();
+    }
+
+    rec.cycle = state.cycle;
+    rec.core = state.core;
+    rec.kind = head & 3;
+    if (rec.kind == MEMTRACE_STACK_OP) {
+      rec.space = (head >> 2) & 7;
+      rec.size = 0;
+      rec.addr = get_varint();
+    } else {
+      uint32_t &last = state.last_addr(rec.core, rec.kind);
+      last += (uint32_t)unzigzag(get_varint());
+      rec.addr = last;
+      if (rec.kind == MEMTRACE_METHOD) {
+        rec.space = 0;
+        rec.size = get_varint();
+      } else {
+        rec.space = (head >> 2) & 3;
+        rec.size = 1 << ((head >> 4) & 3);
+      }
+    }
+    return !error;
+  }
+};
+
+#endif /* _MEMTRACE_H_ */
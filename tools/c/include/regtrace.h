@@ -0,0 +1,197 @@
+/*
+   Binary register trace format, written by the emulator (patemu -E) and
+   read by the regtrace tool.
+
+   A trace contains one record per executed bundle of core 0, with the
+   same information as the text output of patemu -r: the fetch PC and the
+   register file. To keep traces small, the records are delta-encoded:
+
+   - A record starts with a header byte:
+       bits 0-1  PC: 0 follows the previous bundle, 1 same as the previous
+                 record, 2 a zigzag varint of the word distance follows
+       bit 2     the bundle follows as one or two little-endian words;
+                 otherwise, it is the one last seen at this PC
+       bits 4-7  number of changed registers; 15 means that the number
+                 follows as varint
+   - Each changed register is encoded as its index byte and the zigzag
+     varint of the difference to its previous value.
+
+   The records are grouped into blocks, which can be compressed with zstd,
+   see tracefile.h. The magic number of register traces is "PTRC".
+*/
+
+#ifndef _REGTRACE_H_
+#define _REGTRACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "tracefile.h"
+
+#define REGTRACE_MAGIC "PTRC"
+#define REGTRACE_VERSION 1
+#define REGTRACE_REGS 32
+// Number of entries in the table of the last bundle per PC
+#define REGTRACE_BUNDLE_CACHE 4096
+
+enum {
+  REGTRACE_PC_NEXT = 0,
+  REGTRACE_PC_SAME = 1,
+  REGTRACE_PC_DELTA = 2
+};
+
+struct RegTraceRecord {
+  uint32_t pc;
+  uint32_t bundle[2];
+  uint32_t regs[REGTRACE_REGS];
+
+  // A bundle is long if the first word has its top bit set
+  unsigned bundle_words(void) const {
+    return (bundle[0] >> 31) ? 2 : 1;
+  }
+};
+
+// State shared between the encoder and the decoder
+struct RegTraceState {
+  RegTraceRecord last;
+  struct CacheEntry {
+    uint32_t pc;
+    uint32_t bundle[2];
+  } cache[REGTRACE_BUNDLE_CACHE];
+
+  void reset(void) {
+    memset(&last, 0, sizeof(last));
+    for (unsigned i = 0; i < REGTRACE_BUNDLE_CACHE; i++) {
+      cache[i].pc = ~0u;
+      cache[i].bundle[0] = cache[i].bundle[1] = 0;
+    }
+  }
+
+  CacheEntry &cache_entry(uint32_t pc) {
+    return cache[(pc >> 2) & (REGTRACE_BUNDLE_CACHE-1)];
+  }
+};
+
+class RegTraceWriter : public TraceFileWriter {
+  RegTraceState state;
+
+public:
+  bool open(const char *path, bool compress) {
+    state.reset();
+    return open_file(path, REGTRACE_MAGIC, REGTRACE_VERSION, compress);
+  }
+
+  void write(const RegTraceRecord &rec) {
+    RegTraceRecord &last = state.last;
+    size_t start = buf.size();
+    buf.push_back(0);
+    uint8_t head;
+
+    // PC
+    if (rec.pc == last.pc + 4 * last.bundle_words()) {
+      head = REGTRACE_PC_NEXT;
+    } else if (rec.pc == last.pc) {
+      head = REGTRACE_PC_SAME;
+    } else {
+      head = REGTRACE_PC_DELTA;
+      put_varint(zigzag((int32_t)(rec.pc - last.pc) >> 2));
+    }
+
+    // Bundle
+    RegTraceState::CacheEntry &entry = state.cache_entry(rec.pc);
+    unsigned words = rec.bundle_words();
+    if (entry.pc != rec.pc || entry.bundle[0] != rec.bundle[0]
+        || (words == 2 && entry.bundle[1] != rec.bundle[1])) {
+      head |= 1 << 2;
+      put_word(rec.bundle[0]);
+      if (words == 2) {
+        put_word(rec.bundle[1]);
+      }
+      entry.pc = rec.pc;
+      entry.bundle[0] = rec.bundle[0];
+      entry.bundle[1] = words == 2 ? rec.bundle[1] : 0;
+    }
+
+    // Registers
+    unsigned changed = 0;
+    for (unsigned i = 0; i < REGTRACE_REGS; i++) {
+      changed += rec.regs[i] != last.regs[i];
+    }
+    if (changed < 15) {
+      head |= changed << 4;
+    } else {
+      head |= 15 << 4;
+      put_varint(changed);
+    }
+    for (unsigned i = 0; i < REGTRACE_REGS; i++) {
+      if (rec.regs[i] != last.regs[i]) {
+        buf.push_back(i);
+        put_varint(zigzag((int32_t)(rec.regs[i] - last.regs[i])));
+      }
+    }
+    buf[start] = head;
+
+    last.pc = rec.pc;
+    last.bundle[0] = rec.bundle[0];
+    last.bundle[1] = words == 2 ? rec.bundle[1] : 0;
+    memcpy(last.regs, rec.regs, sizeof(last.regs));
+
+    end_record();
+  }
+};
+
+class RegTraceReader : public TraceFileReader {
+  RegTraceState state;
+
+public:
+  // Returns an error message, or NULL if the trace could be opened
+  const char *open(const char *path) {
+    state.reset();
+    return open_file(path, REGTRACE_MAGIC, REGTRACE_VERSION,
+                     "not a register trace");
+  }
+
+  // Decode the next record, returns false at the end of the trace or
+  // if the trace is corrupt, see failed()
+  bool next(RegTraceRecord &rec) {
+    if (!next_record()) {
+      return false;
+    }
+    RegTraceRecord &last = state.last;
+    uint8_t head = get_byte();
+
+    switch (head & 3) {
+    case REGTRACE_PC_NEXT:
+      last.pc += 4 * last.bundle_words();
+      break;
+    case REGTRACE_PC_SAME:
+      break;
+    default:
+      last.pc += (uint32_t)unzigzag(get_varint()) << 2;
+      break;
+    }
+
+    RegTraceState::CacheEntry &entry = state.cache_entry(last.pc);
+    if (head & (1 << 2)) {
+      entry.pc = last.pc;
+      entry.bundle[0] = get_word();
+      entry.bundle[1] = (entry.bundle[0] >> 31) ? get_word() : 0;
+    }
+    last.bundle[0] = entry.bundle[0];
+    last.bundle[1] = entry.bundle[1];
+
+    unsigned changed = head >> 4;
+    if (changed == 15) {
+      changed = get_varint();
+    }
+    for (unsigned i = 0; i < changed && !error; i++) {
+      unsigned r = get_byte() & (REGTRACE_REGS-1);
+      last.regs[r] += (uint32_t)unzigzag(get_varint());
+    }
+
+    rec = last;
+    return !error;
+  }
+};
+
+#endif /* _REGTRACE_H_ */
@@ -0,0 +1,270 @@
+/*
+   Block layer of the binary traces written by the emulator, see regtrace.h
+   and memtrace.h.
+
+   A trace file starts with a four-byte magic number, a version byte, the
+   compression byte and two reserved bytes. The records are grouped into
+   blocks of about TRACE_BLOCK_SIZE bytes, which can be compressed with
+   zstd. Each block has a header with its raw and its stored size, as
+   32-bit little-endian words. Records are encoded by the trace formats
+   with the varints and words provided here.
+*/
+
+#ifndef _TRACEFILE_H_
+#define _TRACEFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#if TRACE_ZSTD
+#include <zstd.h>
+#endif
+
+#define TRACE_BLOCK_SIZE (1 << 20)
+
+enum {
+  TRACE_RAW = 0,
+  TRACE_COMPRESS_ZSTD = 1
+};
+
+class TraceCodec {
+protected:
+  static uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+  }
+  static int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+  }
+};
+
+class TraceFileWriter : public TraceCodec {
+  FILE *file;
+  int compression;
+  std::vector<uint8_t> packed;
+
+  static void word_bytes(uint8_t *p, uint32_t v) {
+    p[0] = v & 0xff; p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+  }
+
+  void flush_block(void) {
+    if (buf.empty()) {
+      return;
+    }
+    const uint8_t *data = &buf[0];
+    size_t stored = buf.size();
+    #if TRACE_ZSTD
+    if (compression == TRACE_COMPRESS_ZSTD) {
+      packed.resize(ZSTD_compressBound(buf.size()));
+      size_t r = ZSTD_compress(&packed[0], packed.size(), &buf[0], buf.size(), 1);
+      if (!ZSTD_isError(r)) {
+        data = &packed[0];
+        stored = r;
+      }
+    }
+    #endif
+    uint8_t header[8];
+    word_bytes(header, buf.size());
+    word_bytes(header + 4, stored);
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(data, 1, stored, file);
+    buf.clear();
+  }
+
+protected:
+  std::vector<uint8_t> buf;
+
+  TraceFileWriter(void) : file(NULL), compression(TRACE_RAW) {}
+  ~TraceFileWriter(void) { close(); }
+
+  // Open a trace for writing; compression falls back to raw blocks if
+  // zstd support is not compiled in
+  bool open_file(const char *path, const char *magic, uint8_t version,
+                 bool compress) {
+    file = fopen(path, "wb");
+    if (file == NULL) {
+      return false;
+    }
+    #if TRACE_ZSTD
+    compression = compress ? TRACE_COMPRESS_ZSTD : TRACE_RAW;
+    #else
+    (void)compress;
+    compression = TRACE_RAW;
+    #endif
+    uint8_t header[8] = { (uint8_t)magic[0], (uint8_t)magic[1],
+                          (uint8_t)magic[2], (uint8_t)magic[3],
+                          version, (uint8_t)compression, 0, 0 };
+    fwrite(header, 1, sizeof(header), file);
+    buf.reserve(TRACE_BLOCK_SIZE + 512);
+    return true;
+  }
+
+  void put_varint(uint64_t v) {
+    while (v >= 0x80) {
+      buf.push_back((uint8_t)(v | 0x80));
+      v >>= 7;
+    }
+    buf.push_back((uint8_t)v);
+  }
+
+  void put_word(uint32_t v) {
+    buf.push_back(v & 0xff);
+    buf.push_back((v >> 8) & 0xff);
+    buf.push_back((v >> 16) & 0xff);
+    buf.push_back((v >> 24) & 0xff);
+  }
+
+  // To be called after each record, blocks end at record boundaries
+  void end_record(void) {
+    if (buf.size() >= TRACE_BLOCK_SIZE) {
+      flush_block();
+    }
+  }
+
+public:
+  bool is_open(void) const {
+    return file != NULL;
+  }
+
+  void close(void) {
+    if (file != NULL) {
+      flush_block();
+      fclose(file);
+      file = NULL;
+    }
+  }
+};
+
+class TraceFileReader : public TraceCodec {
+  FILE *file;
+  int compression;
+  std::vector<uint8_t> block;
+  std::vector<uint8_t> packed;
+
+  static uint32_t get_word_at(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+      ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  bool read_block(void) {
+    uint8_t header[8];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+      return false;
+    }
+    uint32_t raw = get_word_at(header);
+    uint32_t stored = get_word_at(header + 4);
+    block.resize(raw);
+    if (compression == TRACE_RAW || raw == stored) {
+      if (fread(&block[0], 1, raw, file) != raw) {
+        error = true;
+        return false;
+      }
+    } else {
+      #if TRACE_ZSTD
+      packed.resize(stored);
+      if (fread(&packed[0], 1, stored, file) != stored
+          || ZSTD_decompress(&block[0], raw, &packed[0], stored) != raw) {
+        error = true;
+        return false;
+      }
+      #else
+      error = true;
+      return false;
+      #endif
+    }
+    pos = &block[0];
+    end = pos + raw;
+    return true;
+  }
+
+protected:
+  const uint8_t *pos;
+  const uint8_t *end;
+  bool error;
+
+  TraceFileReader(void) : file(NULL), compression(TRACE_RAW),
+                          pos(NULL), end(NULL), error(false) {}
+  ~TraceFileReader(void) { close(); }
+
+  // Returns an error message, or NULL if the trace could be opened
+  const char *open_file(const char *path, const char *magic, uint8_t version,
+                        const char *kind) {
+    file = fopen(path, "rb");
+    if (file == NULL) {
+      return "cannot open file";
+    }
+    uint8_t header[8];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)
+        || memcmp(header, magic, 4) != 0) {
+      return kind;
+    }
+    if (header[4] != version) {
+      return "unsupported trace version";
+    }
+    compression = header[5];
+    #if !TRACE_ZSTD
+    if (compression != TRACE_RAW) {
+      return "trace is compressed, but zstd support is not compiled in";
+    }
+    #endif
+    return NULL;
+  }
+
+  // Start the next record, returns false at the end of the trace
+  bool next_record(void) {
+    return pos != end || read_block();
+  }
+
+  uint8_t get_byte(void) {
+    if (pos == end) {
+      error = true;
+      return 0;
+    }
+    return *pos++;
+  }
+
+  uint64_t get_varint64(void) {
+    uint64_t v = 0;
+    unsigned shift = 0;
+    while (pos < end && shift < 64) {
+      uint8_t b = *pos++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        return v;
+      }
+      shift += 7;
+    }
+    error = true;
+    return 0;
+  }
+
+  uint32_t get_varint(void) {
+    return (uint32_t)get_varint64();
+  }
+
+  uint32_t get_word(void) {
+    if (end - pos < 4) {
+      error = true;
+      return 0;
+    }
+    uint32_t v = get_word_at(pos);
+    pos += 4;
+    return v;
+  }
+
+public:
+  bool failed(void) const {
+    return error;
+  }
+
+  void close(void) {
+    if (file != NULL) {
+      fclose(file);
+      file = NULL;
+    }
+  }
+};
+
+#endif /* _TRACEFILE_H_ */
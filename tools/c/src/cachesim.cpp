@@ -0,0 +1,455 @@
+/*
+   Trace-driven simulation of Patmos cache configurations.
+
+   cachesim [-j <threads>] [-s <param>=<value>,...]... <trace> <config>...
+
+   Replays a memory access trace of the emulator (patemu -M) through the
+   caches of each configuration file, see hardware/config, and prints
+   one line per configuration with the hits and misses of each cache, the
+   transfers of the stack cache and the estimated stall cycles. Each core
+   has its own caches; contention for the memory is not modeled.
+
+   -s varies a parameter: each configuration is simulated with each of the
+   values, and several -s options give all combinations. Parameters are
+   named like the element and attribute in the configuration files:
+   ICache.type, ICache.size, ICache.assoc, DCache.size, DCache.assoc,
+   DCache.writeThrough, SCache.size, bus.burstLength, bus.writeCombine,
+   Timing.latency and Timing.wordCycles. The configurations are simulated
+   in parallel, on as many threads as the host has cores unless -j says
+   otherwise.
+
+   Stall cycles are estimated as Timing.latency plus Timing.wordCycles per
+   word for each transfer. The latency of an SDRAM is taken as tRCD plus
+   tCAS. The instruction cache (ICache.type "line") is approximated by
+   reading all lines of a method when it is called or returned to, as the
+   trace does not contain instruction fetches.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+
+#include "memtrace.h"
+#include "cachemodel.h"
+
+// Default latency of the external memory, as in the emulator
+#define SRAM_CYCLES 3
+
+// Methods below this address are in the boot ROM or the instruction
+// scratchpad, not in the cache
+#define METHOD_CACHE_START 0x20000
+
+struct CacheConfig {
+  std::string name;
+  std::string icache_type;
+  uint32_t icache_size;
+  unsigned icache_assoc;
+  uint32_t dcache_size;
+  unsigned dcache_assoc;
+  bool dcache_write_through;
+  uint32_t scache_size;
+  unsigned burst_length;
+  bool write_combine;
+  unsigned latency;
+  unsigned word_cycles;
+};
+
+struct CacheStats {
+  // Method cache or instruction cache
+  unsigned long long ic_hits, ic_misses;
+  unsigned long long dc_hits, dc_misses, dc_write_backs;
+  unsigned long long wc_hits, wc_misses;
+  unsigned long long sc_spills, sc_fills;
+  unsigned long long words;
+  unsigned long long stall_cycles;
+  uint64_t cycles;
+};
+
+static void fail(const std::string &msg)
+{
+  fprintf(stderr, "cachesim: error: %s\n", msg.c_str());
+  exit(2);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-j <threads>] [-s <param>=<value>,...]... "
+          "<trace> <config>...\n", name);
+}
+
+// Sizes with an optional suffix K, M or G, as in the configuration files
+static bool parse_size(const std::string &text, uint32_t &size)
+{
+  char *end;
+  unsigned long v = strtoul(text.c_str(), &end, 10);
+  if (end == text.c_str()) {
+    return false;
+  }
+  switch (*end) {
+  case 'k': case 'K': v <<= 10; end++; break;
+  case 'm': case 'M': v <<= 20; end++; break;
+  case 'g': case 'G': v <<= 30; end++; break;
+  }
+  size = v;
+  return *end == '\0';
+}
+
+static bool parse_bool(const std::string &text, bool &b)
+{
+  if (text == "true") {
+    b = true;
+  } else if (text == "false") {
+    b = false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Set a parameter, returns false if the parameter or its value is invalid
+static bool set_param(CacheConfig &conf, const std::string &param,
+                      const std::string &value)
+{
+  uint32_t n;
+  if (param == "ICache.type") {
+    conf.icache_type = value;
+    return value == "method" || value == "line";
+  } else if (param == "ICache.size") {
+    return parse_size(value, conf.icache_size);
+  } else if (param == "ICache.assoc") {
+    bool ok = parse_size(value, n);
+    conf.icache_assoc = n;
+    return ok && n > 0;
+  } else if (param == "DCache.size") {
+    return parse_size(value, conf.dcache_size);
+  } else if (param == "DCache.assoc") {
+    bool ok = parse_size(value, n);
+    conf.dcache_assoc = n;
+    return ok && (n == 1 || n == 2);
+  } else if (param == "DCache.writeThrough") {
+    return parse_bool(value, conf.dcache_write_through);
+  } else if (param == "SCache.size") {
+    return parse_size(value, conf.scache_size);
+  } else if (param == "bus.burstLength") {
+    bool ok = parse_size(value, n);
+    conf.burst_length = n;
+    return ok && n > 0;
+  } else if (param == "bus.writeCombine") {
+    return parse_bool(value, conf.write_combine);
+  } else if (param == "Timing.latency") {
+    bool ok = parse_size(value, n);
+    conf.latency = n;
+    return ok;
+  } else if (param == "Timing.wordCycles") {
+    bool ok = parse_size(value, n);
+    conf.word_cycles = n;
+    return ok && n > 0;
+  }
+  return false;
+}
+
+static void load_config(CacheConfig &conf, const std::string &path)
+{
+  namespace pt = boost::property_tree;
+  pt::ptree tree;
+  try {
+    pt::read_xml(path, tree);
+  } catch (const pt::xml_parser_error &e) {
+    fail(path + ": " + e.message());
+  }
+  boost::optional<pt::ptree &> patmos = tree.get_child_optional("patmos");
+  if (!patmos) {
+    fail(path + ": not a Patmos configuration");
+  }
+  const pt::ptree &root = *patmos;
+
+  // Attributes that are missing come from the default configuration
+  boost::optional<std::string> parent = root.get_optional<std::string>("<xmlattr>.default");
+  if (parent) {
+    std::string dir = path.substr(0, path.find_last_of('/') + 1);
+    load_config(conf, (*parent)[0] == '/' ? *parent : dir + *parent);
+  }
+
+  static const char *params[] = {
+    "ICache.type", "ICache.size", "ICache.assoc",
+    "DCache.size", "DCache.assoc", "DCache.writeThrough",
+    "SCache.size", "bus.burstLength", "bus.writeCombine"
+  };
+  for (unsigned i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    std::string param = params[i];
+    size_t dot = param.find('.');
+    std::string key = param.substr(0, dot) + ".<xmlattr>." + param.substr(dot + 1);
+    boost::optional<std::string> value = root.get_optional<std::string>(key);
+    if (value && !set_param(conf, param, *value)) {
+      fail(path + ": invalid value \"" + *value + "\" for " + param);
+    }
+  }
+
+  boost::optional<const pt::ptree &> timing = root.get_child_optional("ExtMem.Timing.<xmlattr>");
+  if (timing) {
+    if (timing->get("type", "") == "sdram") {
+      conf.latency = timing->get("tRCD", 2U) + timing->get("tCAS", 3U);
+    }
+    conf.latency = timing->get("latency", conf.latency);
+    conf.word_cycles = timing->get("wordCycles", conf.word_cycles);
+  }
+}
+
+struct CoreCaches {
+  MethodCacheModel mc;
+  DataCacheModel ic;
+  DataCacheModel dc;
+  WriteCombineModel wc;
+  StackCacheModel sc;
+
+  CoreCaches(const CacheConfig &conf)
+    : mc(conf.icache_size, conf.icache_assoc),
+      ic(conf.icache_size, 1, conf.burst_length * 4, true),
+      dc(conf.dcache_size, conf.dcache_assoc > 0 ? conf.dcache_assoc : 1,
+         conf.burst_length * 4, conf.dcache_write_through),
+      wc(conf.burst_length * 4),
+      sc(conf.scache_size, conf.burst_length * 4) {}
+};
+
+// Replay the trace through the caches of one configuration
+static void simulate(const char *path, const CacheConfig &conf, CacheStats &stats)
+{
+  MemTraceReader reader;
+  const char *msg = reader.open(path);
+  if (msg != NULL) {
+    fail(std::string(path) + ": " + msg);
+  }
+
+  std::vector<CoreCaches *> cores;
+  memset(&stats, 0, sizeof(stats));
+  const unsigned burst = conf.burst_length;
+  const bool method_cache = conf.icache_type == "method";
+  const bool write_through = conf.dcache_write_through || conf.dcache_size == 0;
+  // Words transferred from or to the memory, and the transfers
+  unsigned long long words = 0, transfers = 0;
+
+  MemTraceRecord rec;
+  while (reader.next(rec)) {
+    while (cores.size() <= rec.core) {
+      cores.push_back(new CoreCaches(conf));
+    }
+    CoreCaches &c = *cores[rec.core];
+    bool write_back = false;
+
+    switch (rec.kind) {
+    case MEMTRACE_METHOD:
+      if (conf.icache_size == 0 || rec.addr < METHOD_CACHE_START) {
+        break;
+      }
+      if (method_cache) {
+        uint32_t w = c.mc.request(rec.addr, rec.size);
+        if (w > 0) {
+          // The size is fetched with a burst of its own
+          words += burst + (w + burst - 1) / burst * burst;
+          transfers += 1 + (w + burst - 1) / burst;
+        }
+      } else {
+        for (uint32_t a = rec.addr; a < rec.addr + rec.size; a += burst * 4) {
+          if (c.ic.read(a, write_back)) {
+            words += burst;
+            transfers++;
+          }
+        }
+      }
+      break;
+
+    case MEMTRACE_READ:
+      if (rec.space == MEMTRACE_DATA && conf.dcache_size > 0) {
+        if (c.dc.read(rec.addr, write_back)) {
+          words += burst;
+          transfers++;
+        }
+      } else if (rec.space == MEMTRACE_DATA || rec.space == MEMTRACE_UNCACHED) {
+        words++;
+        transfers++;
+      }
+      break;
+
+    case MEMTRACE_WRITE:
+      if (rec.space == MEMTRACE_STACK || rec.space == MEMTRACE_LOCAL) {
+        break;
+      }
+      if (rec.space == MEMTRACE_DATA && conf.dcache_size > 0
+          && c.dc.write(rec.addr, write_back)) {
+        words += burst;
+        transfers++;
+      }
+      if (rec.space == MEMTRACE_UNCACHED || write_through) {
+        if (!conf.write_combine) {
+          words++;
+          transfers++;
+        } else if (c.wc.write(rec.addr)) {
+          words += burst;
+          transfers++;
+        }
+      }
+      break;
+
+    case MEMTRACE_STACK_OP: {
+      if (conf.scache_size == 0) {
+        break;
+      }
+      uint32_t b = 0;
+      switch (rec.space) {
+      case MEMTRACE_SC_SET_ST: c.sc.set_stack_top(rec.addr); break;
+      case MEMTRACE_SC_SET_MT: c.sc.set_mem_top(rec.addr); break;
+      case MEMTRACE_SC_RES: b = c.sc.reserve(rec.addr); break;
+      case MEMTRACE_SC_ENS: b = c.sc.ensure(rec.addr); break;
+      case MEMTRACE_SC_FREE: c.sc.free(rec.addr); break;
+      case MEMTRACE_SC_SPILL: b = c.sc.spill(rec.addr); break;
+      }
+      words += b * burst;
+      transfers += b;
+      break;
+    }
+    }
+
+    if (write_back) {
+      words += burst;
+      transfers++;
+    }
+    stats.cycles = rec.cycle;
+  }
+  if (reader.failed()) {
+    fail(std::string(path) + ": trace is corrupt");
+  }
+
+  for (size_t i = 0; i < cores.size(); i++) {
+    CoreCaches &c = *cores[i];
+    if (method_cache) {
+      stats.ic_hits += c.mc.hits;
+      stats.ic_misses += c.mc.misses;
+    } else {
+      stats.ic_hits += c.ic.hits;
+      stats.ic_misses += c.ic.misses;
+    }
+    stats.dc_hits += c.dc.hits;
+    stats.dc_misses += c.dc.misses;
+    stats.dc_write_backs += c.dc.write_backs;
+    stats.wc_hits += c.wc.hits;
+    stats.wc_misses += c.wc.misses;
+    stats.sc_spills += c.sc.spills;
+    stats.sc_fills += c.sc.fills;
+    delete cores[i];
+  }
+  stats.words = words;
+  stats.stall_cycles = transfers * conf.latency + words * conf.word_cycles;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned threads = std::thread::hardware_concurrency();
+  std::vector<std::pair<std::string, std::vector<std::string> > > sweeps;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:s:")) != -1) {
+    switch (opt) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 's': {
+      std::string spec = optarg;
+      size_t eq = spec.find('=');
+      if (eq == std::string::npos) {
+        fail("invalid parameter variation \"" + spec + "\"");
+      }
+      std::vector<std::string> values;
+      size_t start = eq + 1;
+      for (;;) {
+        size_t comma = spec.find(',', start);
+        values.push_back(spec.substr(start, comma - start));
+        if (comma == std::string::npos) {
+          break;
+        }
+        start = comma + 1;
+      }
+      sweeps.push_back(make_pair(spec.substr(0, eq), values));
+      break;
+    }
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind < 2) {
+    usage(argv[0]);
+    return 2;
+  }
+  const char *trace = argv[optind];
+  if (threads == 0) {
+    threads = 1;
+  }
+
+  // All combinations of the configuration files and the variations
+  std::vector<CacheConfig> configs;
+  for (int i = optind + 1; i < argc; i++) {
+    CacheConfig base = CacheConfig();
+    base.latency = SRAM_CYCLES;
+    base.word_cycles = 1;
+    load_config(base, argv[i]);
+    std::string file = argv[i];
+    base.name = file.substr(file.find_last_of('/') + 1);
+
+    std::vector<CacheConfig> variants(1, base);
+    for (size_t s = 0; s < sweeps.size(); s++) {
+      std::vector<CacheConfig> next;
+      for (size_t v = 0; v < variants.size(); v++) {
+        for (size_t k = 0; k < sweeps[s].second.size(); k++) {
+          CacheConfig conf = variants[v];
+          const std::string &value = sweeps[s].second[k];
+          if (!set_param(conf, sweeps[s].first, value)) {
+            fail("invalid parameter or value \"" + sweeps[s].first + "=" + value + "\"");
+          }
+          conf.name += (s == 0 ? ":" : ",") + sweeps[s].first + "=" + value;
+          next.push_back(conf);
+        }
+      }
+      variants.swap(next);
+    }
+    configs.insert(configs.end(), variants.begin(), variants.end());
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<CacheStats> results(configs.size());
+  std::atomic<size_t> next_config(0);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads && t < configs.size(); t++) {
+    workers.push_back(std::thread([&]() {
+      for (size_t i = next_config++; i < configs.size(); i = next_config++) {
+        simulate(trace, configs[i], results[i]);
+      }
+    }));
+  }
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+  printf("config ic_hits ic_misses dc_hits dc_misses dc_write_backs"
+         " wc_hits wc_misses sc_spills sc_fills words stall_cycles\n");
+  for (size_t i = 0; i < configs.size(); i++) {
+    const CacheStats &s = results[i];
+    printf("%s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n",
+           configs[i].name.c_str(), s.ic_hits, s.ic_misses, s.dc_hits,
+           s.dc_misses, s.dc_write_backs, s.wc_hits, s.wc_misses,
+           s.sc_spills, s.sc_fills, s.words, s.stall_cycles);
+  }
+  fprintf(stderr, "%zu configurations over %llu cycles in %g s on %zu threads\n",
+          configs.size(), results.empty() ? 0ULL : (unsigned long long)results[0].cycles,
+          secs.count(), workers.size());
+  return 0;
+}
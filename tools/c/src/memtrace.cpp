@@ -0,0 +1,128 @@
+/*
+   Reader for the binary memory access traces of the emulator (patemu -M).
+
+   memtrace dump <trace>     print one line per record
+   memtrace stat <trace>     print the number of records per core and kind
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+
+#include "memtrace.h"
+
+static const char *space_names[] = { "stack", "local", "data", "uncached" };
+static const char *sc_op_names[] = { "none", "setst", "setmt", "sres",
+                                     "sens", "sfree", "sspill", "?" };
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s dump <trace> | stat <trace>\n", name);
+}
+
+static void open_trace(MemTraceReader &reader, const char *path)
+{
+  const char *msg = reader.open(path);
+  if (msg != NULL) {
+    fprintf(stderr, "memtrace: error: %s: %s\n", path, msg);
+    exit(2);
+  }
+}
+
+static void check_trace(MemTraceReader &reader, const char *path)
+{
+  if (reader.failed()) {
+    fprintf(stderr, "memtrace: error: %s: trace is corrupt\n", path);
+    exit(2);
+  }
+}
+
+static int cmd_dump(const char *path)
+{
+  MemTraceReader reader;
+  open_trace(reader, path);
+
+  MemTraceRecord rec;
+  while (reader.next(rec)) {
+    printf("%llu %u ", (unsigned long long)rec.cycle, rec.core);
+    switch (rec.kind) {
+    case MEMTRACE_READ:
+    case MEMTRACE_WRITE:
+      printf("%s %s %u %#x\n", rec.kind == MEMTRACE_READ ? "rd" : "wr",
+             space_names[rec.space], rec.size, rec.addr);
+      break;
+    case MEMTRACE_METHOD:
+      printf("method %#x %u\n", rec.addr, rec.size);
+      break;
+    default:
+      printf("%s %u\n", sc_op_names[rec.space], rec.addr);
+      break;
+    }
+  }
+  check_trace(reader, path);
+  return 0;
+}
+
+static int cmd_stat(const char *path)
+{
+  MemTraceReader reader;
+  open_trace(reader, path);
+
+  // Reads and writes per address space, method requests, stack operations
+  enum { COLUMNS = 10 };
+  std::map<unsigned, unsigned long long[COLUMNS]> counts;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  MemTraceRecord rec;
+  unsigned long long total = 0;
+  uint64_t cycles = 0;
+  while (reader.next(rec)) {
+    unsigned long long *c = counts[rec.core];
+    if (rec.kind == MEMTRACE_READ || rec.kind == MEMTRACE_WRITE) {
+      c[rec.kind * 4 + rec.space]++;
+    } else {
+      c[rec.kind + 6]++;
+    }
+    cycles = rec.cycle;
+    total++;
+  }
+  check_trace(reader, path);
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+  printf("core");
+  for (unsigned k = 0; k < 2; k++) {
+    for (unsigned s = 0; s < 4; s++) {
+      printf(" %s_%s", k == 0 ? "rd" : "wr", space_names[s]);
+    }
+  }
+  printf(" methods stack_ops\n");
+  for (std::map<unsigned, unsigned long long[COLUMNS]>::iterator it = counts.begin();
+       it != counts.end(); ++it) {
+    printf("%u", it->first);
+    for (unsigned i = 0; i < COLUMNS; i++) {
+      printf(" %llu", it->second[i]);
+    }
+    printf("\n");
+  }
+
+  printf("%llu records up to cycle %llu, read in %g s", total,
+         (unsigned long long)cycles, secs.count());
+  if (secs.count() > 0) {
+    printf(", %g records/s", total / secs.count());
+  }
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+    return cmd_dump(argv[2]);
+  } else if (argc == 3 && strcmp(argv[1], "stat") == 0) {
+    return cmd_stat(argv[2]);
+  }
+  usage(argv[0]);
+  return 2;
+}
@@ -0,0 +1,129 @@
+/*
+   Reader for the binary register traces of the emulator (patemu -E).
+
+   regtrace dump <trace>     print the trace in the format of patemu -r
+   regtrace diff <a> <b>     compare two traces, report the first difference
+   regtrace stat <trace>     print the number of records and the decode speed
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "regtrace.h"
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s dump <trace> | diff <trace1> <trace2> | stat <trace>\n",
+          name);
+}
+
+static void open_trace(RegTraceReader &reader, const char *path)
+{
+  const char *msg = reader.open(path);
+  if (msg != NULL) {
+    fprintf(stderr, "regtrace: error: %s: %s\n", path, msg);
+    exit(2);
+  }
+}
+
+static void check_trace(RegTraceReader &reader, const char *path)
+{
+  if (reader.failed()) {
+    fprintf(stderr, "regtrace: error: %s: trace is corrupt\n", path);
+    exit(2);
+  }
+}
+
+static int cmd_dump(const char *path)
+{
+  RegTraceReader reader;
+  open_trace(reader, path);
+
+  RegTraceRecord rec;
+  while (reader.next(rec)) {
+    printf("%u - ", rec.pc);
+    for (unsigned i = 0; i < REGTRACE_REGS; i++) {
+      printf("%u ", rec.regs[i]);
+    }
+    printf("\n");
+  }
+  check_trace(reader, path);
+  return 0;
+}
+
+static int cmd_diff(const char *path1, const char *path2)
+{
+  RegTraceReader reader1, reader2;
+  open_trace(reader1, path1);
+  open_trace(reader2, path2);
+
+  RegTraceRecord rec1, rec2;
+  unsigned long long index = 0;
+  for (;;) {
+    bool more1 = reader1.next(rec1);
+    bool more2 = reader2.next(rec2);
+    check_trace(reader1, path1);
+    check_trace(reader2, path2);
+
+    if (!more1 || !more2) {
+      if (more1 != more2) {
+        printf("%s ends after %llu records\n", more1 ? path2 : path1, index);
+        return 1;
+      }
+      break;
+    }
+
+    if (rec1.pc != rec2.pc
+        || memcmp(rec1.regs, rec2.regs, sizeof(rec1.regs)) != 0) {
+      printf("traces differ in record %llu\n", index);
+      printf("pc: %#x %#x\n", rec1.pc, rec2.pc);
+      for (unsigned i = 0; i < REGTRACE_REGS; i++) {
+        if (rec1.regs[i] != rec2.regs[i]) {
+          printf("r%u: %#x %#x\n", i, rec1.regs[i], rec2.regs[i]);
+        }
+      }
+      return 1;
+    }
+    index++;
+  }
+
+  printf("traces are equal, %llu records\n", index);
+  return 0;
+}
+
+static int cmd_stat(const char *path)
+{
+  RegTraceReader reader;
+  open_trace(reader, path);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  RegTraceRecord rec;
+  unsigned long long count = 0;
+  while (reader.next(rec)) {
+    count++;
+  }
+  check_trace(reader, path);
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+  printf("%llu records in %g s", count, secs.count());
+  if (secs.count() > 0) {
+    printf(", %g records/s", count / secs.count());
+  }
+  printf("\n");
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+    return cmd_dump(argv[2]);
+  } else if (argc == 4 && strcmp(argv[1], "diff") == 0) {
+    return cmd_diff(argv[2], argv[3]);
+  } else if (argc == 3 && strcmp(argv[1], "stat") == 0) {
+    return cmd_stat(argv[2]);
+  }
+  usage(argv[0]);
+  return 2;
+}
@@ -0,0 +1,387 @@
+/*
+   Trace-driven simulation of the stack cache.
+
+   Author: Martin Schoeberl (martin@jopdesign.com)
+
+   By LLVM/Patmos convention the stack grows towards lower addresses.
+   Therefore the top of stack (cache or memory) is the smallest address.
+
+   stacksim [options] <trace>      replay the stack cache operations of a
+                                   memory access trace (patemu -M)
+   stacksim [options] -g <elf>     derive the operations from the call
+                                   graph of a program
+
+   Options:
+     -s <size>,...     stack cache sizes in bytes, with an optional K
+                       suffix (default 2k)
+     -b <words>,...    sizes of the blocks that are spilled and filled, in
+                       words (default 4, the burst length)
+     -l <cycles>       latency of the memory for each block (default 3)
+     -e <elf>          name the functions of a trace after the symbols of
+                       a program
+     -n <count>        number of functions to print (default 20)
+
+   Each combination of size and block size is simulated, and the spill and
+   fill traffic is reported in words and cycles, in total and for the
+   functions that caused most of it. A block costs the latency plus one
+   cycle per word. In traces, operations belong to the method that was
+   requested from the method cache last.
+
+   With -g, each function executes its sres, sens, sfree and sspill
+   instructions in address order and runs each function it calls, once
+   per call site. Branches and loops are ignored, recursion stops at the
+   first repetition and operations with register operands are skipped.
+   This estimates one pass through the call tree, not a profile.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gelf.h>
+#include <libelf.h>
+
+#include "memtrace.h"
+#include "cachemodel.h"
+
+// Stack and memory top of programs from -g, anything far from zero
+#define STACK_START 0x80000000U
+
+// Limit of the operations from -g, as call trees grow exponentially
+#define MAX_OPS 10000000
+
+// Fields of Patmos instructions
+#define OPC_STC 0x0c
+#define OPC_CALLND 0x10
+#define OPC_CALL 0x11
+#define STC_SRES 0x0
+#define STC_SENS 0x4
+#define STC_SFREE 0x8
+#define STC_SSPILL 0xc
+
+struct StackOp {
+  unsigned core;
+  unsigned op;
+  uint32_t n;
+  // Function the operation belongs to
+  uint32_t func;
+};
+
+struct FuncStats {
+  unsigned long long spill_words;
+  unsigned long long fill_words;
+  unsigned long long cycles;
+};
+
+struct Program {
+  // Functions by start address, with name and size
+  std::map<uint32_t, std::pair<std::string, uint32_t> > funcs;
+  // Executable sections by start address
+  std::map<uint32_t, std::vector<uint8_t> > code;
+  uint32_t entry;
+};
+
+static void fail(const std::string &msg)
+{
+  fprintf(stderr, "stacksim: error: %s\n", msg.c_str());
+  exit(2);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-s <size>,...] [-b <words>,...] [-l <cycles>] "
+          "[-e <elf>] [-n <count>] <trace> | -g <elf>\n", name);
+}
+
+static std::vector<uint32_t> parse_list(const char *text, bool sizes)
+{
+  std::vector<uint32_t> list;
+  const char *p = text;
+  for (;;) {
+    char *end;
+    unsigned long v = strtoul(p, &end, 10);
+    if (end == p) {
+      fail(std::string("invalid list \"") + text + "\"");
+    }
+    if (sizes && (*end == 'k' || *end == 'K')) {
+      v <<= 10;
+      end++;
+    }
+    if (v == 0) {
+      fail(std::string("invalid list \"") + text + "\"");
+    }
+    list.push_back(v);
+    if (*end != ',') {
+      if (*end != '\0') {
+        fail(std::string("invalid list \"") + text + "\"");
+      }
+      return list;
+    }
+    p = end + 1;
+  }
+}
+
+static void load_elf(Program &prog, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fail(std::string(path) + ": cannot open file");
+  }
+  elf_version(EV_CURRENT);
+  Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
+  GElf_Ehdr hdr;
+  if (elf == NULL || elf_kind(elf) != ELF_K_ELF || gelf_getehdr(elf, &hdr) == NULL) {
+    fail(std::string(path) + ": not an ELF file");
+  }
+  prog.entry = hdr.e_entry;
+
+  Elf_Scn *scn = NULL;
+  while ((scn = elf_nextscn(elf, scn)) != NULL) {
+    GElf_Shdr shdr;
+    gelf_getshdr(scn, &shdr);
+    Elf_Data *data = elf_getdata(scn, NULL);
+    if (data == NULL) {
+      continue;
+    }
+    if (shdr.sh_type == SHT_SYMTAB) {
+      for (size_t i = 0; i < shdr.sh_size / shdr.sh_entsize; i++) {
+        GElf_Sym sym;
+        gelf_getsym(data, i, &sym);
+        if (GELF_ST_TYPE(sym.st_info) == STT_FUNC && sym.st_size > 0) {
+          const char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+          prog.funcs[sym.st_value] = make_pair(std::string(name ? name : "?"),
+                                               (uint32_t)sym.st_size);
+        }
+      }
+    } else if (shdr.sh_type == SHT_PROGBITS && (shdr.sh_flags & SHF_EXECINSTR)) {
+      const uint8_t *bytes = (const uint8_t *)data->d_buf;
+      prog.code[shdr.sh_addr].assign(bytes, bytes + data->d_size);
+    }
+  }
+  elf_end(elf);
+  close(fd);
+}
+
+// Start of the function that contains <addr>, or <addr> itself
+static uint32_t find_func(const Program &prog, uint32_t addr)
+{
+  std::map<uint32_t, std::pair<std::string, uint32_t> >::const_iterator it =
+    prog.funcs.upper_bound(addr);
+  if (it == prog.funcs.begin()) {
+    return addr;
+  }
+  --it;
+  return addr - it->first < it->second.second ? it->first : addr;
+}
+
+static std::string func_name(const Program &prog, uint32_t addr)
+{
+  std::map<uint32_t, std::pair<std::string, uint32_t> >::const_iterator it =
+    prog.funcs.find(addr);
+  if (it != prog.funcs.end()) {
+    return it->second.first;
+  }
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%#x", addr);
+  return buf;
+}
+
+// Read a big-endian word of code, returns false outside the code
+static bool read_code(const Program &prog, uint32_t addr, uint32_t &word)
+{
+  std::map<uint32_t, std::vector<uint8_t> >::const_iterator it =
+    prog.code.upper_bound(addr);
+  if (it == prog.code.begin()) {
+    return false;
+  }
+  --it;
+  uint32_t off = addr - it->first;
+  if (off + 4 > it->second.size()) {
+    return false;
+  }
+  const uint8_t *p = &it->second[off];
+  word = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+  return true;
+}
+
+static void load_trace(std::vector<StackOp> &ops, const Program &prog,
+                       const char *path)
+{
+  MemTraceReader reader;
+  const char *msg = reader.open(path);
+  if (msg != NULL) {
+    fail(std::string(path) + ": " + msg);
+  }
+  std::vector<uint32_t> method;
+  MemTraceRecord rec;
+  while (reader.next(rec)) {
+    if (rec.core >= method.size()) {
+      method.resize(rec.core + 1, 0);
+    }
+    if (rec.kind == MEMTRACE_METHOD) {
+      method[rec.core] = find_func(prog, rec.addr);
+    } else if (rec.kind == MEMTRACE_STACK_OP) {
+      StackOp op = { rec.core, rec.space, rec.addr, method[rec.core] };
+      ops.push_back(op);
+    }
+  }
+  if (reader.failed()) {
+    fail(std::string(path) + ": trace is corrupt");
+  }
+}
+
+// Run the stack cache operations of a function and the functions it calls
+static void walk_func(std::vector<StackOp> &ops, const Program &prog,
+                      uint32_t func, std::set<uint32_t> &active)
+{
+  std::map<uint32_t, std::pair<std::string, uint32_t> >::const_iterator it =
+    prog.funcs.find(func);
+  if (it == prog.funcs.end() || active.count(func)) {
+    return;
+  }
+  active.insert(func);
+  uint32_t end = func + it->second.second;
+  uint32_t instr;
+  for (uint32_t pc = func; pc < end && ops.size() < MAX_OPS && read_code(prog, pc, instr);
+       pc += (instr >> 31) ? 8 : 4) {
+    // Stack cache and call instructions are only in the first slot
+    unsigned opcode = (instr >> 22) & 0x1f;
+    if (opcode == OPC_STC) {
+      unsigned fun = (instr >> 18) & 0xf;
+      StackOp op = { 0, 0, (instr & 0x3ffff) << 2, func };
+      switch (fun) {
+      case STC_SRES: op.op = MEMTRACE_SC_RES; break;
+      case STC_SENS: op.op = MEMTRACE_SC_ENS; break;
+      case STC_SFREE: op.op = MEMTRACE_SC_FREE; break;
+      case STC_SSPILL: op.op = MEMTRACE_SC_SPILL; break;
+      default: continue;
+      }
+      ops.push_back(op);
+    } else if (opcode == OPC_CALL || opcode == OPC_CALLND) {
+      walk_func(ops, prog, (instr & 0x3fffff) << 2, active);
+    }
+  }
+  active.erase(func);
+}
+
+static void load_call_graph(std::vector<StackOp> &ops, const Program &prog)
+{
+  StackOp st = { 0, MEMTRACE_SC_SET_ST, STACK_START, 0 };
+  StackOp mt = { 0, MEMTRACE_SC_SET_MT, STACK_START, 0 };
+  ops.push_back(st);
+  ops.push_back(mt);
+  std::set<uint32_t> active;
+  walk_func(ops, prog, find_func(prog, prog.entry), active);
+  if (ops.size() >= MAX_OPS) {
+    fprintf(stderr, "stacksim: warning: call tree cut after %d operations\n", MAX_OPS);
+  }
+}
+
+static bool by_cycles(const std::pair<uint32_t, FuncStats> &a,
+                      const std::pair<uint32_t, FuncStats> &b)
+{
+  return a.second.cycles > b.second.cycles;
+}
+
+static void simulate(const std::vector<StackOp> &ops, const Program &prog,
+                     uint32_t size, uint32_t block, unsigned latency,
+                     unsigned count)
+{
+  std::vector<StackCacheModel> cores;
+  std::map<uint32_t, FuncStats> funcs;
+  FuncStats total = { 0, 0, 0 };
+
+  for (size_t i = 0; i < ops.size(); i++) {
+    const StackOp &op = ops[i];
+    while (cores.size() <= op.core) {
+      cores.push_back(StackCacheModel(size, block * 4));
+    }
+    StackCacheModel &sc = cores[op.core];
+    uint32_t spilled = 0, filled = 0;
+    switch (op.op) {
+    case MEMTRACE_SC_SET_ST: sc.set_stack_top(op.n); break;
+    case MEMTRACE_SC_SET_MT: sc.set_mem_top(op.n); break;
+    case MEMTRACE_SC_RES: spilled = sc.reserve(op.n); break;
+    case MEMTRACE_SC_ENS: filled = sc.ensure(op.n); break;
+    case MEMTRACE_SC_FREE: sc.free(op.n); break;
+    case MEMTRACE_SC_SPILL: spilled = sc.spill(op.n); break;
+    }
+    if (spilled + filled > 0) {
+      FuncStats &f = funcs[op.func];
+      f.spill_words += spilled * block;
+      f.fill_words += filled * block;
+      f.cycles += (spilled + filled) * (latency + block);
+      total.spill_words += spilled * block;
+      total.fill_words += filled * block;
+      total.cycles += (spilled + filled) * (latency + block);
+    }
+  }
+
+  printf("size %u, blocks of %u words: %llu words spilled, %llu words filled, %llu cycles\n",
+         size, block, total.spill_words, total.fill_words, total.cycles);
+  std::vector<std::pair<uint32_t, FuncStats> > sorted(funcs.begin(), funcs.end());
+  std::sort(sorted.begin(), sorted.end(), by_cycles);
+  if (!sorted.empty() && count > 0) {
+    printf("  %-32s %10s %10s %12s\n", "function", "spilled", "filled", "cycles");
+  }
+  for (size_t i = 0; i < sorted.size() && i < count; i++) {
+    printf("  %-32s %10llu %10llu %12llu\n", func_name(prog, sorted[i].first).c_str(),
+           sorted[i].second.spill_words, sorted[i].second.fill_words,
+           sorted[i].second.cycles);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  std::vector<uint32_t> sizes(1, 2048);
+  std::vector<uint32_t> blocks(1, 4);
+  unsigned latency = 3;
+  unsigned count = 20;
+  const char *elf_path = NULL;
+  bool graph = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:b:l:e:n:g")) != -1) {
+    switch (opt) {
+    case 's': sizes = parse_list(optarg, true); break;
+    case 'b': blocks = parse_list(optarg, false); break;
+    case 'l': latency = atoi(optarg); break;
+    case 'e': elf_path = optarg; break;
+    case 'n': count = atoi(optarg); break;
+    case 'g': graph = true; break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind != 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  Program prog;
+  std::vector<StackOp> ops;
+  if (graph) {
+    load_elf(prog, argv[optind]);
+    load_call_graph(ops, prog);
+  } else {
+    if (elf_path != NULL) {
+      load_elf(prog, elf_path);
+    }
+    load_trace(ops, prog, argv[optind]);
+  }
+
+  for (size_t s = 0; s < sizes.size(); s++) {
+    for (size_t b = 0; b < blocks.size(); b++) {
+      simulate(ops, prog, sizes[s], blocks[b], latency, count);
+    }
+  }
+  return 0;
+}